@@ -1,6 +1,15 @@
 #include "reloc/reloc_pool.hpp"
 #include "reloc/reloc_ptr.hpp"
 #include "reloc/pinned_ptr.hpp"
+#include "reloc/trace.hpp"
+#include "reloc/snapshot.hpp"
+#include "reloc/region_pool.hpp"
+#include "reloc/mapped_pool.hpp"
+#include "reloc/shared_pool.hpp"
+#include "reloc/overflow_allocator.hpp"
+#include <sys/wait.h>
+#include <cstring>
+#include <new>
 
 using namespace reloc;
 
@@ -284,6 +293,589 @@ void test9() {
     delete[] p;
 }
 
+void test10() {
+    uint8* p = new uint8[100];
+
+    trace_buffer buf(4);
+    {
+        trace_buffer::scope scope(buf);
+        reloc_pool<1, std_traits, trace_observer> pool(p, 100);
+        reloc_ptr p1 = pool.allocate(40);
+        reloc_ptr p2 = pool.allocate(10);
+        reloc_ptr p3 = pool.allocate(40);
+        pinned_ptr pin = p3.pin();
+        pool.deallocate(p1);
+        // p3 がピンされているので、p2 を動かしても 50 バイトは確保できない
+        reloc_ptr p4 = pool.allocate(50);
+        assert(!p4);
+        pin.reset();
+        pool.deallocate(p2);
+        pool.deallocate(p3);
+    }
+    // リングバッファなので最後の 4 つだけが残っている
+    assert(buf.size() == 4);
+    assert(buf.dropped() == 6);
+    assert(buf[0].type == trace_relocation_end && buf[0].id == 0 && buf[0].size == 50);
+    assert(buf[1].type == trace_allocate && buf[1].id == 0 && buf[1].size == 50);
+    assert(buf[2].type == trace_deallocate && buf[2].size == 10);
+    assert(buf[3].type == trace_deallocate && buf[3].size == 40);
+    assert(buf[0].time <= buf[3].time);
+
+    // バイナリに書き出して読み込み、別のプールで再現する
+    trace_buffer buf2(100);
+    {
+        trace_buffer::scope scope(buf2);
+        reloc_pool<1, std_traits, trace_observer> pool(p, 100);
+        reloc_ptr p1 = pool.allocate(30);
+        reloc_ptr p2 = pool.allocate(30);
+        pool.deallocate(p1);
+        reloc_ptr p3 = pool.reallocate(p2, 60);
+        pool.deallocate(p3);
+    }
+    std::FILE* fp = std::tmpfile();
+    assert(buf2.dump(fp));
+    std::rewind(fp);
+    std::vector<trace_event> events;
+    assert(load_trace(fp, events));
+    std::fclose(fp);
+    assert(events.size() == 5);
+    assert(events[3].type == trace_reallocate && events[3].prev_size == 30 && events[3].size == 60);
+
+    reloc_pool<1> pool(p, 100);
+    assert(replay_trace(pool, &events[0], &events[0] + events.size()) == 0);
+    assert(pool.total_free() == 100);
+
+    delete[] p;
+}
+
+void test11() {
+    uint8* p = new uint8[100];
+
+    reloc_pool<1> pool(p, 100);
+    reloc_ptr p1 = pool.allocate(10);
+    reloc_ptr p2 = pool.allocate(20);
+    reloc_ptr p3 = pool.allocate(10);
+    reloc_ptr p4 = pool.allocate(30);
+    pool.deallocate(p1);
+    pool.deallocate(p3);
+    pinned_ptr pin = p2.pin();
+
+    std::FILE* fp = std::tmpfile();
+    assert(write_snapshot(pool, fp));
+    std::rewind(fp);
+    snapshot snap;
+    assert(load_snapshot(fp, snap));
+
+    // レコード数が壊れていても、その数を確保しようとせずに失敗する
+    {
+        const long count_offset = 8 + 8 + 8;
+        std::fseek(fp, count_offset, SEEK_SET);
+        const uint64_t huge = static_cast<uint64_t>(1) << 60;
+        assert(std::fwrite(&huge, sizeof(huge), 1, fp) == 1);
+        std::rewind(fp);
+        snapshot broken;
+        assert(!load_snapshot(fp, broken));
+    }
+    std::fclose(fp);
+
+    // free(10) pinned(20) free(10) alloc(30) free(30)
+    assert(snap.size == 100);
+    assert(snap.blocks.size() == 5);
+    assert(snap.blocks[0].kind == snapshot_free && snap.blocks[0].size == 10);
+    assert(snap.blocks[1].kind == snapshot_pinned && snap.blocks[1].offset == 10);
+    assert(snap.blocks[3].kind == snapshot_allocated && snap.blocks[3].offset == 40);
+    assert(snap.blocks[4].kind == snapshot_free && snap.blocks[4].size == 30);
+
+    const snapshot_metrics m = compute_metrics(snap);
+    assert(m.total_free == 50);
+    assert(m.largest_free == 30);
+    assert(m.free_blocks == 3);
+    assert(m.pinned_blocks == 1);
+    assert(m.islands == 2);
+    assert(m.max_relocatable == 40);
+    assert(m.external_fragmentation > 39.9 && m.external_fragmentation < 40.1);
+
+    pin.reset();
+    pool.deallocate(p2);
+    pool.deallocate(p4);
+
+    delete[] p;
+}
+
+void test12() {
+    uint8* p = new uint8[1000];
+
+    reloc_pool<4> pool(p, 1000);
+    // 操作毎には近傍だけを、7 回毎に全体をチェックする
+    pool.set_validation(validate_local, 7);
+
+    reloc_ptr ptrs[20];
+    for (int i = 0; i < 20; i++) {
+        ptrs[i] = pool.allocate(10 + i);
+    }
+    pinned_ptr pin = ptrs[10].pin();
+    for (int i = 0; i < 20; i += 2) {
+        if (i != 10) pool.deallocate(ptrs[i]);
+    }
+    for (int i = 1; i < 20; i += 2) {
+        ptrs[i] = pool.reallocate(ptrs[i], 30 - i);
+    }
+    // 断片化しているのでリロケーションが起きる
+    reloc_ptr big = pool.allocate(pool.max_free() + 4);
+    assert(big);
+    assert(pool.check());
+
+    pool.deallocate(big);
+    pin.reset();
+    pool.deallocate(ptrs[10]);
+    for (int i = 1; i < 20; i += 2) {
+        pool.deallocate(ptrs[i]);
+    }
+    assert(pool.check());
+    assert(pool.total_free() == pool.size());
+
+    delete[] p;
+}
+
+void test13() {
+    const std::size_t size = 4096;
+    uint64_t* mem = new uint64_t[size / 8];
+    uint64_t* mem2 = new uint64_t[size / 8];
+
+    {
+        region_pool<16> pool;
+        assert(pool.create(mem, size, 8));
+        region_ptr handles[8];
+        for (int i = 0; i < 8; i++) {
+            handles[i] = pool.allocate(100);
+            assert(handles[i]);
+            std::memset(pool.pin(handles[i]).get(), i, 100);
+        }
+        // ブロックの最大数を超えた
+        assert(!pool.allocate(1));
+
+        // 断片化させて、ピンされたブロック越しにリロケーションさせる
+        region_pinned_ptr pin = pool.pin(handles[3]);
+        void* const pinned_addr = pin.get();
+        for (int i = 0; i < 8; i += 2) {
+            pool.deallocate(handles[i]);
+        }
+        const std::size_t big = pool.total_free() - pool.max_free();
+        region_ptr p = pool.allocate(big);
+        assert(p);
+        assert(pin.get() == pinned_addr);
+        pin.reset();
+        assert(static_cast<uint8*>(pool.pin(handles[5]).get())[99] == 5);
+
+        handles[5] = pool.reallocate(handles[5], 200);
+        assert(pool.size(handles[5]) == 208);
+        assert(static_cast<uint8*>(pool.pin(handles[5]).get())[99] == 5);
+        pool.deallocate(p);
+        pool.set_root(0, handles[5]);
+        assert(pool.check());
+    }
+
+    // 別のアドレスへコピーしても再開できる
+    std::memcpy(mem2, mem, size);
+    std::memset(mem, 0, size);
+    {
+        region_pool<16> pool;
+        assert(!pool.attach(mem, size));
+        assert(pool.attach(mem2, size));
+        assert(pool.count() == 4);
+        region_ptr p = pool.root(0);
+        assert(static_cast<uint8*>(pool.pin(p).get())[0] == 5);
+        // アライメントが違うものは開けない
+        region_pool<32> pool2;
+        assert(!pool2.attach(mem2, size));
+    }
+
+    // 管理データが壊れているものは開けない
+    {
+        detail::region_header* const h = reinterpret_cast<detail::region_header*>(mem2);
+        const detail::region_header saved = *h;
+        region_pool<16> pool;
+        h->capacity = 1000;
+        assert(!pool.attach(mem2, size));
+        *h = saved;
+        h->nodes += 16;
+        assert(!pool.attach(mem2, size));
+        *h = saved;
+        h->data_size = ~static_cast<uint64_t>(0) - h->data + 16 + 1;
+        assert(!pool.attach(mem2, size));
+        *h = saved;
+        h->roots[1] = 9;
+        assert(!pool.attach(mem2, size));
+        *h = saved;
+        // ファイルが途中で切れている
+        assert(!pool.attach(mem2, size - 16));
+        assert(pool.attach(mem2, size));
+    }
+
+    delete[] mem;
+    delete[] mem2;
+}
+
+void test14() {
+    const char* path = "/tmp/reloc_test14.pool";
+    {
+        mapped_pool<16> pool;
+        assert(pool.create(path, 64 * 1024, 16));
+        region_ptr p = pool.allocate(6);
+        std::memcpy(pool.pin(p).get(), "hello", 6);
+        pool.set_root(0, p);
+        // ピンしたままプロセスが落ちたことにする。次に開いた時にピンが外れる
+        static char leaked[sizeof(region_pinned_ptr)];
+        new (leaked) region_pinned_ptr(pool.pin(p));
+        pool.close();
+    }
+    {
+        mapped_pool<16> pool;
+        assert(pool.open(path));
+        region_ptr p = pool.root(0);
+        assert(std::strcmp(static_cast<const char*>(pool.pin(p).get()), "hello") == 0);
+        // ピンが外れているので解放できる
+        pool.deallocate(p);
+        assert(pool.count() == 0);
+    }
+    std::remove(path);
+    mapped_pool<16> pool;
+    assert(!pool.open(path));
+}
+
+void test15() {
+    char name[64];
+    std::sprintf(name, "/reloc_test15_%d", (int)getpid());
+
+    shared_pool<16> pool;
+    assert(pool.create(name, 64 * 1024, 64));
+    region_ptr p = pool.allocate(100);
+    std::memset(pool.pin(p).get(), 0xab, 100);
+    pool.set_root(0, p);
+    // 他のプロセスがリロケーションしても動かない
+    region_pinned_ptr pin = pool.pin(p);
+    void* const addr = pin.get();
+
+    for (int n = 0; n < 2; n++) {
+        if (fork() == 0) {
+            shared_pool<16> child;
+            if (!child.open(name)) _exit(1);
+            region_ptr hs[10];
+            for (int i = 0; i < 10; i++) {
+                hs[i] = child.allocate(200 + i);
+                if (!hs[i]) _exit(2);
+                std::memset(child.pin(hs[i]).get(), n, 200);
+            }
+            for (int i = 0; i < 10; i += 2) {
+                child.deallocate(hs[i]);
+            }
+            child.relocate();
+            for (int i = 1; i < 10; i += 2) {
+                if (static_cast<uint8*>(child.pin(hs[i]).get())[199] != n) _exit(3);
+                if (i != 1) child.deallocate(hs[i]);
+            }
+            child.set_root(n + 1, hs[1]);
+            _exit(0);
+        }
+    }
+    for (int n = 0; n < 2; n++) {
+        int status;
+        wait(&status);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+    assert(pin.get() == addr);
+    assert(static_cast<uint8*>(pin.get())[99] == 0xab);
+    assert(pool.count() == 3);
+    assert(static_cast<uint8*>(pool.pin(pool.root(1)).get())[0] == 0);
+    assert(static_cast<uint8*>(pool.pin(pool.root(2)).get())[0] == 1);
+
+    // ロックを持ったまま子プロセスが死んでも、次の操作で回復する
+    if (fork() == 0) {
+        shared_pool<16> child;
+        if (!child.open(name)) _exit(1);
+        detail::region_header* h = static_cast<detail::region_header*>(child.region());
+        process_mutex::lock(h->lock);
+        _exit(0);
+    }
+    int status;
+    wait(&status);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    pool.relocate();
+    assert(!pool.broken());
+    assert(pool.check());
+
+    pool.deallocate(pool.root(1));
+    pool.deallocate(pool.root(2));
+    pin.reset();
+    pool.deallocate(p);
+    pool.close();
+    assert(shared_pool<16>::unlink(name));
+}
+
+void test16() {
+    char buf[1024];
+    reloc_pool<16> pool(buf, sizeof(buf));
+
+    // 連続した領域に順に確保される
+    const std::size_t sizes[] = { 10, 0, 33, 16 };
+    reloc_ptr ps[4];
+    assert(pool.allocate_batch(sizes, 4, ps));
+    const char* base = static_cast<const char*>(pool.base());
+    assert(ps[0].pin().get() == base);
+    assert(ps[1].pin().get() == base + 16);
+    assert(ps[2].pin().get() == base + 32);
+    assert(ps[3].pin().get() == base + 80);
+    assert(pool.total_free() == pool.size() - 96);
+
+    // 合計サイズが入る領域が無ければ何も確保しない
+    const std::size_t large[] = { 512, 512 };
+    reloc_ptr ls[2];
+    assert(!pool.allocate_batch(large, 2, ls));
+    assert(!ls[0] && !ls[1]);
+    assert(pool.total_free() == pool.size() - 96);
+
+    // 空き領域が足りていれば、リロケートして確保する
+    pool.deallocate(ps[0]);
+    pool.deallocate(ps[2]);
+    const std::size_t mid[] = { 480, 464 };
+    assert(pool.allocate_batch(mid, 2, ls));
+    assert(pool.total_free() == pool.size() - 32 - 944);
+    assert(pool.check());
+
+    pool.deallocate(ps[1]);
+    pool.deallocate(ps[3]);
+    pool.deallocate(ls[0]);
+    pool.deallocate(ls[1]);
+
+    // まとめて確保したブロックを 1 つおきに解放しても、空き領域のリストを広げずに済む
+    {
+        char buf2[1024];
+        reloc_pool<16> pool2(buf2, sizeof(buf2));
+        const std::size_t smalls[] = { 16, 16, 16, 16, 16, 16, 16, 16, 16, 16 };
+        reloc_ptr ss[10];
+        assert(pool2.allocate_batch(smalls, 10, ss));
+        for (int i = 0; i < 10; i += 2) pool2.deallocate(ss[i]);
+        assert(pool2.total_free() == pool2.size() - 80);
+        assert(pool2.check());
+        for (int i = 1; i < 10; i += 2) pool2.deallocate(ss[i]);
+    }
+}
+
+void test17() {
+    char buf[1024];
+    reloc_pool<16> pool(buf, sizeof(buf));
+
+    reloc_ptr ps[8];
+    for (int i = 0; i < 8; i++) {
+        ps[i] = pool.allocate(64);
+        std::memset(ps[i].pin().get(), i, 64);
+    }
+    pool.deallocate(ps[0]);
+    pool.deallocate(ps[2]);
+    pool.deallocate(ps[5]);
+    pool.deallocate(ps[7]);
+    assert(pool.max_free() == pool.size() - 448);
+
+    // ピンされたブロックの両側をそれぞれ詰める
+    {
+        const pinned_ptr pin = ps[4].pin();
+        pool.relocate();
+        assert(pin.get() == static_cast<const char*>(pool.base()) + 256);
+        assert(ps[1].pin().get() == pool.base());
+        assert(pool.max_free() == pool.size() - 384);
+        assert(pool.check());
+    }
+    // ピンが無ければ空き領域は 1 つになる
+    pool.relocate();
+    assert(pool.max_free() == pool.total_free());
+    assert(pool.check());
+    const int ns[] = { 1, 3, 4, 6 };
+    for (int i = 0; i < 4; i++) {
+        const char* p = static_cast<const char*>(ps[ns[i]].pin().get());
+        assert(p == static_cast<const char*>(pool.base()) + i * 64);
+        assert(p[0] == ns[i] && p[63] == ns[i]);
+        pool.deallocate(ps[ns[i]]);
+    }
+    // 何も無くても良い
+    pool.relocate();
+    assert(pool.total_free() == pool.size());
+}
+
+// capacity まで 256 バイトずつ広げる
+std::size_t grow_256(void* context, void* base, std::size_t size, std::size_t required) {
+    const std::size_t capacity = *static_cast<std::size_t*>(context);
+    std::size_t n = size;
+    while (n < capacity && n - size < required) n += 256;
+    return n < capacity ? n : capacity;
+}
+
+// 何も確保できない overflow_allocator
+void* no_overflow_alloc(void*, std::size_t, std::size_t) {
+    return 0;
+}
+
+void test18() {
+    char buf[2048];
+    reloc_pool<16> pool(buf, 512);
+    const std::size_t size = pool.size();
+    std::size_t capacity = size + 512;
+
+    reloc_ptr a = pool.allocate(size);
+    assert(a && !pool.allocate(16));
+
+    // 領域を広げて確保する
+    pool.set_grow(&grow_256, &capacity);
+    reloc_ptr b = pool.allocate(300);
+    assert(b && pool.contains(b));
+    assert(pool.size() == size + 512 && pool.total_free() == 512 - 304);
+    assert(pool.check());
+
+    // 広げられなければプールの外に確保する
+    reloc_ptr c = pool.allocate(400);
+    assert(!c);
+    pool.set_overflow(malloc_overflow());
+    c = pool.allocate(400);
+    assert(c && pool.overflowed(c) && !pool.contains(c) && !pool.overflowed(b));
+    assert(pool.overflow_size() == 400 && pool.overflow_count() == 1);
+    {
+        const pinned_ptr pin = c.pin();
+        assert(reinterpret_cast<std::size_t>(pin.get()) % 16 == 0);
+        std::memset(pin.get(), 7, 400);
+    }
+    assert(pool.total_free() == 512 - 304);
+
+    // プールにも外にも空きが無くても、縮めるのは失敗しない
+    {
+        const overflow_allocator exhausted = { &no_overflow_alloc, malloc_overflow().free, 0 };
+        pool.set_overflow(exhausted);
+        assert(!pool.allocate(400));
+        assert(pool.reallocate(c, 384) == c);
+        assert(pool.overflowed(c) && pool.overflow_size() == 384 && pool.overflow_count() == 1);
+        assert(c.get()->size == 384);
+        const pinned_ptr pin = c.pin();
+        const char* p = static_cast<const char*>(pin.get());
+        assert(p[0] == 7 && p[383] == 7);
+        pool.set_overflow(malloc_overflow());
+    }
+    assert(!pool.overflowed(reloc_ptr()));
+
+    // 空きができれば、reallocate でプールに戻る
+    pool.deallocate(a);
+    const reloc_ptr c2 = pool.reallocate(c, 320);
+    assert(c2 && !pool.overflowed(c2) && pool.contains(c2));
+    assert(pool.overflow_size() == 0 && pool.overflow_count() == 0);
+    {
+        const pinned_ptr pin = c2.pin();
+        const char* p = static_cast<const char*>(pin.get());
+        assert(p[0] == 7 && p[319] == 7);
+    }
+    assert(pool.check());
+
+    pool.deallocate(b);
+    pool.deallocate(c2);
+    pool.deallocate(pool.allocate(size * 4));
+    assert(pool.overflow_count() == 0);
+}
+
+// ロックを持っていたプロセスが死んでいたことにするためのロック
+struct test_lock {
+    static const std::size_t storage_size = 1;
+    static lock_result result;
+
+    static bool init(void*) { return true; }
+    static lock_result lock(void*) { return result; }
+    static void unlock(void*) { }
+};
+lock_result test_lock::result = lock_acquired;
+
+void test19() {
+    const std::size_t size = 4096;
+    uint64_t* mem = new uint64_t[size / 8];
+    uint8* const base = reinterpret_cast<uint8*>(mem);
+    detail::region_header* const h = reinterpret_cast<detail::region_header*>(mem);
+    typedef region_pool<16, std_traits, test_lock> pool_type;
+
+    // 重ならないコピーの途中で落ちたら、やり直して回復する
+    {
+        pool_type pool;
+        assert(pool.create(mem, size, 8));
+        region_ptr a = pool.allocate(64);
+        region_ptr b = pool.allocate(64);
+        region_ptr c = pool.allocate(32);
+        for (int i = 0; i < 64; i++) static_cast<uint8*>(pool.pin(b).get())[i] = i;
+        pool.deallocate(a);
+
+        // relocate が b を左へ半分コピーしたところで落ちた
+        h->busy = 1;
+        h->relocating = 1;
+        h->free_count = 0;
+        h->move_node = b.index();
+        h->move_src = h->data + 64;
+        h->move_dst = h->data;
+        h->move_size = 64;
+        std::memcpy(base + h->data, base + h->data + 64, 32);
+        test_lock::result = lock_owner_dead;
+        assert(pool.count() == 2);
+        test_lock::result = lock_acquired;
+
+        assert(!pool.broken());
+        assert(pool.check());
+        assert(pool.pin(b).get() == base + h->data);
+        for (int i = 0; i < 64; i++) assert(static_cast<uint8*>(pool.pin(b).get())[i] == i);
+        assert(pool.pin(c).get() == base + h->data + 128);
+        assert(pool.total_free() == pool.size() - 96);
+        assert(h->move_size == 0 && h->relocating == 0);
+    }
+
+    // 重なっているコピーの途中で落ちたら、やり直せないので壊れている
+    {
+        pool_type pool;
+        assert(pool.create(mem, size, 8));
+        region_ptr a = pool.allocate(16);
+        region_ptr b = pool.allocate(64);
+        pool.deallocate(a);
+
+        h->busy = 1;
+        h->relocating = 1;
+        h->free_count = 0;
+        h->move_node = b.index();
+        h->move_src = h->data + 16;
+        h->move_dst = h->data;
+        h->move_size = 64;
+        std::memmove(base + h->data, base + h->data + 16, 32);
+        test_lock::result = lock_owner_dead;
+        pool.count();
+        test_lock::result = lock_acquired;
+        assert(pool.broken());
+        assert(!pool.allocate(1));
+    }
+
+    // ロックできなければその操作だけが失敗し、管理データには触らない
+    {
+        pool_type pool;
+        assert(pool.create(mem, size, 8));
+        region_ptr a = pool.allocate(16);
+        test_lock::result = lock_failed;
+        assert(!pool.allocate(1));
+        assert(!pool.pin(a));
+        pool.deallocate(a);
+        assert(pool.count() == 0);
+        assert(!pool.check());
+        test_lock::result = lock_acquired;
+        assert(!pool.broken());
+        assert(pool.count() == 1 && pool.check());
+
+        // 二度とロックできなければ壊れたものとして扱う
+        test_lock::result = lock_not_recoverable;
+        assert(!pool.allocate(1));
+        test_lock::result = lock_acquired;
+        assert(pool.broken());
+        assert(!pool.allocate(1));
+    }
+
+    delete[] mem;
+}
+
 int main() {
     test1();
     test2();
@@ -294,4 +886,14 @@ int main() {
     test7();
     test8();
     test9();
+    test10();
+    test11();
+    test12();
+    test13();
+    test14();
+    test15();
+    test16();
+    test17();
+    test18();
+    test19();
 }
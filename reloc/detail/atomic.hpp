@@ -0,0 +1,27 @@
+#ifndef RELOC_DETAIL_ATOMIC_HPP_INCLUDED
+#define RELOC_DETAIL_ATOMIC_HPP_INCLUDED
+
+#include <stdint.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace reloc { namespace detail {
+
+// いい加減なアトミック操作の実装
+// 共有メモリ上の値も操作するので、std::atomic ではなく生の値に対して使う
+inline uint64_t atomic_add(volatile uint64_t* p, uint64_t n) {
+#if defined(_MSC_VER)
+    return static_cast<uint64_t>(_InterlockedExchangeAdd64(reinterpret_cast<volatile __int64*>(p), static_cast<__int64>(n))) + n;
+#else
+    return __sync_add_and_fetch(p, n);
+#endif
+}
+inline uint64_t atomic_sub(volatile uint64_t* p, uint64_t n) {
+    return atomic_add(p, ~n + 1);
+}
+
+}}
+
+#endif // RELOC_DETAIL_ATOMIC_HPP_INCLUDED
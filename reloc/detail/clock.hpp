@@ -0,0 +1,31 @@
+#ifndef RELOC_DETAIL_CLOCK_HPP_INCLUDED
+#define RELOC_DETAIL_CLOCK_HPP_INCLUDED
+
+#include <stdint.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+namespace reloc { namespace detail {
+
+// 単調増加するナノ秒単位の時刻
+inline uint64_t now_ns() {
+#if defined(_WIN32)
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return static_cast<uint64_t>(count.QuadPart / freq.QuadPart * 1000000000 +
+                                 count.QuadPart % freq.QuadPart * 1000000000 / freq.QuadPart);
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + static_cast<uint64_t>(ts.tv_nsec);
+#endif
+}
+
+}}
+
+#endif // RELOC_DETAIL_CLOCK_HPP_INCLUDED
@@ -0,0 +1,12 @@
+#ifndef RELOC_DETAIL_THREAD_LOCAL_HPP_INCLUDED
+#define RELOC_DETAIL_THREAD_LOCAL_HPP_INCLUDED
+
+// いい加減な thread_local の実装
+// POD な型にしか使えない
+#if defined(_MSC_VER)
+#define RELOC_THREAD_LOCAL __declspec(thread)
+#else
+#define RELOC_THREAD_LOCAL __thread
+#endif
+
+#endif // RELOC_DETAIL_THREAD_LOCAL_HPP_INCLUDED
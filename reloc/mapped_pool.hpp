@@ -0,0 +1,103 @@
+#ifndef RELOC_MAPPED_POOL_HPP_INCLUDED
+#define RELOC_MAPPED_POOL_HPP_INCLUDED
+
+// ファイルにマップした region_pool
+//
+//     mapped_pool<16> pool;
+//     if (!pool.open("cache.pool")) {
+//         pool.create("cache.pool", 64 * 1024 * 1024, 4096);
+//     }
+//     region_ptr p = pool.root(0);
+//
+// open はファイルをマップしてヘッダを検証するだけなので、データはコピーしない。
+// POSIX の mmap を使っている。
+
+#include <cstddef>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "region_pool.hpp"
+#include "std_traits.hpp"
+#include "null_lock.hpp"
+
+namespace reloc {
+
+template<std::size_t Alignment, class Traits = std_traits, class Lock = null_lock>
+class mapped_pool : public region_pool<Alignment, Traits, Lock> {
+    typedef region_pool<Alignment, Traits, Lock> base_type;
+
+    void* map_;
+    std::size_t map_size_;
+
+    bool map(const char* path, int flags, std::size_t size) {
+        const int fd = ::open(path, flags, 0644);
+        if (fd < 0) return false;
+        if (size == 0) {
+            struct stat st;
+            if (::fstat(fd, &st) != 0 || st.st_size <= 0) {
+                ::close(fd);
+                return false;
+            }
+            size = static_cast<std::size_t>(st.st_size);
+        } else if (::ftruncate(fd, static_cast<off_t>(size)) != 0) {
+            ::close(fd);
+            return false;
+        }
+        void* const p = ::mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        // マップしてしまえばファイルディスクリプタは必要ない
+        ::close(fd);
+        if (p == MAP_FAILED) return false;
+        map_ = p;
+        map_size_ = size;
+        return true;
+    }
+
+    mapped_pool(const mapped_pool&);
+    mapped_pool& operator=(const mapped_pool&);
+
+public:
+    mapped_pool() : map_(0), map_size_(0) { }
+    ~mapped_pool() { close(); }
+
+    // path に size バイトのファイルを作って、最大 capacity 個のブロックを確保できるプールを作る。
+    // 既にファイルがある場合は中身を捨てる。
+    bool create(const char* path, std::size_t size, std::size_t capacity) {
+        close();
+        if (!map(path, O_RDWR | O_CREAT | O_TRUNC, size)) return false;
+        if (!base_type::create(map_, map_size_, capacity)) {
+            close();
+            return false;
+        }
+        return true;
+    }
+    // create したファイルを開いて再開する。
+    // 他のプロセスと同時に開く場合は exclusive を false にする (region_pool::attach を参照)
+    bool open(const char* path, bool exclusive = true) {
+        close();
+        if (!map(path, O_RDWR, 0)) return false;
+        if (!base_type::attach(map_, map_size_, exclusive)) {
+            close();
+            return false;
+        }
+        return true;
+    }
+    // ファイルへ書き出してからアンマップする。
+    // ピンされているブロックがあってはならない。
+    void close() {
+        if (!map_) return;
+        base_type::detach();
+        ::msync(map_, map_size_, MS_SYNC);
+        ::munmap(map_, map_size_);
+        map_ = 0;
+        map_size_ = 0;
+    }
+    // 変更をファイルへ書き出す
+    bool flush() {
+        return map_ && ::msync(map_, map_size_, MS_SYNC) == 0;
+    }
+};
+
+}
+
+#endif // RELOC_MAPPED_POOL_HPP_INCLUDED
@@ -0,0 +1,33 @@
+#ifndef RELOC_NULL_LOCK_HPP_INCLUDED
+#define RELOC_NULL_LOCK_HPP_INCLUDED
+
+#include <cstddef>
+
+namespace reloc {
+
+// Lock::lock の戻り値
+enum lock_result {
+    lock_acquired,
+    // ロックを持っていたプロセスが死んでいたが、ロックは取れた
+    lock_owner_dead,
+    // ロックできなかった。region_pool はこの操作だけを失敗させる
+    lock_failed,
+    // 二度とロックできない。region_pool は壊れたものとして扱う
+    lock_not_recoverable
+};
+
+// region_pool の操作を排他するためのロック。
+// ロックの実体は領域のヘッダの中の storage_size バイトに置かれる。
+// 何もしない実装なので、1 つのスレッドからしか使えない。
+struct null_lock {
+    static const std::size_t storage_size = 1;
+
+    // create 時に呼ばれる
+    static bool init(void* storage) { return true; }
+    static lock_result lock(void* storage) { return lock_acquired; }
+    static void unlock(void* storage) { }
+};
+
+}
+
+#endif // RELOC_NULL_LOCK_HPP_INCLUDED
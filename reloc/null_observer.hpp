@@ -0,0 +1,30 @@
+#ifndef RELOC_NULL_OBSERVER_HPP_INCLUDED
+#define RELOC_NULL_OBSERVER_HPP_INCLUDED
+
+#include <cstddef>
+
+namespace reloc {
+
+// reloc_pool の各イベントを受け取るためのフック。
+// 何もしない実装なので、最適化によって呼び出しは完全に消える。
+//
+// id はハンドル (alloc_node) のアドレスで、リロケーションが起きても変わらない。
+// 確保に失敗した場合は id と ptr が 0 になる。
+struct null_observer {
+    static void allocated(const void* id, const void* ptr, std::size_t size) { } // nothrow
+    static void deallocated(const void* id, const void* ptr, std::size_t size) { } // nothrow
+    // reallocate でハンドルが変わった場合、old_id と id は異なる
+    static void reallocated(const void* old_id, std::size_t old_size,
+                            const void* id, const void* ptr, std::size_t size) { } // nothrow
+
+    // リロケーションの開始と終了。size は要求されたサイズ、
+    // moved はリロケーションによって移動したバイト数
+    static void relocation_started(std::size_t size) { } // nothrow
+    static void relocation_finished(std::size_t size, std::size_t moved, bool succeeded) { } // nothrow
+    // ピンされていたためにリロケーション範囲を分断したブロック
+    static void relocation_blocked(const void* id, const void* ptr, std::size_t size) { } // nothrow
+};
+
+}
+
+#endif // RELOC_NULL_OBSERVER_HPP_INCLUDED
@@ -0,0 +1,44 @@
+#ifndef RELOC_OVERFLOW_ALLOCATOR_HPP_INCLUDED
+#define RELOC_OVERFLOW_ALLOCATOR_HPP_INCLUDED
+
+#include <cstddef>
+#include <stdlib.h>
+
+namespace reloc {
+
+// reloc_pool が、リロケートしても領域を広げても足りない時に、プールの外に確保するためのアロケータ
+// (reloc_pool::set_overflow)。
+// ここで確保した領域はリロケートされないので、別の reloc_pool から確保することはできない。
+struct overflow_allocator {
+    // alignment でアライメントされた size バイトを返す。失敗したら 0 を返すこと。
+    void* (*alloc)(void* opaque, std::size_t size, std::size_t alignment);
+    // size は解放する時点のブロックのサイズ。reallocate で縮めた場合は、確保した時より小さくなっている
+    void (*free)(void* opaque, void* p, std::size_t size);
+    void* opaque;
+};
+
+namespace detail {
+
+inline void* malloc_overflow_alloc(void*, std::size_t size, std::size_t alignment) {
+    // posix_memalign に渡せるのは、void* のサイズの倍数である 2 のべき乗だけ
+    std::size_t a = sizeof(void*);
+    while (a < alignment) a *= 2;
+    if (a % alignment != 0) return 0;
+    void* p;
+    return posix_memalign(&p, a, size) == 0 ? p : 0;
+}
+inline void malloc_overflow_free(void*, void* p, std::size_t) {
+    ::free(p);
+}
+
+}
+
+// posix_memalign で確保する
+inline overflow_allocator malloc_overflow() {
+    const overflow_allocator a = { &detail::malloc_overflow_alloc, &detail::malloc_overflow_free, 0 };
+    return a;
+}
+
+}
+
+#endif // RELOC_OVERFLOW_ALLOCATOR_HPP_INCLUDED
@@ -0,0 +1,777 @@
+#ifndef RELOC_REGION_POOL_HPP_INCLUDED
+#define RELOC_REGION_POOL_HPP_INCLUDED
+
+// 管理データも含めて全てを 1 つのメモリ領域の中に置くプール
+//
+// 管理データはポインタではなく領域の先頭からのオフセットで持っているので、
+// 領域を別のアドレスにマップし直してもそのまま使える。
+// ファイルにマップすれば、プロセスを再起動しても中身を保持したまま再開できる (mapped_pool.hpp)。
+//
+//     region_pool<16> pool;
+//     pool.create(mem, size, 1024); // 最大 1024 個のブロックを確保できるプールを作る
+//     region_ptr p = pool.allocate(100);
+//     pool.set_root(0, p); // 再開した時に辿れるようにしておく
+//     ...
+//     region_pool<16> pool2;
+//     pool2.attach(mem2, size); // mem を mem2 にコピーしたり、別のアドレスにマップしたものでも良い
+//     region_ptr p2 = pool2.root(0);
+//     region_pinned_ptr pin = pool2.pin(p2);
+//
+// ハンドルはノードの番号なので、領域の中にそのまま保存できる。
+// 領域は Alignment でアライメントされている必要がある (mmap したものなら問題ない)。
+// ブロックの最大数は create 時に決まり、後から変更できない。
+//
+// reloc_pool と違って、リロケーションはピンされていないブロックを全て左に詰める。
+// 操作毎の整合性チェックは RELOC_VALIDATION_LEVEL が validate_full の時だけ行う。
+//
+// Lock を指定すると、全ての操作とピンを打つ操作がロックで排他される。
+// ピンを外す操作はアトミックに行うのでロックしない。
+// 共有メモリに置いて複数のプロセスから使う場合は shared_pool.hpp を参照。
+
+#include <cstddef>
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+#include <stdint.h>
+#include "detail/type.hpp"
+#include "detail/atomic.hpp"
+#include "std_traits.hpp"
+#include "null_lock.hpp"
+#include "validation.hpp"
+
+namespace reloc {
+
+namespace detail {
+
+struct region_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t alignment;
+    uint64_t region_size;
+    // ブロックの最大数
+    uint64_t capacity;
+    // 各テーブルの領域の先頭からのオフセット
+    uint64_t nodes;
+    uint64_t free_list;
+    uint64_t alloc_list;
+    uint64_t data;
+    uint64_t data_size;
+
+    uint64_t free_count;
+    uint64_t alloc_count;
+    // 未使用ノードのリストの先頭 (0 なら無し)
+    uint32_t unused_node;
+    // 操作中なら 0 以外になる。attach 時に 0 以外なら操作中に落ちている
+    uint32_t busy;
+    // ピンされている数の合計。attach 時に 0 以外ならピンしたまま落ちている
+    uint64_t pinned;
+    uint64_t roots[8];
+    // 操作中に落ちたプロセスがいて、管理データが壊れている
+    uint32_t broken;
+    // relocate の途中なら 0 以外になる。空き領域のリストは作り直している途中
+    uint32_t relocating;
+    // relocate でデータを動かしている途中なら move_size が 0 以外になる。
+    // move_node のブロックを move_src から move_dst へ動かしている
+    uint32_t move_node;
+    uint32_t reserved;
+    uint64_t move_src;
+    uint64_t move_dst;
+    uint64_t move_size;
+    // Lock の実体
+    uint64_t lock[8];
+};
+
+struct region_node {
+    uint64_t offset;
+    uint64_t size;
+    // ピンされている数。未使用のノードなら次の未使用ノードの番号
+    uint64_t pinned;
+};
+
+struct region_free {
+    uint64_t offset;
+    uint64_t size;
+};
+
+inline const char* region_magic() { return "RELOCRGN"; }
+const uint32_t region_version = 3;
+
+}
+
+// region_pool のハンドル。
+// ノードの番号なので、領域の中やファイルにそのまま保存しておける。
+class region_ptr {
+public:
+    typedef region_ptr this_type;
+
+private:
+    uint32_t index_;
+
+public:
+    region_ptr() : index_(0) { }
+    explicit region_ptr(uint32_t index) : index_(index) { }
+    uint32_t index() const { return index_; }
+
+    typedef uint32_t this_type::*unspecified_bool_type;
+    operator unspecified_bool_type() const {
+        return index_ == 0 ? 0 : &this_type::index_;
+    }
+};
+
+inline bool operator==(const region_ptr& a, const region_ptr& b) {
+    return a.index() == b.index();
+}
+inline bool operator!=(const region_ptr& a, const region_ptr& b) {
+    return !(a == b);
+}
+inline bool operator<(const region_ptr& a, const region_ptr& b) {
+    return a.index() < b.index();
+}
+
+// ピンされている間は、get() で得られるアドレスが変わらない
+class region_pinned_ptr {
+public:
+    typedef region_pinned_ptr this_type;
+
+private:
+    detail::byte* base_;
+    detail::region_header* header_;
+    detail::region_node* node_;
+
+    // ピンを打つ時は region_pool がロックしているが、
+    // 外す時はロックしないのでアトミックに操作する
+    void add() {
+        if (!node_) return;
+        detail::atomic_add(&node_->pinned, 1);
+        detail::atomic_add(&header_->pinned, 1);
+    }
+    void sub() {
+        if (!node_) return;
+        detail::atomic_sub(&node_->pinned, 1);
+        detail::atomic_sub(&header_->pinned, 1);
+    }
+
+public:
+    region_pinned_ptr() : base_(0), header_(0), node_(0) { }
+    region_pinned_ptr(detail::byte* base, detail::region_node* node)
+        : base_(base), header_(reinterpret_cast<detail::region_header*>(base)), node_(node) {
+        add();
+    }
+    region_pinned_ptr(const region_pinned_ptr& p) : base_(p.base_), header_(p.header_), node_(p.node_) {
+        add();
+    }
+    ~region_pinned_ptr() {
+        sub();
+    }
+    region_pinned_ptr& operator=(const region_pinned_ptr& p) {
+        this_type(p).swap(*this);
+        return *this;
+    }
+    void swap(region_pinned_ptr& p) {
+        std::swap(base_, p.base_);
+        std::swap(header_, p.header_);
+        std::swap(node_, p.node_);
+    }
+    void reset() {
+        this_type().swap(*this);
+    }
+
+    void* get() const { return base_ + node_->offset; }
+    std::size_t size() const { return static_cast<std::size_t>(node_->size); }
+
+    typedef detail::region_node* this_type::*unspecified_bool_type;
+    operator unspecified_bool_type() const {
+        return node_ == 0 ? 0 : &this_type::node_;
+    }
+};
+
+template<std::size_t Alignment, class Traits = std_traits, class Lock = null_lock>
+class region_pool {
+public:
+    typedef Traits traits_type;
+    typedef Lock lock_type;
+
+private:
+    typedef detail::byte byte;
+    typedef detail::region_header header_t;
+    typedef detail::region_node node_t;
+    typedef detail::region_free free_t;
+
+    byte* base_;
+    header_t* header_;
+
+    static uint64_t align_ceil(uint64_t v) {
+        return (v + Alignment - 1) / Alignment * Alignment;
+    }
+    static uint64_t align_floor(uint64_t v) {
+        return v / Alignment * Alignment;
+    }
+    // [offset, offset + size) が limit に収まるか (溢れないように比べる)
+    static bool fits(uint64_t offset, uint64_t size, uint64_t limit) {
+        return offset <= limit && size <= limit - offset;
+    }
+
+    // capacity 個のブロックを管理する時の、各テーブルの先頭からのオフセット。
+    // capacity は 32 ビットに収まっていること。
+    struct layout {
+        uint64_t nodes;
+        uint64_t free_list;
+        uint64_t alloc_list;
+        uint64_t data;
+    };
+    static layout make_layout(uint64_t capacity) {
+        assert(capacity < 0xffffffffu);
+        layout l;
+        l.nodes = align_ceil(sizeof(header_t));
+        l.free_list = align_ceil(l.nodes + sizeof(node_t) * capacity);
+        l.alloc_list = align_ceil(l.free_list + sizeof(free_t) * (capacity + 1));
+        l.data = align_ceil(l.alloc_list + sizeof(uint32_t) * capacity);
+        return l;
+    }
+
+    node_t* node(uint32_t index) const {
+        return reinterpret_cast<node_t*>(base_ + header_->nodes) + (index - 1);
+    }
+    free_t* free_begin() const {
+        return reinterpret_cast<free_t*>(base_ + header_->free_list);
+    }
+    free_t* free_end() const {
+        return free_begin() + header_->free_count;
+    }
+    uint32_t* alloc_begin() const {
+        return reinterpret_cast<uint32_t*>(base_ + header_->alloc_list);
+    }
+    uint32_t* alloc_end() const {
+        return alloc_begin() + header_->alloc_count;
+    }
+
+    struct free_pred {
+        bool operator()(const free_t& a, uint64_t b) const { return a.offset < b; }
+    };
+    struct alloc_pred {
+        const region_pool* pool;
+        explicit alloc_pred(const region_pool* pool) : pool(pool) { }
+        bool operator()(uint32_t a, uint64_t b) const { return pool->node(a)->offset < b; }
+    };
+    free_t* free_lower_bound(uint64_t offset) const {
+        return std::lower_bound(free_begin(), free_end(), offset, free_pred());
+    }
+    uint32_t* alloc_lower_bound(uint64_t offset) const {
+        return std::lower_bound(alloc_begin(), alloc_end(), offset, alloc_pred(this));
+    }
+
+    // ロックして、busy なら操作中であることを記録しておく
+    class lock_scope {
+        const region_pool& pool_;
+        bool busy_;
+        bool locked_;
+
+        lock_scope(const lock_scope&);
+        lock_scope& operator=(const lock_scope&);
+
+    public:
+        lock_scope(const region_pool& pool, bool busy) : pool_(pool), busy_(busy), locked_(true) {
+            header_t* const h = pool_.header_;
+            const lock_result r = lock_type::lock(h->lock);
+            if (r == lock_failed || r == lock_not_recoverable) {
+                // ロックを持たずに管理データを触ってはならないので、この操作は失敗させる
+                locked_ = false;
+                busy_ = false;
+                // 二度とロックできないなら、誰も管理データを書き換えることはないので、
+                // broken を立てるだけなら (0 から 1 にしかしない) ロックが無くても安全
+                if (r == lock_not_recoverable) h->broken = 1;
+                return;
+            }
+            if (r == lock_owner_dead) {
+                // 前にロックしていたプロセスが操作中に落ちていたら、管理データを回復する
+                if (h->busy != 0 && !pool_.recover_impl()) h->broken = 1;
+                h->busy = 0;
+            }
+            if (busy_) h->busy = 1;
+        }
+        ~lock_scope() {
+            if (!locked_) return;
+            if (busy_) pool_.header_->busy = 0;
+            lock_type::unlock(pool_.header_->lock);
+        }
+        bool locked() const { return locked_; }
+    };
+
+    // noncopyable
+    region_pool(const region_pool&);
+    region_pool& operator=(const region_pool&);
+
+public:
+    region_pool() : base_(0), header_(0) { }
+
+    // size バイトの領域 region に、最大 capacity 個のブロックを確保できるプールを作る。
+    // 管理データを置く領域が足りなければ false を返す。
+    bool create(void* region, std::size_t size, std::size_t capacity) {
+        byte* const base = static_cast<byte*>(region);
+        if (reinterpret_cast<uintptr_t>(base) % Alignment != 0) return false;
+        if (capacity == 0 || capacity >= 0xffffffffu) return false;
+
+        if (sizeof(header_t().lock) < lock_type::storage_size) return false;
+
+        const layout l = make_layout(capacity);
+        if (l.data > size) return false;
+
+        header_t* const h = reinterpret_cast<header_t*>(base);
+        std::memset(h, 0, sizeof(header_t));
+        std::memcpy(h->magic, detail::region_magic(), 8);
+        h->version = detail::region_version;
+        h->alignment = Alignment;
+        h->region_size = size;
+        h->capacity = capacity;
+        h->nodes = l.nodes;
+        h->free_list = l.free_list;
+        h->alloc_list = l.alloc_list;
+        h->data = l.data;
+        h->data_size = align_floor(size - l.data);
+        if (!lock_type::init(h->lock)) return false;
+
+        base_ = base;
+        header_ = h;
+
+        // 全てのノードを未使用リストへ繋いでおく
+        for (uint32_t i = 1; i <= capacity; i++) {
+            node_t* const n = node(i);
+            n->offset = 0;
+            n->size = 0;
+            n->pinned = i == capacity ? 0 : i + 1;
+        }
+        h->unused_node = 1;
+
+        if (h->data_size != 0) {
+            free_t* const f = free_begin();
+            f->offset = l.data;
+            f->size = h->data_size;
+            h->free_count = 1;
+        }
+        assert(check_impl());
+        return true;
+    }
+
+    // create 済みの領域を使って再開する。
+    // ヘッダしか見ないので、通常は O(1) で終わる。
+    // exclusive なら、他に領域を使っているプロセスはいないものとして、
+    // 操作中やピンしたままプロセスが落ちていた場合だけ、全体をチェックしてピンを外す。
+    // 共有している場合はピンを外してはいけないので、exclusive を false にする。
+    bool attach(void* region, std::size_t size, bool exclusive = true) {
+        byte* const base = static_cast<byte*>(region);
+        if (reinterpret_cast<uintptr_t>(base) % Alignment != 0) return false;
+        if (size < sizeof(header_t)) return false;
+
+        header_t* const h = reinterpret_cast<header_t*>(base);
+        if (std::memcmp(h->magic, detail::region_magic(), 8) != 0) return false;
+        if (h->version != detail::region_version) return false;
+        if (h->alignment != Alignment) return false;
+        if (h->region_size > size) return false;
+        // ファイルが壊れていても領域の外を触らないように、テーブルの位置は capacity から求め直して比べる
+        if (h->capacity == 0 || h->capacity >= 0xffffffffu) return false;
+        const layout l = make_layout(h->capacity);
+        if (h->nodes != l.nodes || h->free_list != l.free_list ||
+            h->alloc_list != l.alloc_list || h->data != l.data) return false;
+        if (!fits(h->data, h->data_size, h->region_size) || h->data_size % Alignment != 0) return false;
+        if (h->free_count > h->capacity + 1 || h->alloc_count > h->capacity) return false;
+        if (h->unused_node > h->capacity) return false;
+        for (std::size_t i = 0; i < root_count(); i++) {
+            if (h->roots[i] > h->capacity) return false;
+        }
+        if (h->broken != 0) return false;
+
+        base_ = base;
+        header_ = h;
+
+        if (exclusive && (h->busy != 0 || h->pinned != 0)) {
+            if (!recover_impl()) {
+                detach();
+                return false;
+            }
+            for (uint32_t i = 1; i <= h->capacity; i++) {
+                if (node(i)->size != 0) node(i)->pinned = 0;
+            }
+            h->pinned = 0;
+            h->busy = 0;
+        }
+        return true;
+    }
+
+    void detach() {
+        base_ = 0;
+        header_ = 0;
+    }
+
+    bool attached() const { return header_ != 0; }
+    void* region() const { return base_; }
+    // 操作中に落ちたプロセスがいて管理データが壊れてしまったか、ロックが二度と取れなくなった。
+    // 以降の allocate は全て失敗する。
+    bool broken() const { return header_->broken != 0; }
+
+    // データを置く領域のサイズ
+    std::size_t size() const {
+        return static_cast<std::size_t>(header_->data_size);
+    }
+    std::size_t capacity() const {
+        return static_cast<std::size_t>(header_->capacity);
+    }
+    // 確保済みのブロック数
+    std::size_t count() const {
+        lock_scope lock(*this, false);
+        if (!lock.locked()) return 0;
+        return static_cast<std::size_t>(header_->alloc_count);
+    }
+    std::size_t total_free() const {
+        lock_scope lock(*this, false);
+        if (!lock.locked()) return 0;
+        uint64_t free = 0;
+        for (const free_t* it = free_begin(); it != free_end(); ++it) free += it->size;
+        return static_cast<std::size_t>(free);
+    }
+    std::size_t max_free() const {
+        lock_scope lock(*this, false);
+        if (!lock.locked()) return 0;
+        uint64_t max = 0;
+        for (const free_t* it = free_begin(); it != free_end(); ++it) if (max < it->size) max = it->size;
+        return static_cast<std::size_t>(max);
+    }
+
+    // 再開した時に最初に辿るハンドルを保存しておく場所
+    static std::size_t root_count() { return 8; }
+    region_ptr root(std::size_t n) const {
+        assert(n < root_count());
+        lock_scope lock(*this, false);
+        if (!lock.locked()) return region_ptr();
+        return region_ptr(static_cast<uint32_t>(header_->roots[n]));
+    }
+    void set_root(std::size_t n, const region_ptr& handle) {
+        assert(n < root_count());
+        lock_scope lock(*this, false);
+        if (!lock.locked()) return;
+        header_->roots[n] = handle.index();
+    }
+
+    // ロックしてピンを打つので、他のプロセスがリロケーションしている途中のアドレスを掴むことはない
+    region_pinned_ptr pin(const region_ptr& handle) const {
+        if (!handle) return region_pinned_ptr();
+        lock_scope lock(*this, false);
+        if (!lock.locked()) return region_pinned_ptr();
+        assert(handle.index() <= header_->capacity && node(handle.index())->size != 0);
+        return region_pinned_ptr(base_, node(handle.index()));
+    }
+    std::size_t size(const region_ptr& handle) const {
+        lock_scope lock(*this, false);
+        if (!lock.locked()) return 0;
+        return handle ? static_cast<std::size_t>(node(handle.index())->size) : 0;
+    }
+
+public:
+    region_ptr allocate(std::size_t size) {
+        assert(attached());
+        lock_scope lock(*this, true);
+        if (!lock.locked() || header_->broken != 0) return region_ptr();
+        return allocate_impl(size);
+    }
+
+    region_ptr reallocate(const region_ptr& handle, std::size_t size) {
+        if (!handle) return allocate(size);
+
+        lock_scope lock(*this, true);
+        if (!lock.locked() || header_->broken != 0) return region_ptr();
+        node_t* const p = node(handle.index());
+        // handle は解放される可能性があるのでピンされていてはならない
+        assert(p->pinned == 0);
+
+        if (size == 0) size = 1;
+        const uint64_t new_size = align_ceil(size);
+        if (new_size == p->size) return handle;
+
+        const uint64_t right = p->offset + p->size;
+        free_t* it = free_lower_bound(right);
+        const bool free_right = it != free_end() && it->offset == right;
+
+        if (new_size < p->size) {
+            // 右側を空き領域にする
+            const uint64_t cs = p->size - new_size;
+            if (free_right) {
+                it->offset -= cs;
+                it->size += cs;
+            } else {
+                insert_free(it, p->offset + new_size, cs);
+            }
+            p->size = new_size;
+            validate();
+            return handle;
+        }
+
+        const uint64_t cs = new_size - p->size;
+        if (free_right && it->size >= cs) {
+            if (it->size == cs) {
+                erase_free(it);
+            } else {
+                it->offset += cs;
+                it->size -= cs;
+            }
+            p->size = new_size;
+            validate();
+            return handle;
+        }
+
+        const region_ptr h2 = allocate_impl(size);
+        if (!h2) return h2;
+        // allocate_impl でリロケーションが起きている可能性があるので、ここで位置を取得する
+        node_t* const p2 = node(h2.index());
+        copy_as_possible(base_ + p->offset, static_cast<std::size_t>(p->size), base_ + p2->offset);
+        deallocate_impl(handle);
+        validate();
+        return h2;
+    }
+
+    void deallocate(const region_ptr& handle) { // nothrow
+        if (!handle) return;
+        lock_scope lock(*this, true);
+        if (!lock.locked() || header_->broken != 0) return;
+        deallocate_impl(handle);
+    }
+
+    // ピンされていないブロックを全て左に詰める
+    void relocate() {
+        lock_scope lock(*this, true);
+        if (!lock.locked() || header_->broken != 0) return;
+        relocate_impl();
+    }
+
+private:
+    region_ptr allocate_impl(std::size_t size) {
+        if (size == 0) size = 1;
+        const uint64_t s = align_ceil(size);
+        if (header_->unused_node == 0) return region_ptr();
+
+        free_t* it = find_free(s);
+        if (it == free_end()) {
+            relocate_impl();
+            it = find_free(s);
+            if (it == free_end()) return region_ptr();
+        }
+
+        const uint64_t offset = it->offset;
+        if (it->size == s) {
+            erase_free(it);
+        } else {
+            it->offset += s;
+            it->size -= s;
+        }
+
+        const uint32_t index = header_->unused_node;
+        node_t* const n = node(index);
+        header_->unused_node = static_cast<uint32_t>(n->pinned);
+        n->offset = offset;
+        n->size = s;
+        n->pinned = 0;
+
+        uint32_t* const pos = alloc_lower_bound(offset);
+        std::copy_backward(pos, alloc_end(), alloc_end() + 1);
+        *pos = index;
+        ++header_->alloc_count;
+
+        traits_type::construct(base_ + offset);
+        validate();
+        return region_ptr(index);
+    }
+
+    void deallocate_impl(const region_ptr& handle) {
+        const uint32_t index = handle.index();
+        node_t* const p = node(index);
+        assert(p->size != 0);
+        assert(p->pinned == 0);
+
+        free_t* it = free_lower_bound(p->offset);
+        const bool free_left = it != free_begin() && (it - 1)->offset + (it - 1)->size == p->offset;
+        const bool free_right = it != free_end() && p->offset + p->size == it->offset;
+        if (free_left && free_right) {
+            (it - 1)->size += p->size + it->size;
+            erase_free(it);
+        } else if (!free_left && free_right) {
+            it->offset = p->offset;
+            it->size += p->size;
+        } else if (free_left && !free_right) {
+            (it - 1)->size += p->size;
+        } else {
+            insert_free(it, p->offset, p->size);
+        }
+
+        uint32_t* const pos = alloc_lower_bound(p->offset);
+        assert(pos != alloc_end() && *pos == index);
+        std::copy(pos + 1, alloc_end(), pos);
+        --header_->alloc_count;
+
+        traits_type::destroy(base_ + p->offset);
+        p->offset = 0;
+        p->size = 0;
+        p->pinned = header_->unused_node;
+        header_->unused_node = index;
+        validate();
+    }
+
+    free_t* find_free(uint64_t size) const {
+        for (free_t* it = free_begin(); it != free_end(); ++it) {
+            if (it->size >= size) return it;
+        }
+        return free_end();
+    }
+    void insert_free(free_t* pos, uint64_t offset, uint64_t size) {
+        // 空き領域の数は確保済みのブロック数 + 1 を超えないので、溢れることはない
+        assert(header_->free_count < header_->capacity + 1);
+        std::copy_backward(pos, free_end(), free_end() + 1);
+        pos->offset = offset;
+        pos->size = size;
+        ++header_->free_count;
+    }
+    void erase_free(free_t* pos) {
+        std::copy(pos + 1, free_end(), pos);
+        --header_->free_count;
+    }
+
+    void relocate_impl() {
+        // ピンされたブロックで区切られた区間毎に、ブロックを左に詰める。
+        // 途中で落ちても回復できるように、動かしているブロックをヘッダに記録しておく
+        header_t* const h = header_;
+        h->relocating = 1;
+        uint64_t dst = h->data;
+        h->free_count = 0;
+        for (uint32_t* it = alloc_begin(); it != alloc_end(); ++it) {
+            node_t* const n = node(*it);
+            if (n->pinned != 0) {
+                if (dst < n->offset) push_free(dst, n->offset - dst);
+                dst = n->offset + n->size;
+                continue;
+            }
+            if (n->offset != dst) {
+                h->move_node = *it;
+                h->move_src = n->offset;
+                h->move_dst = dst;
+                h->move_size = n->size;
+                copy_as_possible(base_ + n->offset, static_cast<std::size_t>(n->size), base_ + dst);
+                n->offset = dst;
+                h->move_size = 0;
+            }
+            dst += n->size;
+        }
+        const uint64_t end = h->data + h->data_size;
+        if (dst < end) push_free(dst, end - dst);
+        h->relocating = 0;
+        validate();
+    }
+
+    // 操作中に落ちたプロセスの後始末をして、管理データが正しいか調べる
+    bool recover_impl() const {
+        header_t* const h = header_;
+        if (h->move_size != 0) {
+            if (h->move_node == 0 || h->move_node > h->capacity) return false;
+            node_t* const n = node(h->move_node);
+            const uint64_t src = h->move_src;
+            const uint64_t dst = h->move_dst;
+            const uint64_t size = h->move_size;
+            if (n->size != size || !fits(src, size, h->region_size) || !fits(dst, size, h->region_size)) return false;
+            if (n->offset != dst) {
+                // 重なっていれば、コピー元は途中まで上書きされているのでやり直せない
+                if (n->offset != src || (src < dst + size && dst < src + size)) return false;
+                traits_type::copy(base_ + src, static_cast<std::size_t>(size), base_ + dst);
+                n->offset = dst;
+            }
+            h->move_size = 0;
+        }
+        if (h->relocating != 0) {
+            // ブロックの位置は確定しているので、その隙間から空き領域のリストを作り直す
+            const uint64_t end = h->data + h->data_size;
+            uint64_t pos = h->data;
+            h->free_count = 0;
+            for (const uint32_t* it = alloc_begin(); it != alloc_end(); ++it) {
+                if (*it == 0 || *it > h->capacity) return false;
+                const node_t* const n = node(*it);
+                if (n->offset < pos || !fits(n->offset, n->size, end)) return false;
+                if (pos < n->offset) push_free(pos, n->offset - pos);
+                pos = n->offset + n->size;
+            }
+            if (pos < end) push_free(pos, end - pos);
+            h->relocating = 0;
+        }
+        return check_impl();
+    }
+    void push_free(uint64_t offset, uint64_t size) const {
+        free_t* const f = free_end();
+        f->offset = offset;
+        f->size = size;
+        ++header_->free_count;
+    }
+
+    static void copy_as_possible(const byte* src, std::size_t size, byte* dst) {
+        assert(src != dst);
+
+        if (dst < src && dst + size > src) {
+            traits_type::move_left(src, size, dst);
+        } else if (src < dst && src + size > dst) {
+            traits_type::move_right(src, size, dst);
+        } else {
+            traits_type::copy(src, size, dst);
+        }
+    }
+
+    void validate() const {
+#ifndef NDEBUG
+        if (RELOC_VALIDATION_LEVEL == validate_full) assert(check_impl());
+#endif
+    }
+
+public:
+    // データの整合性チェック
+    bool check() const {
+        lock_scope lock(*this, false);
+        return lock.locked() && check_impl();
+    }
+
+private:
+    bool check_impl() const {
+        const header_t* const h = header_;
+        if (h->free_count > h->capacity + 1 || h->alloc_count > h->capacity) return false;
+
+        const free_t* fit = free_begin();
+        const free_t* const flast = free_end();
+        const uint32_t* ait = alloc_begin();
+        const uint32_t* const alast = alloc_end();
+        uint64_t pos = h->data;
+        const uint64_t end = h->data + h->data_size;
+        bool prev_free = false;
+        while (fit != flast || ait != alast) {
+            if (fit != flast && fit->offset == pos) {
+                if (fit->size == 0 || fit->size % Alignment != 0 || prev_free) return false;
+                if (!fits(pos, fit->size, end)) return false;
+                pos += fit->size;
+                prev_free = true;
+                ++fit;
+            } else if (ait != alast) {
+                if (*ait == 0 || *ait > h->capacity) return false;
+                const node_t* const n = node(*ait);
+                if (n->offset != pos || n->size == 0 || n->size % Alignment != 0) return false;
+                if (!fits(pos, n->size, end)) return false;
+                pos += n->size;
+                prev_free = false;
+                ++ait;
+            } else {
+                return false;
+            }
+        }
+        if (pos != end) return false;
+
+        // 未使用ノードの数と確保済みのブロック数を足すと capacity になる
+        uint64_t unused = 0;
+        for (uint32_t i = h->unused_node; i != 0; i = static_cast<uint32_t>(node(i)->pinned)) {
+            if (i > h->capacity || node(i)->size != 0 || ++unused > h->capacity) return false;
+        }
+        return unused + h->alloc_count == h->capacity;
+    }
+};
+
+}
+
+#endif // RELOC_REGION_POOL_HPP_INCLUDED
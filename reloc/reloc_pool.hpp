@@ -5,6 +5,7 @@
 #include <cassert>
 #include <utility>
 #include <iterator>
+#include <vector>
 #include "detail/type.hpp"
 #include "detail/assoc_vector.hpp"
 #include "detail/alloc_node.hpp"
@@ -12,14 +13,35 @@
 #include "detail/node_pred.hpp"
 #include "detail/enable_if.hpp"
 #include "std_traits.hpp"
+#include "null_observer.hpp"
+#include "validation.hpp"
 #include "reloc_ptr.hpp"
+#include "overflow_allocator.hpp"
 
 namespace reloc {
 
-template<std::size_t Alignment, class Traits = std_traits>
+// reloc_pool::set_watermarks で通知される空き領域の状態
+enum pressure_level {
+    pressure_none,
+    pressure_low,
+    pressure_critical
+};
+
+template<std::size_t Alignment, class Traits = std_traits, class Observer = null_observer>
 class reloc_pool {
 public:
     typedef Traits traits_type;
+    typedef Observer observer_type;
+
+    // allocate が、リロケートしても空き領域が足りなかった時に呼ばれる。
+    // base から size バイトのプールの領域を後ろに伸ばして、新しいサイズを返す (伸ばせなければ size を返す)。
+    // required は確保しようとしているサイズ。領域を移動してはならない。
+    typedef std::size_t (*grow_func)(void* context, void* base, std::size_t size, std::size_t required);
+    // 空き領域の状態が変わった時に呼ばれる
+    typedef void (*pressure_func)(void* context, pressure_level level, std::size_t total_free, std::size_t max_free);
+    // allocate が、リロケートしても空き領域が足りなかった時に、grow より先に呼ばれる。
+    // required は確保しようとしているサイズで、解放したバイト数の目安を返す。
+    typedef std::size_t (*reclaim_func)(void* context, std::size_t required);
 
 private:
     typedef detail::byte byte;
@@ -33,6 +55,33 @@ private:
     std::size_t size_;
     free_list_t free_list_;
     alloc_list_t alloc_list_;
+    // プールの中で確保済みのサイズ
+    std::size_t used_;
+
+    validation_level validation_level_;
+    std::size_t validation_interval_;
+    std::size_t validation_count_;
+
+    grow_func grow_;
+    void* grow_context_;
+    overflow_allocator overflow_;
+    // プールの外に確保している領域の合計と数
+    std::size_t overflow_size_;
+    std::size_t overflow_count_;
+
+    std::size_t low_watermark_;
+    std::size_t critical_watermark_;
+    pressure_func pressure_;
+    void* pressure_context_;
+    pressure_level pressure_level_;
+    bool notifying_;
+
+    struct reclaimer {
+        reclaim_func f;
+        void* context;
+    };
+    std::vector<reclaimer> reclaimers_;
+    bool reclaiming_;
 
 private:
     // T は std::size_t か byte* を渡される可能性があるが、
@@ -52,7 +101,25 @@ private:
     }
 
 public:
-    reloc_pool(void* ptr, std::size_t size) {
+    reloc_pool(void* ptr, std::size_t size)
+        : used_(0)
+        , validation_level_(RELOC_VALIDATION_LEVEL)
+        , validation_interval_(RELOC_VALIDATION_INTERVAL)
+        , validation_count_(0)
+        , grow_(0)
+        , grow_context_(0)
+        , overflow_size_(0)
+        , overflow_count_(0)
+        , low_watermark_(0)
+        , critical_watermark_(0)
+        , pressure_(0)
+        , pressure_context_(0)
+        , pressure_level_(pressure_none)
+        , notifying_(false)
+        , reclaiming_(false) {
+
+        const overflow_allocator none = { 0, 0, 0 };
+        overflow_ = none;
         byte* p = static_cast<byte*>(ptr);
         ptr_ = align_ceil(p);
         std::size_t d = static_cast<std::size_t>(ptr_ - p);
@@ -62,13 +129,18 @@ public:
             free_node fn = { ptr_, size_ };
             free_list_.insert(fn);
         }
-        validate();
+        assert(check_validation());
     }
     ~reloc_pool() {
         // まだ解放されてないメモリがある
         assert(alloc_list_.size() == 0);
+        assert(overflow_count_ == 0);
     }
 
+    // プール全体の先頭 (アライメント済み)
+    const void* base() const {
+        return ptr_;
+    }
     // プール全体のサイズ
     std::size_t size() const {
         return size_;
@@ -76,11 +148,7 @@ public:
     // 空き領域の合計値
     // ピンが１つもされていなければ、この値までのサイズが allocate 可能
     std::size_t total_free() const {
-        std::size_t free = 0;
-        for (free_list_t::const_iterator it = free_list_.begin(); it != free_list_.end(); ++it) {
-            free += it->size;
-        }
-        return free;
+        return size_ - used_;
     }
     // それぞれの空き領域の中の最大値
     // この値までのサイズならリロケートを起こすことなく allocate 可能
@@ -92,6 +160,78 @@ public:
         return max;
     }
 
+    // 操作毎に行う整合性チェックの度合いを設定する。
+    // interval が 0 でなければ、level に関係なく interval 回の操作毎に全体をチェックする。
+    // デフォルトは RELOC_VALIDATION_LEVEL, RELOC_VALIDATION_INTERVAL で変更できる。
+    void set_validation(validation_level level, std::size_t interval = 0) {
+        validation_level_ = level;
+        validation_interval_ = interval;
+        validation_count_ = 0;
+    }
+    // 全体の整合性チェックを今すぐ行う
+    bool check() const {
+        return check_validation();
+    }
+
+    // リロケートしても確保できない時の動作を設定する。
+    // まず grow でプールの領域を広げて探し直し、それでも駄目なら overflow でプールの外に確保する。
+    // プールの外に確保した領域も、ハンドルとしては他と同じように pin, reallocate, deallocate できる。
+    // どちらも設定しなければ (デフォルト) 空の reloc_ptr を返す。
+    void set_grow(grow_func f, void* context) {
+        grow_ = f;
+        grow_context_ = context;
+    }
+    void set_overflow(const overflow_allocator& a) {
+        overflow_ = a;
+    }
+    // プールの外に確保している領域の合計サイズと数
+    std::size_t overflow_size() const {
+        return overflow_size_;
+    }
+    std::size_t overflow_count() const {
+        return overflow_count_;
+    }
+    // プールの外に確保した領域かどうか
+    bool overflowed(const reloc_ptr& handle) const {
+        const alloc_node* const p = handle.get();
+        if (!p) return false;
+        return p->ptr < ptr_ || ptr_ + size_ <= p->ptr;
+    }
+
+    // allocate, reallocate, deallocate の後で total_free() が low を下回っていれば pressure_low、
+    // critical を下回っていれば pressure_critical として、状態が変わる度に f を呼ぶ (戻れば pressure_none)。
+    // 設定した時点で既に下回っていれば、すぐに呼ばれる。
+    // f の中でプールを操作してもよいが、その間に状態が変わっても f は呼ばれない。
+    // f を 0 にすると通知しなくなる。
+    void set_watermarks(std::size_t low, std::size_t critical, pressure_func f, void* context) {
+        low_watermark_ = low;
+        critical_watermark_ = critical;
+        pressure_ = f;
+        pressure_context_ = context;
+        pressure_level_ = pressure_none;
+        update_pressure();
+    }
+    // 最後に通知した状態
+    pressure_level pressure() const {
+        return pressure_level_;
+    }
+
+    // プールを使うキャッシュなどが、空き領域を作るための関数を登録する。
+    // 登録した順に、確保できる空き領域ができるまで呼ばれる。
+    // f の中でプールを操作してもよいが、その中で確保に失敗しても reclaimer は呼ばれない。
+    void add_reclaimer(reclaim_func f, void* context) {
+        const reclaimer r = { f, context };
+        reclaimers_.push_back(r);
+    }
+    void remove_reclaimer(reclaim_func f, void* context) {
+        for (typename std::vector<reclaimer>::iterator it = reclaimers_.begin(); it != reclaimers_.end(); ++it) {
+            if (it->f == f && it->context == context) {
+                reclaimers_.erase(it);
+                return;
+            }
+        }
+    }
+
     // このプールから確保した領域かどうか
     bool contains(const reloc_ptr& handle) const {
         const alloc_node* const p = handle.get();
@@ -164,6 +304,132 @@ private:
 
 public:
     reloc_ptr allocate(std::size_t size) {
+        const reloc_ptr rh = allocate_impl(size);
+        alloc_node* const p = rh.get();
+        observer_type::allocated(p, p ? p->ptr : 0, p ? p->size : size);
+        update_pressure();
+        return rh;
+    }
+
+    // allocate と同じだが、リロケートしても確保できなければ reclaimer, grow, overflow を使わずに
+    // 空の reloc_ptr を返す。確保できなければ小さく確保し直せる、推測したサイズを確保する時に使う。
+    reloc_ptr try_allocate(std::size_t size) {
+        const reloc_ptr rh = allocate_impl(size, false);
+        alloc_node* const p = rh.get();
+        observer_type::allocated(p, p ? p->ptr : 0, p ? p->size : size);
+        update_pressure();
+        return rh;
+    }
+
+    reloc_ptr reallocate(const reloc_ptr& handle, std::size_t size) {
+        alloc_node* const p = handle.get();
+        if (!p) return allocate(size);
+
+        const std::size_t old_size = p->size;
+        const reloc_ptr rh = reallocate_impl(handle, size);
+        alloc_node* const np = rh.get();
+        observer_type::reallocated(p, old_size, np, np ? np->ptr : 0, np ? np->size : size);
+        update_pressure();
+        return rh;
+    }
+
+    // n 個の領域をまとめて確保する。
+    // 合計サイズの空き領域を 1 回だけ探して (必要ならリロケートして)、その中を順に切り分ける。
+    // 全て確保できた場合だけ out[0] 〜 out[n - 1] に入れて true を返す。
+    bool allocate_batch(const std::size_t* sizes, std::size_t n, reloc_ptr* out) {
+        if (n == 0) return true;
+
+        std::size_t total = 0;
+        for (std::size_t i = 0; i < n; i++) {
+            const std::size_t size = align_ceil(sizes[i] == 0 ? 1 : sizes[i]);
+            // 溢れた
+            if (total + size < total) return false;
+            total += size;
+        }
+
+        // 確保した後に 1 つずつ解放しても足りるように、n 個増えた分を reserve しておく
+        alloc_list_.reserve(alloc_list_.size() + n);
+        free_list_.reserve(alloc_list_.size() + n + 1);
+        std::vector<alloc_node*> nodes(n);
+        try {
+            for (std::size_t i = 0; i < n; i++) nodes[i] = new alloc_node();
+        } catch (...) {
+            for (std::size_t i = 0; i < n; i++) delete nodes[i];
+            throw;
+        }
+
+        free_list_t::iterator it = find_free(total);
+        if (it == free_list_.end()) it = relocate(total);
+        // 空き領域を作ってもらってから探し直す
+        if (it == free_list_.end() && reclaim(total)) {
+            alloc_list_.reserve(alloc_list_.size() + n);
+            free_list_.reserve(alloc_list_.size() + n + 1);
+            it = find_free(total);
+            if (it == free_list_.end()) it = relocate(total);
+        }
+        // 領域を広げてから探し直す (プールの外には確保しない)
+        if (it == free_list_.end() && grow(total)) {
+            it = find_free(total);
+            if (it == free_list_.end()) it = relocate(total);
+        }
+        if (it == free_list_.end()) {
+            for (std::size_t i = 0; i < n; i++) delete nodes[i];
+            return false;
+        }
+
+        byte* p = it->ptr;
+        if (it->size == total) {
+            free_list_.erase(it);
+        } else {
+            it->ptr += total;
+            it->size -= total;
+        }
+        used_ += total;
+        byte* const first = p;
+        for (std::size_t i = 0; i < n; i++) {
+            alloc_node* const an = nodes[i];
+            an->ptr = p;
+            an->size = align_ceil(sizes[i] == 0 ? 1 : sizes[i]);
+            an->pinned = 0;
+            alloc_list_.insert(an); // nothrow のはず
+            traits_type::construct(p);
+            p += an->size;
+            out[i] = reloc_ptr(an);
+            observer_type::allocated(an, an->ptr, an->size);
+        }
+        validate(first, p);
+        update_pressure();
+        return true;
+    }
+
+    // ピンされていないブロックを全て左に詰める。
+    // ピンされたブロックの間毎に詰めるので、空き領域はピンされたブロックの数 + 1 個以下になる。
+    void relocate() {
+        observer_type::relocation_started(0);
+        std::size_t moved = 0;
+        // do_relocate で空き領域が消えるので、位置は番号で覚えておく
+        std::size_t first = 0;
+        for (alloc_list_t::iterator it = alloc_list_.begin(); it != alloc_list_.end(); ++it) {
+            if ((*it)->pinned != 0) {
+                observer_type::relocation_blocked(*it, (*it)->ptr, (*it)->size);
+                const std::size_t last = free_list_.lower_bound((*it)->ptr) - free_list_.begin();
+                first = relocate_range(first, last, moved);
+            }
+        }
+        relocate_range(first, free_list_.size(), moved);
+        observer_type::relocation_finished(0, moved, true);
+    }
+
+private:
+    // 空き領域 [first, last) の間にあるブロックを詰めて、次の範囲の最初の番号を返す
+    std::size_t relocate_range(std::size_t first, std::size_t last, std::size_t& moved) {
+        if (last - first < 2) return last;
+        do_relocate(free_list_.begin() + first, free_list_.begin() + (last - 1), moved);
+        return first + 1;
+    }
+
+    // fallbacks が false なら、リロケートまでで諦める
+    reloc_ptr allocate_impl(std::size_t size, bool fallbacks = true) {
         if (size == 0) size = 1;
         size = align_ceil(size);
 
@@ -181,16 +447,32 @@ public:
 
         // リロケートして再度確保する
         free_list_t::iterator it = relocate(size);
+        // 空き領域を作ってもらってから探し直す
+        if (fallbacks && it == free_list_.end() && reclaim(size)) {
+            // reclaimer の中で確保されたかもしれないので、もう一度 reserve しておく
+            alloc_list_.reserve(alloc_list_.size() + 1);
+            free_list_.reserve(alloc_list_.size() + 2);
+            rh = allocate_free_list(size, an);
+            if (rh) return rh;
+            it = relocate(size);
+        }
+        // 領域を広げてから探し直す
+        if (fallbacks && it == free_list_.end() && grow(size)) {
+            rh = allocate_free_list(size, an);
+            if (rh) return rh;
+            it = relocate(size);
+        }
         if (it != free_list_.end()) {
             rh = allocate_free_node(it, size, an);
             assert(rh);
+            return rh;
         }
-        return rh;
+        if (!fallbacks) return reloc_ptr();
+        return allocate_overflow(size, an);
     }
 
-    reloc_ptr reallocate(const reloc_ptr& handle, std::size_t size) {
+    reloc_ptr reallocate_impl(const reloc_ptr& handle, std::size_t size) {
         alloc_node* const p = handle.get();
-        if (!p) return allocate(size);
 
         // handle は解放される可能性があるのでピンされていてはならない
         assert(p->pinned == 0);
@@ -199,6 +481,7 @@ public:
         size = align_ceil(size);
 
         if (p->size == size) return handle;
+        if (overflowed(handle)) return reallocate_overflow(handle, size);
 
         byte* const rp = p->ptr + p->size;
         // このブロックの右側が空いてるかどうかを調べる
@@ -212,13 +495,15 @@ public:
                 it->ptr -= cs;
                 it->size += cs;
                 p->size -= cs;
-                validate();
+                used_ -= cs;
+                validate(p->ptr, rp);
                 return reloc_ptr(p);
             } else {
                 free_node fn = { p->ptr + size, cs };
                 free_list_.insert(it, fn); // throwable
                 p->size -= cs;
-                validate();
+                used_ -= cs;
+                validate(p->ptr, rp);
                 return reloc_ptr(p);
             }
         } else {
@@ -233,25 +518,146 @@ public:
                     it->size -= cs;
                 }
                 p->size += cs;
-                validate();
+                used_ += cs;
+                validate(p->ptr, p->ptr + p->size);
                 return reloc_ptr(p);
             } else {
                 // リアロケートする必要がある
-                const reloc_ptr p2 = allocate(size); // throwable
+                const reloc_ptr p2 = allocate_impl(size); // throwable
                 if (!p2) return p2;
 
-                const pinned_ptr pin = p2.pin();
-                // リアロケートによるコピーであることを Traits に伝えた方がいいかもしれない
-                copy_as_possible(p->ptr, p->size, static_cast<byte*>(pin.get()));
-                deallocate(handle);
+                {
+                    const pinned_ptr pin = p2.pin();
+                    // リアロケートによるコピーであることを Traits に伝えた方がいいかもしれない
+                    copy_as_possible(p->ptr, p->size, static_cast<byte*>(pin.get()));
+                }
+                deallocate_impl(handle);
 
-                validate();
+                validate(p2.get()->ptr, p2.get()->ptr + p2.get()->size);
                 return p2;
             }
         }
     }
 
+    // プールの外の領域は、新しく確保し直してコピーする。
+    // プールに空きができていれば、そちらに戻ることになる。
+    // 縮める時は失敗させない。リロケートなどをしなくてもプールに入る時だけ戻し、
+    // 入らなければプールの外のまま縮める。
+    reloc_ptr reallocate_overflow(const reloc_ptr& handle, std::size_t size) {
+        alloc_node* const p = handle.get();
+        reloc_ptr p2;
+        if (size < p->size) {
+            try {
+                alloc_list_.reserve(alloc_list_.size() + 1);
+                free_list_.reserve(alloc_list_.size() + 2);
+                std::auto_ptr<alloc_node> an(new alloc_node());
+                p2 = allocate_free_list(size, an);
+            } catch (...) {
+            }
+            if (!p2) {
+                overflow_size_ -= p->size - size;
+                p->size = size;
+                return handle;
+            }
+        } else {
+            p2 = allocate_impl(size); // throwable
+        }
+        if (!p2) return p2;
+        {
+            const pinned_ptr pin = p2.pin();
+            traits_type::copy(p->ptr, size < p->size ? size : p->size, pin.get());
+        }
+        deallocate_overflow(p);
+        return p2;
+    }
+
 private:
+    free_list_t::iterator find_free(std::size_t size) {
+        free_list_t::iterator it = free_list_.begin();
+        while (it != free_list_.end() && it->size < size) ++it;
+        return it;
+    }
+    // 登録された reclaimer を、size の空き領域ができるまで順に呼ぶ。
+    // 何か解放された場合に true を返す。
+    // コールバックを呼んでいる間だけ flag を立てておく
+    struct callback_scope {
+        bool& flag;
+        explicit callback_scope(bool& flag) : flag(flag) { flag = true; }
+        ~callback_scope() { flag = false; }
+    };
+
+    bool reclaim(std::size_t size) {
+        if (reclaimers_.empty() || reclaiming_) return false;
+        const callback_scope scope(reclaiming_);
+        bool freed = false;
+        // reclaimer の中で登録が変わっても良いように、毎回番号で取り出す
+        for (std::size_t i = 0; i < reclaimers_.size(); i++) {
+            const reclaimer r = reclaimers_[i];
+            if (r.f(r.context, size) != 0) freed = true;
+            if (find_free(size) != free_list_.end()) break;
+        }
+        return freed;
+    }
+    void update_pressure() {
+        if (!pressure_ || notifying_) return;
+        const pressure_level level = current_pressure();
+        if (level == pressure_level_) return;
+        pressure_level_ = level;
+        {
+            const callback_scope scope(notifying_);
+            pressure_(pressure_context_, level, total_free(), max_free());
+        }
+        // f の中で変わった分は通知しない
+        pressure_level_ = current_pressure();
+    }
+    pressure_level current_pressure() const {
+        const std::size_t free = total_free();
+        if (free < critical_watermark_) return pressure_critical;
+        if (free < low_watermark_) return pressure_low;
+        return pressure_none;
+    }
+
+    // grow_ でプールの領域を広げて、増えた分を空き領域にする
+    bool grow(std::size_t size) {
+        if (!grow_) return false;
+        const std::size_t new_size = align_floor(grow_(grow_context_, ptr_, size_, size));
+        if (new_size <= size_) return false;
+
+        byte* const last = ptr_ + size_;
+        const std::size_t cs = new_size - size_;
+        size_ = new_size;
+        if (!free_list_.empty() && (free_list_.end() - 1)->ptr + (free_list_.end() - 1)->size == last) {
+            (free_list_.end() - 1)->size += cs;
+        } else {
+            // allocate 時に reserve しているので、例外は発生しない
+            free_node fn = { last, cs };
+            free_list_.insert(free_list_.end(), fn); // nothrow のはず
+        }
+        validate(last, ptr_ + size_);
+        return true;
+    }
+    // overflow_ でプールの外に確保する
+    reloc_ptr allocate_overflow(std::size_t size, std::auto_ptr<alloc_node>& an) {
+        if (!overflow_.alloc) return reloc_ptr();
+        byte* const p = static_cast<byte*>(overflow_.alloc(overflow_.opaque, size, Alignment));
+        if (!p) return reloc_ptr();
+        an->ptr = p;
+        an->size = size;
+        an->pinned = 0;
+        traits_type::construct(p);
+        overflow_size_ += size;
+        ++overflow_count_;
+        return reloc_ptr(an.release());
+    }
+    void deallocate_overflow(alloc_node* p) { // nothrow
+        assert(p->pinned == 0);
+        traits_type::destroy(p->ptr);
+        overflow_.free(overflow_.opaque, p->ptr, p->size);
+        overflow_size_ -= p->size;
+        --overflow_count_;
+        delete p;
+    }
+
     // フリーリストから単純に探す
     reloc_ptr allocate_free_list(std::size_t size, std::auto_ptr<alloc_node>& an) {
         for (free_list_t::iterator it = free_list_.begin(); it != free_list_.end(); ++it) {
@@ -272,6 +678,7 @@ private:
             it->ptr += size;
             it->size -= size;
         }
+        used_ += size;
         an->ptr = p;
         an->size = size;
         an->pinned = 0;
@@ -282,7 +689,7 @@ private:
 
         traits_type::construct(p);
 
-        validate();
+        validate(p, p + size);
         return reloc_ptr(pan);
     }
 
@@ -309,10 +716,17 @@ private:
     };
 
     free_list_t::iterator relocate(std::size_t size) {
+        observer_type::relocation_started(size);
         reloc_cand rc = find_relocatable_range(size);
-        if (!rc.valid) return free_list_.end();
+        if (!rc.valid) {
+            observer_type::relocation_finished(size, 0, false);
+            return free_list_.end();
+        }
 
-        return do_relocate(rc.first, rc.last);
+        std::size_t moved = 0;
+        free_list_t::iterator it = do_relocate(rc.first, rc.last, moved);
+        observer_type::relocation_finished(size, moved, true);
+        return it;
     }
     reloc_cand find_relocatable_range(std::size_t size) {
         reloc_cand rc;
@@ -321,6 +735,7 @@ private:
         free_list_t::iterator fit = free_list_.begin();
         for (alloc_list_t::iterator it = alloc_list_.begin(); it != alloc_list_.end(); ++it) {
             if ((*it)->pinned != 0) {
+                observer_type::relocation_blocked(*it, (*it)->ptr, (*it)->size);
                 free_list_t::iterator fit2 = free_list_.lower_bound((*it)->ptr);
                 rc.set_if_min(find_relocatable_range(size, fit, fit2));
                 fit = fit2;
@@ -352,10 +767,14 @@ private:
         return rc;
     }
     // [first, last] の範囲にある alloc_node を移動する
-    free_list_t::iterator do_relocate(free_list_t::iterator first, free_list_t::iterator last) {
+    // moved には移動したバイト数が入る
+    free_list_t::iterator do_relocate(free_list_t::iterator first, free_list_t::iterator last, std::size_t& moved) {
         assert(last != free_list_.end());
         assert(std::distance(first, last) >= 1);
 
+        byte* const range_first = first->ptr;
+        byte* const range_last = last->ptr + last->size;
+
         free_list_t::iterator it = first;
         byte* ptr = it->ptr;
         std::size_t free_size = 0;
@@ -367,6 +786,7 @@ private:
                 copy_as_possible((*af)->ptr, (*af)->size, ptr);
                 (*af)->ptr = ptr;
                 ptr += (*af)->size;
+                moved += (*af)->size;
                 ++af;
             }
             free_size += it->size;
@@ -375,7 +795,7 @@ private:
         first->ptr = ptr;
         first->size = free_size + last->size;
         free_list_.erase(first + 1, last + 1);
-        validate();
+        validate(range_first, range_last);
         return first;
     }
 
@@ -396,6 +816,21 @@ public:
         alloc_node* const p = handle.get();
         if (!p) return;
 
+        observer_type::deallocated(p, p->ptr, p->size);
+        if (overflowed(handle)) {
+            deallocate_overflow(p);
+        } else {
+            deallocate_impl(handle);
+        }
+        update_pressure();
+    }
+
+private:
+    void deallocate_impl(const reloc_ptr& handle) { // nothrow
+        alloc_node* const p = handle.get();
+        byte* const first = p->ptr;
+        byte* const last = p->ptr + p->size;
+
         assert(free_list_.find(p->ptr) == free_list_.end());
         assert(alloc_list_.find(p->ptr) != alloc_list_.end());
         assert(p->pinned == 0);
@@ -422,12 +857,13 @@ public:
             free_list_.insert(it, fn); // nothrow のはず
         }
 
+        used_ -= p->size;
         // アロケーションリストからの解放
         alloc_list_.erase(alloc_list_.find(p->ptr));
         traits_type::destroy(p->ptr);
         delete p;
 
-        validate();
+        validate(first, last);
     }
 
 private:
@@ -505,10 +941,63 @@ private:
             }
         }
         if (ptr != ptr_ + size_) return false;
+
+        // used_ が確保済みのサイズの合計と一致しているかチェックする
+        std::size_t used = 0;
+        for (alloc_list_t::const_iterator it = alloc_list_.begin(); it != alloc_list_.end(); ++it) {
+            used += (*it)->size;
+        }
+        if (used != used_) return false;
         return true;
     }
-    void validate() const {
-        assert(check_validation());
+    // [first, last) の範囲とその両隣のブロックの整合性チェック
+    bool check_local_validation(const byte* first, const byte* last) const {
+        // first の左隣のブロックから始める
+        free_list_t::const_iterator fit = free_list_.lower_bound(const_cast<byte*>(first));
+        alloc_list_t::const_iterator ait = alloc_list_.lower_bound(const_cast<byte*>(first));
+        byte* ptr = ptr_;
+        if (fit != free_list_.begin() && ptr < (fit - 1)->ptr) ptr = (fit - 1)->ptr;
+        if (ait != alloc_list_.begin() && ptr < (*(ait - 1))->ptr) ptr = (*(ait - 1))->ptr;
+        fit = free_list_.lower_bound(ptr);
+        ait = alloc_list_.lower_bound(ptr);
+
+        free_list_t::const_iterator flast = free_list_.end();
+        alloc_list_t::const_iterator alast = alloc_list_.end();
+        bool prev_free = false;
+        // last から始まる右隣のブロックまでチェックする
+        while ((fit != flast || ait != alast) && ptr <= last) {
+            if (fit != flast && fit->ptr == ptr) {
+                if (!aligned(fit->ptr) || !aligned(fit->size) || fit->size == 0) return false;
+                // 空き領域が連続していてはいけない
+                if (prev_free) return false;
+                prev_free = true;
+                ptr += fit->size;
+                ++fit;
+            } else if (ait != alast && (*ait)->ptr == ptr) {
+                if (!aligned((*ait)->ptr) || !aligned((*ait)->size) || (*ait)->size == 0) return false;
+                prev_free = false;
+                ptr += (*ait)->size;
+                ++ait;
+            } else {
+                return false;
+            }
+        }
+        if (ptr > ptr_ + size_) return false;
+        if (fit == flast && ait == alast && ptr != ptr_ + size_) return false;
+        return true;
+    }
+    // 操作した範囲 [first, last) を渡す
+    void validate(const byte* first, const byte* last) {
+#ifndef NDEBUG
+        ++validation_count_;
+        if (validation_interval_ != 0 && validation_count_ % validation_interval_ == 0) {
+            assert(check_validation());
+        } else if (validation_level_ == validate_full) {
+            assert(check_validation());
+        } else if (validation_level_ == validate_local) {
+            assert(check_local_validation(first, last));
+        }
+#endif
     }
 };
 
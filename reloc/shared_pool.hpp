@@ -0,0 +1,152 @@
+#ifndef RELOC_SHARED_POOL_HPP_INCLUDED
+#define RELOC_SHARED_POOL_HPP_INCLUDED
+
+// POSIX 共有メモリに置いて、複数のプロセスから使う region_pool
+//
+//     // 親プロセス
+//     shared_pool<16> pool;
+//     pool.create("/my_cache", 64 * 1024 * 1024, 4096);
+//     // ワーカープロセス
+//     shared_pool<16> pool;
+//     pool.open("/my_cache");
+//     region_pinned_ptr pin = pool.pin(pool.root(0));
+//
+// 管理データは全て共有メモリの中にオフセットで置かれているので、
+// プロセス毎に違うアドレスにマップされていても良い。
+// 操作はプロセス間で共有される robust な mutex で排他される。
+// あるプロセスがリロケーションしている間も、他のプロセスはピンしたブロックを読み書きできる。
+
+#include <cstddef>
+#include <cerrno>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "region_pool.hpp"
+#include "std_traits.hpp"
+
+namespace reloc {
+
+// プロセス間で共有する pthread_mutex_t。
+// ロックを持ったままプロセスが死んでも、次にロックしたプロセスが回復できる。
+struct process_mutex {
+    static const std::size_t storage_size = sizeof(pthread_mutex_t);
+
+    static bool init(void* storage) {
+        pthread_mutexattr_t attr;
+        if (pthread_mutexattr_init(&attr) != 0) return false;
+        bool ok = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) == 0 &&
+                  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) == 0 &&
+                  pthread_mutex_init(static_cast<pthread_mutex_t*>(storage), &attr) == 0;
+        pthread_mutexattr_destroy(&attr);
+        return ok;
+    }
+    static lock_result lock(void* storage) {
+        pthread_mutex_t* const m = static_cast<pthread_mutex_t*>(storage);
+        const int r = pthread_mutex_lock(m);
+        if (r == 0) return lock_acquired;
+        if (r == EOWNERDEAD) {
+            if (pthread_mutex_consistent(m) == 0) return lock_owner_dead;
+            // consistent にしないまま unlock すると、以降は ENOTRECOVERABLE になる
+            pthread_mutex_unlock(m);
+            return lock_not_recoverable;
+        }
+        if (r == ENOTRECOVERABLE) return lock_not_recoverable;
+        // EINVAL, EAGAIN など。この操作だけを失敗させる
+        return lock_failed;
+    }
+    static void unlock(void* storage) {
+        pthread_mutex_unlock(static_cast<pthread_mutex_t*>(storage));
+    }
+};
+
+template<std::size_t Alignment, class Traits = std_traits>
+class shared_pool : public region_pool<Alignment, Traits, process_mutex> {
+    typedef region_pool<Alignment, Traits, process_mutex> base_type;
+
+    void* map_;
+    std::size_t map_size_;
+
+    bool map(int fd, std::size_t size) {
+        void* const p = ::mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) return false;
+        map_ = p;
+        map_size_ = size;
+        return true;
+    }
+
+    shared_pool(const shared_pool&);
+    shared_pool& operator=(const shared_pool&);
+
+public:
+    shared_pool() : map_(0), map_size_(0) { }
+    ~shared_pool() { close(); }
+
+    // 共有メモリ name を作って、最大 capacity 個のブロックを確保できるプールを作る。
+    // 既に同じ名前の共有メモリがある場合は失敗する。
+    bool create(const char* name, std::size_t size, std::size_t capacity) {
+        close();
+        const int fd = ::shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0) return false;
+        if (::ftruncate(fd, static_cast<off_t>(size)) != 0) {
+            ::close(fd);
+            ::shm_unlink(name);
+            return false;
+        }
+        if (!map(fd, size) || !base_type::create(map_, map_size_, capacity)) {
+            close();
+            ::shm_unlink(name);
+            return false;
+        }
+        return true;
+    }
+    // memfd_create などで作ったファイルディスクリプタを使ってプールを作る。
+    // fd はこの関数の中で閉じられる。fork した子プロセスは同じ領域を共有する。
+    bool create(int fd, std::size_t size, std::size_t capacity) {
+        close();
+        if (::ftruncate(fd, static_cast<off_t>(size)) != 0) {
+            ::close(fd);
+            return false;
+        }
+        if (!map(fd, size) || !base_type::create(map_, map_size_, capacity)) {
+            close();
+            return false;
+        }
+        return true;
+    }
+    // create で作った共有メモリを開く
+    bool open(const char* name) {
+        close();
+        const int fd = ::shm_open(name, O_RDWR, 0600);
+        if (fd < 0) return false;
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || st.st_size <= 0) {
+            ::close(fd);
+            return false;
+        }
+        // 他のプロセスがピンしている可能性があるので、exclusive にはしない
+        if (!map(fd, static_cast<std::size_t>(st.st_size)) ||
+            !base_type::attach(map_, map_size_, false)) {
+            close();
+            return false;
+        }
+        return true;
+    }
+    // アンマップする。共有メモリ自体は unlink するまで残る
+    void close() {
+        if (!map_) return;
+        base_type::detach();
+        ::munmap(map_, map_size_);
+        map_ = 0;
+        map_size_ = 0;
+    }
+    static bool unlink(const char* name) {
+        return ::shm_unlink(name) == 0;
+    }
+};
+
+}
+
+#endif // RELOC_SHARED_POOL_HPP_INCLUDED
@@ -0,0 +1,178 @@
+#ifndef RELOC_SNAPSHOT_HPP_INCLUDED
+#define RELOC_SNAPSHOT_HPP_INCLUDED
+
+// reloc_pool のレイアウト (空き領域, 確保済み領域, ピンされた領域) を
+// バイナリとして書き出し、オフラインで断片化の具合を調べるための機能
+//
+//     std::FILE* fp = std::fopen("pool.snap", "wb");
+//     write_snapshot(pool, fp);
+//
+// 書き出したファイルは reloc_snapshot で表示できる。
+
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <stdint.h>
+
+namespace reloc {
+
+enum snapshot_block_kind {
+    snapshot_free = 0,
+    snapshot_allocated = 1,
+    snapshot_pinned = 2
+};
+
+// プールの先頭からのオフセットで表したブロック
+struct snapshot_block {
+    uint64_t offset;
+    uint64_t size;
+    uint32_t kind;
+    uint32_t reserved;
+};
+
+struct snapshot {
+    uint64_t size;
+    // アドレス順に並んでいて、プール全体を隙間なく覆っている
+    std::vector<snapshot_block> blocks;
+};
+
+namespace detail {
+
+inline const char* snapshot_magic() { return "RELOCSNP"; }
+const uint32_t snapshot_version = 1;
+
+inline bool write_snapshot_block(std::FILE* fp, uint64_t offset, uint64_t size, uint32_t kind) {
+    const snapshot_block b = { offset, size, kind, 0 };
+    return std::fwrite(&b, sizeof(b), 1, fp) == 1;
+}
+
+}
+
+// ヘッダ (マジックナンバー, バージョン, レコードサイズ, プールのサイズ, レコード数) に続けて
+// アドレス順にブロックを書き出す。
+// 空き領域は確保済み領域の隙間として求めている。
+template<class Pool>
+bool write_snapshot(const Pool& pool, std::FILE* fp) {
+    typedef typename Pool::alloc_info_range range_t;
+    typedef typename Pool::alloc_info_iterator iterator_t;
+
+    const unsigned char* const base = static_cast<const unsigned char*>(pool.base());
+    const uint64_t size = pool.size();
+    const range_t range = pool.alloc_info();
+
+    // ブロック数を先に数える
+    uint64_t n = 0;
+    uint64_t pos = 0;
+    for (iterator_t it = range.first; it != range.second; ++it) {
+        const uint64_t offset = static_cast<const unsigned char*>(it->ptr()) - base;
+        if (pos < offset) ++n;
+        ++n;
+        pos = offset + it->size();
+    }
+    if (pos < size) ++n;
+
+    const uint32_t header[2] = { detail::snapshot_version, sizeof(snapshot_block) };
+    if (std::fwrite(detail::snapshot_magic(), 8, 1, fp) != 1) return false;
+    if (std::fwrite(header, sizeof(header), 1, fp) != 1) return false;
+    if (std::fwrite(&size, sizeof(size), 1, fp) != 1) return false;
+    if (std::fwrite(&n, sizeof(n), 1, fp) != 1) return false;
+
+    pos = 0;
+    for (iterator_t it = range.first; it != range.second; ++it) {
+        const uint64_t offset = static_cast<const unsigned char*>(it->ptr()) - base;
+        if (pos < offset && !detail::write_snapshot_block(fp, pos, offset - pos, snapshot_free)) return false;
+        if (!detail::write_snapshot_block(fp, offset, it->size(),
+                it->pinned() ? snapshot_pinned : snapshot_allocated)) return false;
+        pos = offset + it->size();
+    }
+    if (pos < size && !detail::write_snapshot_block(fp, pos, size - pos, snapshot_free)) return false;
+    return true;
+}
+
+// write_snapshot で書き出したものを読む。形式が違うか壊れていれば false を返す。
+inline bool load_snapshot(std::FILE* fp, snapshot& snap) {
+    char magic[8];
+    uint32_t header[2];
+    uint64_t size;
+    uint64_t n;
+    if (std::fread(magic, 8, 1, fp) != 1) return false;
+    if (std::memcmp(magic, detail::snapshot_magic(), 8) != 0) return false;
+    if (std::fread(header, sizeof(header), 1, fp) != 1) return false;
+    if (header[0] != detail::snapshot_version || header[1] != sizeof(snapshot_block)) return false;
+    if (std::fread(&size, sizeof(size), 1, fp) != 1) return false;
+    if (std::fread(&n, sizeof(n), 1, fp) != 1) return false;
+
+    // n は壊れているかもしれないので、先に確保せずに読めた分だけ追加していく
+    std::vector<snapshot_block> v;
+    snapshot_block buf[256];
+    uint64_t pos = 0;
+    for (uint64_t i = 0; i < n; ) {
+        const std::size_t m = n - i < 256 ? static_cast<std::size_t>(n - i) : 256;
+        if (std::fread(buf, sizeof(snapshot_block), m, fp) != m) return false;
+        // 隙間なく並んでいるか
+        for (std::size_t j = 0; j < m; j++) {
+            const snapshot_block& b = buf[j];
+            if (b.offset != pos || b.size == 0 || b.size > size - pos || b.kind > snapshot_pinned) return false;
+            pos += b.size;
+        }
+        v.insert(v.end(), buf, buf + m);
+        i += m;
+    }
+    if (pos != size) return false;
+
+    snap.size = size;
+    snap.blocks.swap(v);
+    return true;
+}
+
+struct snapshot_metrics {
+    uint64_t total_free;
+    uint64_t largest_free;
+    std::size_t free_blocks;
+    std::size_t allocated_blocks;
+    std::size_t pinned_blocks;
+    uint64_t pinned_bytes;
+    // 1 - largest_free / total_free をパーセントで表したもの
+    double external_fragmentation;
+
+    // ピンされたブロックで区切られた区間の数と、
+    // その中で空き領域の合計が最も大きいもの。
+    // リロケーションで確保できるのは最大でも max_relocatable まで。
+    std::size_t islands;
+    uint64_t max_relocatable;
+};
+
+inline snapshot_metrics compute_metrics(const snapshot& snap) {
+    snapshot_metrics m;
+    std::memset(&m, 0, sizeof(m));
+    m.islands = 1;
+
+    uint64_t island_free = 0;
+    for (std::size_t i = 0; i < snap.blocks.size(); i++) {
+        const snapshot_block& b = snap.blocks[i];
+        if (b.kind == snapshot_free) {
+            ++m.free_blocks;
+            m.total_free += b.size;
+            if (m.largest_free < b.size) m.largest_free = b.size;
+            island_free += b.size;
+        } else if (b.kind == snapshot_allocated) {
+            ++m.allocated_blocks;
+        } else {
+            ++m.pinned_blocks;
+            m.pinned_bytes += b.size;
+            if (m.max_relocatable < island_free) m.max_relocatable = island_free;
+            island_free = 0;
+            ++m.islands;
+        }
+    }
+    if (m.max_relocatable < island_free) m.max_relocatable = island_free;
+
+    m.external_fragmentation = m.total_free == 0 ? 0.0 :
+        100.0 * (1.0 - static_cast<double>(m.largest_free) / static_cast<double>(m.total_free));
+    return m;
+}
+
+}
+
+#endif // RELOC_SNAPSHOT_HPP_INCLUDED
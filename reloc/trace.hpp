@@ -0,0 +1,235 @@
+#ifndef RELOC_TRACE_HPP_INCLUDED
+#define RELOC_TRACE_HPP_INCLUDED
+
+// reloc_pool のイベントをリングバッファへ記録し、バイナリとして出力する
+//
+//     trace_buffer buf(64 * 1024);
+//     trace_buffer::scope scope(buf); // このスレッドのイベントを buf へ記録する
+//     reloc_pool<16, std_traits, trace_observer> pool(mem, size);
+//     ...
+//     buf.dump(fp);
+//
+// バッファはスレッド毎に用意して使う。
+// 書き込むのは scope を作ったスレッドだけなので、ロックは必要ない。
+
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <map>
+#include <stdint.h>
+#include "detail/clock.hpp"
+#include "detail/thread_local.hpp"
+#include "reloc_ptr.hpp"
+
+namespace reloc {
+
+enum trace_event_type {
+    trace_allocate = 1,
+    trace_deallocate = 2,
+    trace_reallocate = 3,
+    trace_relocation_start = 4,
+    trace_relocation_end = 5,
+    trace_pin_blocked = 6
+};
+
+// トレースファイルの 1 レコード
+//
+// type                    | id         | ptr      | size       | prev_id    | prev_size
+// ------------------------+------------+----------+------------+------------+----------
+// trace_allocate          | ハンドル   | アドレス | サイズ     | -          | -
+// trace_deallocate        | ハンドル   | アドレス | サイズ     | -          | -
+// trace_reallocate        | ハンドル   | アドレス | サイズ     | 元ハンドル | 元サイズ
+// trace_relocation_start  | -          | -        | 要求サイズ | -          | -
+// trace_relocation_end    | 成功なら 1 | -        | 要求サイズ | -          | 移動量
+// trace_pin_blocked       | ハンドル   | アドレス | サイズ     | -          | -
+//
+// 確保に失敗した場合、id と ptr は 0 になる
+struct trace_event {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t time; // ナノ秒
+    uint64_t id;
+    uint64_t ptr;
+    uint64_t size;
+    uint64_t prev_id;
+    uint64_t prev_size;
+};
+
+class trace_buffer {
+    std::vector<trace_event> events_;
+    // これまでに記録したイベントの総数
+    uint64_t count_;
+
+    trace_buffer(const trace_buffer&);
+    trace_buffer& operator=(const trace_buffer&);
+
+    static trace_buffer*& current_ref() {
+        static RELOC_THREAD_LOCAL trace_buffer* current = 0;
+        return current;
+    }
+
+public:
+    // ファイルの先頭に書かれるマジックナンバーとバージョン
+    static const char* magic() { return "RELOCTRC"; }
+    static const uint32_t version = 1;
+
+    // capacity 個を超えたら古いイベントから上書きされる
+    explicit trace_buffer(std::size_t capacity) : events_(capacity == 0 ? 1 : capacity), count_(0) { }
+
+    // 現在のスレッドに割り当てられているバッファ
+    static trace_buffer* current() { return current_ref(); }
+
+    // スコープの間、現在のスレッドのイベントを buf へ記録する
+    class scope {
+        trace_buffer* prev_;
+
+        scope(const scope&);
+        scope& operator=(const scope&);
+
+    public:
+        explicit scope(trace_buffer& buf) : prev_(current_ref()) { current_ref() = &buf; }
+        ~scope() { current_ref() = prev_; }
+    };
+
+    void push(uint32_t type, const void* id, const void* ptr, std::size_t size,
+              const void* prev_id = 0, std::size_t prev_size = 0) { // nothrow
+        trace_event& e = events_[static_cast<std::size_t>(count_ % events_.size())];
+        e.type = type;
+        e.reserved = 0;
+        e.time = detail::now_ns();
+        e.id = reinterpret_cast<uintptr_t>(id);
+        e.ptr = reinterpret_cast<uintptr_t>(ptr);
+        e.size = size;
+        e.prev_id = reinterpret_cast<uintptr_t>(prev_id);
+        e.prev_size = prev_size;
+        ++count_;
+    }
+
+    std::size_t capacity() const { return events_.size(); }
+    // 保持しているイベント数
+    std::size_t size() const {
+        return count_ < events_.size() ? static_cast<std::size_t>(count_) : events_.size();
+    }
+    // 上書きされて失われたイベント数
+    uint64_t dropped() const { return count_ - size(); }
+    void clear() { count_ = 0; }
+
+    // 古い順に n 番目のイベント
+    const trace_event& operator[](std::size_t n) const {
+        return events_[static_cast<std::size_t>((dropped() + n) % events_.size())];
+    }
+
+    // ヘッダ (マジックナンバー, バージョン, レコードサイズ, レコード数) に続けて
+    // 古い順にイベントを書き出す
+    bool dump(std::FILE* fp) const {
+        const uint32_t header[2] = { version, sizeof(trace_event) };
+        const uint64_t n = size();
+        if (std::fwrite(magic(), 8, 1, fp) != 1) return false;
+        if (std::fwrite(header, sizeof(header), 1, fp) != 1) return false;
+        if (std::fwrite(&n, sizeof(n), 1, fp) != 1) return false;
+        for (std::size_t i = 0; i < n; i++) {
+            if (std::fwrite(&(*this)[i], sizeof(trace_event), 1, fp) != 1) return false;
+        }
+        return true;
+    }
+};
+
+// dump したトレースを読み込む
+inline bool load_trace(std::FILE* fp, std::vector<trace_event>& events) {
+    char magic[8];
+    uint32_t header[2];
+    uint64_t n;
+    if (std::fread(magic, 8, 1, fp) != 1) return false;
+    if (std::memcmp(magic, trace_buffer::magic(), 8) != 0) return false;
+    if (std::fread(header, sizeof(header), 1, fp) != 1) return false;
+    if (header[0] != trace_buffer::version || header[1] != sizeof(trace_event)) return false;
+    if (std::fread(&n, sizeof(n), 1, fp) != 1) return false;
+
+    std::vector<trace_event> v(static_cast<std::size_t>(n));
+    if (n != 0 && std::fread(&v[0], sizeof(trace_event), v.size(), fp) != v.size()) return false;
+    events.swap(v);
+    return true;
+}
+
+// 現在のスレッドに割り当てられた trace_buffer へ記録する Observer
+struct trace_observer {
+    static void allocated(const void* id, const void* ptr, std::size_t size) {
+        if (trace_buffer* buf = trace_buffer::current()) buf->push(trace_allocate, id, ptr, size);
+    }
+    static void deallocated(const void* id, const void* ptr, std::size_t size) {
+        if (trace_buffer* buf = trace_buffer::current()) buf->push(trace_deallocate, id, ptr, size);
+    }
+    static void reallocated(const void* old_id, std::size_t old_size,
+                            const void* id, const void* ptr, std::size_t size) {
+        if (trace_buffer* buf = trace_buffer::current()) buf->push(trace_reallocate, id, ptr, size, old_id, old_size);
+    }
+    static void relocation_started(std::size_t size) {
+        if (trace_buffer* buf = trace_buffer::current()) buf->push(trace_relocation_start, 0, 0, size);
+    }
+    static void relocation_finished(std::size_t size, std::size_t moved, bool succeeded) {
+        if (trace_buffer* buf = trace_buffer::current())
+            buf->push(trace_relocation_end, reinterpret_cast<const void*>(succeeded ? 1 : 0), 0, size, 0, moved);
+    }
+    static void relocation_blocked(const void* id, const void* ptr, std::size_t size) {
+        if (trace_buffer* buf = trace_buffer::current()) buf->push(trace_pin_blocked, id, ptr, size);
+    }
+};
+
+// トレースの allocate, deallocate, reallocate を pool 上で再現する。
+// リングバッファが溢れて途中から始まるトレースでも動くように、
+// 知らないハンドルに対する操作は無視する。
+// 再現し終わった時点で残っている領域は全て解放する。
+// 確保に失敗した回数を返す。
+template<class Pool>
+std::size_t replay_trace(Pool& pool, const trace_event* first, const trace_event* last) {
+    typedef std::map<uint64_t, reloc_ptr> map_t;
+    map_t handles;
+    std::size_t failed = 0;
+
+    for ( ; first != last; ++first) {
+        const trace_event& e = *first;
+        switch (e.type) {
+        case trace_allocate: {
+            if (e.id == 0) break;
+            const reloc_ptr p = pool.allocate(static_cast<std::size_t>(e.size));
+            if (p) handles[e.id] = p;
+            else ++failed;
+            break;
+        }
+        case trace_deallocate: {
+            map_t::iterator it = handles.find(e.id);
+            if (it == handles.end()) break;
+            pool.deallocate(it->second);
+            handles.erase(it);
+            break;
+        }
+        case trace_reallocate: {
+            // 元のトレースで失敗した reallocate は再現しない
+            if (e.id == 0) break;
+            map_t::iterator it = handles.find(e.prev_id);
+            if (it == handles.end()) break;
+            const reloc_ptr p = pool.reallocate(it->second, static_cast<std::size_t>(e.size));
+            if (!p) {
+                // 失敗した場合、元の領域は残っている
+                ++failed;
+                break;
+            }
+            handles.erase(it);
+            handles[e.id] = p;
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    for (map_t::iterator it = handles.begin(); it != handles.end(); ++it) {
+        pool.deallocate(it->second);
+    }
+    return failed;
+}
+
+}
+
+#endif // RELOC_TRACE_HPP_INCLUDED
@@ -0,0 +1,27 @@
+#ifndef RELOC_VALIDATION_HPP_INCLUDED
+#define RELOC_VALIDATION_HPP_INCLUDED
+
+// reloc_pool を生成した時の整合性チェックの度合いのデフォルト値
+#ifndef RELOC_VALIDATION_LEVEL
+#define RELOC_VALIDATION_LEVEL ::reloc::validate_full
+#endif
+#ifndef RELOC_VALIDATION_INTERVAL
+#define RELOC_VALIDATION_INTERVAL 0
+#endif
+
+namespace reloc {
+
+// 操作毎に行うデータの整合性チェックの度合い
+// NDEBUG が定義されている場合はチェックしない
+enum validation_level {
+    // チェックしない
+    validate_none,
+    // 操作した領域とその両隣のブロックだけをチェックする
+    validate_local,
+    // 全体をチェックする。プールが大きいと非常に遅い
+    validate_full
+};
+
+}
+
+#endif // RELOC_VALIDATION_HPP_INCLUDED
@@ -0,0 +1,110 @@
+// reloc_pool のベンチマーク
+//
+//     reloc_bench               # 合成したワークロードを記録して再現する
+//     reloc_bench trace.bin     # trace_buffer::dump したトレースを再現する
+//     reloc_bench -o trace.bin  # 合成したワークロードのトレースを書き出す
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "reloc/reloc_pool.hpp"
+#include "reloc/trace.hpp"
+
+using namespace reloc;
+
+static const std::size_t pool_size = 4 * 1024 * 1024;
+
+// 適当なサイズの確保と解放を繰り返して、リロケーションが起きる程度に断片化させる
+void record_workload(trace_buffer& buf, void* mem) {
+    trace_buffer::scope scope(buf);
+    reloc_pool<16, std_traits, trace_observer> pool(mem, pool_size);
+
+    std::vector<reloc_ptr> live;
+    std::srand(1);
+    for (int i = 0; i < 200000; i++) {
+        const int r = std::rand() % 10;
+        if (r < 5 || live.empty()) {
+            reloc_ptr p = pool.allocate(16 + std::rand() % 4096);
+            if (p) live.push_back(p);
+        } else if (r < 8) {
+            const std::size_t n = std::rand() % live.size();
+            pool.deallocate(live[n]);
+            live[n] = live.back();
+            live.pop_back();
+        } else {
+            const std::size_t n = std::rand() % live.size();
+            reloc_ptr p = pool.reallocate(live[n], 16 + std::rand() % 8192);
+            if (p) live[n] = p;
+        }
+    }
+    for (std::size_t i = 0; i < live.size(); i++) {
+        pool.deallocate(live[i]);
+    }
+}
+
+void print_summary(const std::vector<trace_event>& events) {
+    std::size_t counts[7] = { 0 };
+    uint64_t reloc_time = 0;
+    uint64_t reloc_max = 0;
+    uint64_t moved = 0;
+    uint64_t start = 0;
+    for (std::size_t i = 0; i < events.size(); i++) {
+        const trace_event& e = events[i];
+        if (e.type < 7) ++counts[e.type];
+        if (e.type == trace_relocation_start) start = e.time;
+        if (e.type == trace_relocation_end && start != 0) {
+            const uint64_t t = e.time - start;
+            reloc_time += t;
+            if (reloc_max < t) reloc_max = t;
+            moved += e.prev_size;
+            start = 0;
+        }
+    }
+    std::printf("events: %lu\n", (unsigned long)events.size());
+    std::printf("  allocate: %lu, deallocate: %lu, reallocate: %lu\n",
+        (unsigned long)counts[trace_allocate], (unsigned long)counts[trace_deallocate], (unsigned long)counts[trace_reallocate]);
+    std::printf("  relocation: %lu (total %.3f ms, max %.3f ms, moved %lu bytes), pin blocked: %lu\n",
+        (unsigned long)counts[trace_relocation_start], reloc_time / 1e6, reloc_max / 1e6,
+        (unsigned long)moved, (unsigned long)counts[trace_pin_blocked]);
+}
+
+int main(int argc, char* argv[]) {
+    void* mem = std::malloc(pool_size);
+    std::vector<trace_event> events;
+
+    if (argc == 2) {
+        std::FILE* fp = std::fopen(argv[1], "rb");
+        if (!fp || !load_trace(fp, events)) {
+            std::fprintf(stderr, "failed to load %s\n", argv[1]);
+            return 1;
+        }
+        std::fclose(fp);
+    } else {
+        trace_buffer buf(1024 * 1024);
+        record_workload(buf, mem);
+        for (std::size_t i = 0; i < buf.size(); i++) {
+            events.push_back(buf[i]);
+        }
+        if (argc == 3 && std::strcmp(argv[1], "-o") == 0) {
+            std::FILE* fp = std::fopen(argv[2], "wb");
+            if (!fp || !buf.dump(fp)) {
+                std::fprintf(stderr, "failed to write %s\n", argv[2]);
+                return 1;
+            }
+            std::fclose(fp);
+        }
+    }
+    print_summary(events);
+    if (events.empty()) return 0;
+
+    // トレースを取らないプールで再現して時間を計る
+    reloc_pool<16> pool(mem, pool_size);
+    const uint64_t t = detail::now_ns();
+    const std::size_t failed = replay_trace(pool, &events[0], &events[0] + events.size());
+    const uint64_t elapsed = detail::now_ns() - t;
+    std::printf("replay: %.3f ms, %.1f ns/event, failed: %lu\n",
+        elapsed / 1e6, (double)elapsed / events.size(), (unsigned long)failed);
+
+    std::free(mem);
+}
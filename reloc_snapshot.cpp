@@ -0,0 +1,110 @@
+// write_snapshot で書き出したプールのレイアウトを表示する
+//
+//     reloc_snapshot pool.snap [width] [height]
+//
+// マップの 1 文字はプールを width * height 等分した範囲を表す。
+//   '.' 全て空き領域
+//   '-' 半分以上が空き領域
+//   '+' 半分以上が確保済み領域
+//   '#' 全て確保済み領域
+//   'P' ピンされた領域を含む
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include "reloc/snapshot.hpp"
+
+using namespace reloc;
+
+void print_map(const snapshot& snap, std::size_t width, std::size_t height) {
+    const std::size_t cells = width * height;
+    std::vector<uint64_t> used(cells);
+    std::vector<bool> pinned(cells);
+
+    // 各ブロックを、重なっているセルに振り分ける
+    for (std::size_t i = 0; i < snap.blocks.size(); i++) {
+        const snapshot_block& b = snap.blocks[i];
+        if (b.kind == snapshot_free) continue;
+        uint64_t pos = b.offset;
+        const uint64_t end = b.offset + b.size;
+        while (pos < end) {
+            const std::size_t c = static_cast<std::size_t>(pos * cells / snap.size);
+            uint64_t cell_end = (static_cast<uint64_t>(c) + 1) * snap.size / cells;
+            if (cell_end <= pos) cell_end = pos + 1;
+            const uint64_t e = cell_end < end ? cell_end : end;
+            used[c] += e - pos;
+            if (b.kind == snapshot_pinned) pinned[c] = true;
+            pos = e;
+        }
+    }
+
+    for (std::size_t y = 0; y < height; y++) {
+        std::printf("%12lu ", (unsigned long)(static_cast<uint64_t>(y) * width * snap.size / cells));
+        for (std::size_t x = 0; x < width; x++) {
+            const std::size_t c = y * width + x;
+            const uint64_t first = static_cast<uint64_t>(c) * snap.size / cells;
+            const uint64_t last = (static_cast<uint64_t>(c) + 1) * snap.size / cells;
+            const uint64_t cell_size = last - first;
+            char ch;
+            if (pinned[c]) ch = 'P';
+            else if (used[c] == 0) ch = '.';
+            else if (used[c] >= cell_size) ch = '#';
+            else if (used[c] * 2 >= cell_size) ch = '+';
+            else ch = '-';
+            std::putchar(ch);
+        }
+        std::putchar('\n');
+    }
+}
+
+// ピンされたブロックで区切られた区間毎の空き領域
+void print_islands(const snapshot& snap) {
+    std::printf("islands:\n");
+    uint64_t first = 0;
+    uint64_t free = 0;
+    std::size_t blocks = 0;
+    for (std::size_t i = 0; i <= snap.blocks.size(); i++) {
+        const bool end = i == snap.blocks.size();
+        if (end || snap.blocks[i].kind == snapshot_pinned) {
+            const uint64_t last = end ? snap.size : snap.blocks[i].offset;
+            if (first < last) {
+                std::printf("  [%lu, %lu) blocks: %lu, free: %lu\n",
+                    (unsigned long)first, (unsigned long)last, (unsigned long)blocks, (unsigned long)free);
+            }
+            if (!end) first = snap.blocks[i].offset + snap.blocks[i].size;
+            free = 0;
+            blocks = 0;
+        } else {
+            if (snap.blocks[i].kind == snapshot_free) free += snap.blocks[i].size;
+            ++blocks;
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::fprintf(stderr, "usage: %s snapshot [width] [height]\n", argv[0]);
+        return 1;
+    }
+    const std::size_t width = argc > 2 ? std::atoi(argv[2]) : 64;
+    const std::size_t height = argc > 3 ? std::atoi(argv[3]) : 16;
+
+    std::FILE* fp = std::fopen(argv[1], "rb");
+    snapshot snap;
+    if (!fp || !load_snapshot(fp, snap)) {
+        std::fprintf(stderr, "failed to load %s\n", argv[1]);
+        return 1;
+    }
+    std::fclose(fp);
+
+    const snapshot_metrics m = compute_metrics(snap);
+    std::printf("pool size: %lu\n", (unsigned long)snap.size);
+    std::printf("blocks: free %lu, allocated %lu, pinned %lu (%lu bytes)\n",
+        (unsigned long)m.free_blocks, (unsigned long)m.allocated_blocks,
+        (unsigned long)m.pinned_blocks, (unsigned long)m.pinned_bytes);
+    std::printf("total free: %lu, largest free: %lu\n", (unsigned long)m.total_free, (unsigned long)m.largest_free);
+    std::printf("external fragmentation: %.1f%%\n", m.external_fragmentation);
+    std::printf("max relocatable: %lu\n", (unsigned long)m.max_relocatable);
+    if (snap.size != 0 && width != 0 && height != 0) print_map(snap, width, height);
+    print_islands(snap);
+}
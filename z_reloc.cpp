@@ -1,5 +1,24 @@
 #include <cassert>
+#include <cstdlib>
+#include <vector>
 #include <z_reloc/z_reloc.hpp>
+#include <z_reloc/pool_allocator.hpp>
+#include <z_reloc/stream_cache.hpp>
+#include <z_reloc/parallel.hpp>
+#include <z_reloc/streaming.hpp>
+#include <z_reloc/chain.hpp>
+#include <z_reloc/batch.hpp>
+#include <z_reloc/dictionary.hpp>
+#include <z_reloc/codec.hpp>
+#include <z_reloc/lz.hpp>
+#include <z_reloc/level_tuner.hpp>
+#include <z_reloc/compressed_cache.hpp>
+#include <z_reloc/async.hpp>
+#include <z_reloc/block_index.hpp>
+#include <z_reloc/access_index.hpp>
+#include <z_reloc/verify.hpp>
+#include <z_reloc/nothrow.hpp>
+#include <cstdio>
 #include <reloc/reloc_pool.hpp>
 
 using namespace reloc;
@@ -38,8 +57,1188 @@ void test2() {
     pool.deallocate(ptr2.ptr);
 }
 
+void test3() {
+    const std::size_t size = 64 * 1024;
+    unsigned char* pd = new unsigned char[size * 4];
+    reloc_pool<16> pool(pd, size * 4);
+    std::vector<unsigned char> data(size);
+    for (std::size_t i = 0; i < size; i++) {
+        data[i] = static_cast<unsigned char>(i % 251 * (i / 1024));
+    }
+
+    // 出力サイズを推測するので、reallocate で伸ばすことはない
+    z_reloc::sized_ptr ptr = z_reloc::deflate(pool, &data[0], size);
+    assert(ptr.ptr);
+    z_reloc::sized_ptr ptr2 = z_reloc::inflate(pool, ptr.ptr.pin().get(), ptr.size);
+    assert(ptr2.size == size);
+    assert(std::equal(data.begin(), data.end(), static_cast<unsigned char*>(ptr2.ptr.pin().get())));
+
+    // gzip ならトレーラから展開後のサイズが分かる
+    const unsigned char gz[20] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3, 0, 0, 0, 0, 0, 0, 0x39, 0x30, 0, 0 };
+    assert(z_reloc::detail::estimate_inflate_size(gz, sizeof(gz)) == 12345);
+
+    pool.deallocate(ptr.ptr);
+    pool.deallocate(ptr2.ptr);
+    delete[] pd;
+}
+
+void test4() {
+    // zlib の内部状態もプールから確保する
+    const std::size_t size = 1024 * 1024;
+    unsigned char* pd = new unsigned char[size];
+    reloc_pool<16> pool(pd, size);
+    z_reloc::pool_allocator<reloc_pool<16> > pa(pool);
+    zlibpp::allocator a = pa.get();
+
+    const char data[] = "pool_allocator pool_allocator pool_allocator";
+    z_reloc::sized_ptr ptr = z_reloc::deflate(pool, data, sizeof(data), 0, 1.5f, zlibpp::BEST_COMPRESSION, &a);
+    assert(ptr.ptr);
+    z_reloc::sized_ptr ptr2 = z_reloc::inflate(pool, ptr.ptr.pin().get(), ptr.size, 0, 1.5f, &a);
+    assert(ptr2.size == sizeof(data));
+    assert(std::equal(data, data + sizeof(data), static_cast<char*>(ptr2.ptr.pin().get())));
+
+    pool.deallocate(ptr.ptr);
+    pool.deallocate(ptr2.ptr);
+    // ストリームの破棄と共に全て解放されている
+    assert(pool.total_free() == pool.size());
+
+    // プールが小さすぎて zlib の内部状態を確保できない
+    unsigned char* pd2 = new unsigned char[16 * 1024];
+    reloc_pool<16> pool2(pd2, 16 * 1024);
+    z_reloc::pool_allocator<reloc_pool<16> > pa2(pool2);
+    zlibpp::allocator a2 = pa2.get();
+    {
+        // 初期化に失敗したストリームは空になる
+        zlibpp::deflate_stream ds(zlibpp::BEST_COMPRESSION, &a2);
+        assert(!ds && ds.init_result() == zlibpp::MEM_ERROR);
+        assert(ds.deflate(zlibpp::FINISH) == zlibpp::MEM_ERROR);
+    }
+    assert(pool2.total_free() == pool2.size());
+
+    delete[] pd;
+    delete[] pd2;
+}
+
+void test5() {
+    const std::size_t size = 64 * 1024;
+    unsigned char* pd = new unsigned char[size];
+    reloc_pool<16> pool(pd, size);
+    z_reloc::stream_cache cache(2);
+
+    // 同じ設定のストリームは使い回される
+    for (int i = 0; i < 10; i++) {
+        char data[32];
+        for (int j = 0; j < 32; j++) data[j] = static_cast<char>(i + j % 4);
+        z_reloc::sized_ptr ptr = z_reloc::deflate(pool, cache, data, sizeof(data));
+        assert(ptr.ptr);
+        z_reloc::sized_ptr ptr2 = z_reloc::inflate(pool, cache, ptr.ptr.pin().get(), ptr.size);
+        assert(ptr2.size == sizeof(data));
+        assert(std::equal(data, data + sizeof(data), static_cast<char*>(ptr2.ptr.pin().get())));
+        pool.deallocate(ptr.ptr);
+        pool.deallocate(ptr2.ptr);
+    }
+    assert(cache.misses() == 2);
+    assert(cache.hits() == 18);
+    assert(cache.size() == 2);
+
+    // レベルが違えば別のストリーム。容量を超えたら古いものから捨てる
+    {
+        z_reloc::cached_deflate_stream ds(cache, zlibpp::BEST_SPEED);
+        assert(ds);
+    }
+    assert(cache.misses() == 3);
+    assert(cache.size() == 2);
+
+    // zlibpp のストリームも reset で使い回せる
+    zlibpp::deflate_stream ds(zlibpp::BEST_SPEED, zlibpp::MAX_WINDOW_BITS, zlibpp::DEFAULT_MEM_LEVEL);
+    char out[64];
+    for (int i = 0; i < 2; i++) {
+        assert(ds.reset() == zlibpp::OK);
+        ds->next_in = "reset";
+        ds->avail_in = 5;
+        ds->next_out = out;
+        ds->avail_out = sizeof(out);
+        assert(ds.deflate(zlibpp::FINISH) == zlibpp::STREAM_END);
+        assert(ds->total_in == 5);
+    }
+
+    cache.clear();
+    assert(cache.size() == 0);
+    delete[] pd;
+}
+
+void test6() {
+    const std::size_t size = 300 * 1024;
+    unsigned char* pd = new unsigned char[size * 4];
+    reloc_pool<16> pool(pd, size * 4);
+    std::vector<unsigned char> data(size);
+    for (std::size_t i = 0; i < size; i++) {
+        data[i] = static_cast<unsigned char>(i % 251 * (i / 1024));
+    }
+
+    // 普通の inflate で展開できる 1 つの zlib ストリームになっている
+    z_reloc::worker_pool workers(3);
+    z_reloc::sized_ptr ptr = z_reloc::deflate_parallel(pool, workers, &data[0], size, zlibpp::DEFAULT_COMPRESSION, 64 * 1024);
+    assert(ptr.ptr);
+    z_reloc::sized_ptr ptr2 = z_reloc::inflate(pool, ptr.ptr.pin().get(), ptr.size, size);
+    assert(ptr2.size == size);
+    assert(std::equal(data.begin(), data.end(), static_cast<unsigned char*>(ptr2.ptr.pin().get())));
+    pool.deallocate(ptr2.ptr);
+
+    // スレッドが無くても同じ結果になる
+    z_reloc::worker_pool inline_workers(0);
+    z_reloc::sized_ptr ptr3 = z_reloc::deflate_parallel(pool, inline_workers, &data[0], size, zlibpp::DEFAULT_COMPRESSION, 64 * 1024);
+    assert(ptr3.size == ptr.size);
+    assert(std::equal(static_cast<unsigned char*>(ptr.ptr.pin().get()),
+                      static_cast<unsigned char*>(ptr.ptr.pin().get()) + ptr.size,
+                      static_cast<unsigned char*>(ptr3.ptr.pin().get())));
+
+    pool.deallocate(ptr.ptr);
+    pool.deallocate(ptr3.ptr);
+    assert(pool.total_free() == pool.size());
+    delete[] pd;
+}
+
+void test7() {
+    const std::size_t size = 256 * 1024;
+    std::vector<unsigned char> data(size);
+    for (std::size_t i = 0; i < size; i++) {
+        data[i] = static_cast<unsigned char>(i % 251 * (i / 1024) ^ i >> 7);
+    }
+
+    const std::size_t pool_size = 64 * 1024;
+    unsigned char* pd = new unsigned char[pool_size];
+    reloc_pool<16> pool(pd, pool_size);
+
+    // プールより大きなデータを、少しずつ入力して少しずつ取り出す
+    std::vector<unsigned char> compressed;
+    std::size_t max_used = 0;
+    {
+        z_reloc::deflater<reloc_pool<16> > d(pool, zlibpp::BEST_SPEED, 1024, 4);
+        assert(d);
+        unsigned char out[700];
+        std::size_t pos = 0;
+        while (pos < size) {
+            const std::size_t n = size - pos < 5000 ? size - pos : 5000;
+            pos += d.write(&data[pos], n);
+            const std::size_t used = pool.size() - pool.total_free();
+            if (max_used < used) max_used = used;
+            while (std::size_t k = d.read(out, sizeof(out))) compressed.insert(compressed.end(), out, out + k);
+        }
+        while (!d.finish()) {
+            while (std::size_t k = d.read(out, sizeof(out))) compressed.insert(compressed.end(), out, out + k);
+        }
+        while (std::size_t k = d.read(out, sizeof(out))) compressed.insert(compressed.end(), out, out + k);
+        assert(d.done());
+        assert(d.total_in() == size);
+        assert(d.total_out() == compressed.size());
+    }
+    // 出力の領域は (max_chunks + 1) 個まで
+    assert(max_used <= 1024 * 5);
+    assert(pool.total_free() == pool.size());
+
+    // 取り出した領域をそのまま使う
+    std::vector<unsigned char> decompressed;
+    {
+        z_reloc::inflater<reloc_pool<16> > in(pool, 4096, 2);
+        std::size_t pos = 0;
+        while (!in.finished()) {
+            if (pos < compressed.size()) {
+                const std::size_t n = compressed.size() - pos < 333 ? compressed.size() - pos : 333;
+                pos += in.write(&compressed[pos], n);
+            } else {
+                in.finish();
+            }
+            z_reloc::sized_ptr c;
+            while (in.pop(c)) {
+                const unsigned char* p = static_cast<const unsigned char*>(c.ptr.pin().get());
+                decompressed.insert(decompressed.end(), p, p + c.size);
+                pool.deallocate(c.ptr);
+            }
+        }
+        assert(pos == compressed.size());
+        assert(in.done());
+    }
+    assert(decompressed == data);
+    assert(pool.total_free() == pool.size());
+
+    // 途中で切れている
+    {
+        z_reloc::inflater<reloc_pool<16> > in(pool, 4096, 2);
+        in.write(&compressed[0], 100);
+        bool thrown = false;
+        try {
+            while (!in.finish()) {
+                z_reloc::sized_ptr c;
+                while (in.pop(c)) pool.deallocate(c.ptr);
+            }
+        } catch (int) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+    assert(pool.total_free() == pool.size());
+    delete[] pd;
+}
+
+void test8() {
+    const std::size_t size = 128 * 1024;
+    std::vector<unsigned char> data(size);
+    for (std::size_t i = 0; i < size; i++) {
+        data[i] = static_cast<unsigned char>(i * 7 ^ i >> 5);
+    }
+
+    // 4KB 毎に穴の空いたプールには、連続した大きな空き領域が無い
+    const std::size_t pool_size = 512 * 1024;
+    unsigned char* pd = new unsigned char[pool_size];
+    reloc_pool<16> pool(pd, pool_size);
+    std::vector<reloc_ptr> holes;
+    while (reloc_ptr p = pool.allocate(4 * 1024)) holes.push_back(p);
+    std::vector<pinned_ptr> pins;
+    for (std::size_t i = 0; i < holes.size(); i++) {
+        if (i % 2 == 0) pool.deallocate(holes[i]);
+        else pins.push_back(holes[i].pin());
+    }
+    assert(!pool.allocate(8 * 1024));
+
+    z_reloc::chain compressed;
+    assert(z_reloc::deflate_chain(pool, compressed, &data[0], size, 4096, zlibpp::BEST_SPEED));
+    assert(compressed.segments.size() > 1);
+
+    std::vector<unsigned char> buf(compressed.size);
+    {
+        z_reloc::chain_view v(compressed);
+        std::size_t total = 0;
+        for (std::size_t i = 0; i < v.count(); i++) total += v[i].size;
+        assert(total == compressed.size);
+        assert(v.copy(0, &buf[0], buf.size()) == buf.size());
+        unsigned char b[10];
+        assert(v.copy(4090, b, 10) == 10);
+        assert(std::equal(b, b + 10, &buf[4090]));
+    }
+
+    z_reloc::chain decompressed;
+    assert(z_reloc::inflate_chain(pool, decompressed, &buf[0], buf.size(), 4096));
+    assert(decompressed.size == size);
+    assert(decompressed.segments.size() == size / 4096);
+    {
+        std::vector<unsigned char> out(size);
+        z_reloc::chain_view v(decompressed);
+        v.copy(0, &out[0], size);
+        assert(out == data);
+    }
+    // 連続した領域が無いので繋げられない
+    assert(!z_reloc::coalesce(pool, compressed).ptr);
+    assert(compressed.size == buf.size());
+    z_reloc::deallocate(pool, decompressed);
+
+    pins.clear();
+    for (std::size_t i = 1; i < holes.size(); i += 2) pool.deallocate(holes[i]);
+
+    z_reloc::sized_ptr sp = z_reloc::coalesce(pool, compressed);
+    assert(sp.ptr && sp.size == buf.size());
+    assert(compressed.segments.empty() && compressed.size == 0);
+    assert(std::equal(buf.begin(), buf.end(), static_cast<unsigned char*>(sp.ptr.pin().get())));
+    pool.deallocate(sp.ptr);
+    assert(pool.total_free() == pool.size());
+    delete[] pd;
+}
+
+void test9() {
+    const std::size_t n = 100;
+    std::vector<std::vector<char> > records(n);
+    std::vector<z_reloc::batch_input> in(n);
+    for (std::size_t i = 0; i < n; i++) {
+        records[i].resize(i % 7 == 0 ? 0 : 200 + i);
+        for (std::size_t j = 0; j < records[i].size(); j++) records[i][j] = static_cast<char>("record"[j % 6] + i % 3);
+        in[i].data = records[i].empty() ? 0 : &records[i][0];
+        in[i].size = records[i].size();
+    }
+
+    const std::size_t size = 64 * 1024;
+    unsigned char* pd = new unsigned char[size];
+    reloc_pool<16> pool(pd, size);
+
+    z_reloc::worker_pool workers(3);
+    for (int k = 0; k < 2; k++) {
+        std::vector<z_reloc::sized_ptr> out(n);
+        assert(z_reloc::deflate_batch(pool, &in[0], n, &out[0], zlibpp::BEST_SPEED, k == 0 ? 0 : &workers));
+        for (std::size_t i = 0; i < n; i++) {
+            assert(out[i].ptr);
+            z_reloc::sized_ptr d = z_reloc::inflate(pool, out[i].ptr.pin().get(), out[i].size, records[i].size() + 1);
+            assert(d.size == records[i].size());
+            assert(std::equal(records[i].begin(), records[i].end(), static_cast<char*>(d.ptr.pin().get())));
+            pool.deallocate(d.ptr);
+            pool.deallocate(out[i].ptr);
+        }
+    }
+    assert(pool.total_free() == pool.size());
+
+    // プールが足りなければ何も確保しない
+    unsigned char* pd2 = new unsigned char[1024];
+    reloc_pool<16> pool2(pd2, 1024);
+    std::vector<z_reloc::sized_ptr> out(n);
+    assert(!z_reloc::deflate_batch(pool2, &in[0], n, &out[0]));
+    assert(pool2.total_free() == pool2.size());
+
+    delete[] pd;
+    delete[] pd2;
+}
+
+void test10() {
+    // 似たような小さいレコード
+    const std::size_t n = 200;
+    std::vector<std::vector<char> > records(n);
+    std::vector<z_reloc::batch_input> samples(n);
+    for (std::size_t i = 0; i < n; i++) {
+        char buf[256];
+        const int len = std::sprintf(buf,
+            "{\"id\":%lu,\"name\":\"user%lu\",\"status\":\"%s\",\"created_at\":\"2011-%02lu-%02luT12:00:00Z\",\"tags\":[\"reloc\",\"pool\"]}",
+            (unsigned long)i, (unsigned long)(i * 7), i % 3 == 0 ? "active" : "inactive",
+            (unsigned long)(i % 12 + 1), (unsigned long)(i % 28 + 1));
+        records[i].assign(buf, buf + len);
+        samples[i].data = &records[i][0];
+        samples[i].size = records[i].size();
+    }
+
+    std::vector<unsigned char> d;
+    z_reloc::train_dictionary(&samples[0], n / 2, 4096, d);
+    assert(!d.empty() && d.size() <= 4096);
+
+    const std::size_t size = 256 * 1024;
+    unsigned char* pd = new unsigned char[size];
+    reloc_pool<16> pool(pd, size);
+    {
+        z_reloc::dictionary<reloc_pool<16> > dict(pool, &d[0], d.size());
+        assert(dict);
+        assert(dict.id() == zlibpp::adler32(1, &d[0], d.size()));
+
+        // 学習に使っていないレコードで比べる
+        std::size_t plain = 0;
+        std::size_t with_dict = 0;
+        for (std::size_t i = n / 2; i < n; i++) {
+            z_reloc::sized_ptr p1 = z_reloc::deflate(pool, &records[i][0], records[i].size());
+            z_reloc::sized_ptr p2 = z_reloc::deflate(pool, dict, &records[i][0], records[i].size());
+            plain += p1.size;
+            with_dict += p2.size;
+
+            z_reloc::sized_ptr q = z_reloc::inflate(pool, dict, p2.ptr.pin().get(), p2.size);
+            assert(q.size == records[i].size());
+            assert(std::equal(records[i].begin(), records[i].end(), static_cast<char*>(q.ptr.pin().get())));
+            pool.deallocate(q.ptr);
+
+            // 辞書が無いと展開できない
+            if (i == n / 2) {
+                bool thrown = false;
+                try {
+                    z_reloc::inflate(pool, p2.ptr.pin().get(), p2.size);
+                } catch (int r) {
+                    thrown = r == zlibpp::NEED_DICT;
+                }
+                assert(thrown);
+            }
+            pool.deallocate(p1.ptr);
+            pool.deallocate(p2.ptr);
+        }
+        assert(with_dict * 2 < plain);
+    }
+    assert(pool.total_free() == pool.size());
+    delete[] pd;
+}
+
+template<class Codec>
+void test_codec(reloc_pool<16>& pool, const std::vector<unsigned char>& data, std::size_t out_init_size) {
+    z_reloc::sized_ptr ptr = z_reloc::compress<Codec>(pool, &data[0], data.size(), out_init_size);
+    assert(ptr.ptr);
+    z_reloc::sized_ptr ptr2 = z_reloc::decompress<Codec>(pool, ptr.ptr.pin().get(), ptr.size, out_init_size);
+    assert(ptr2.size == data.size());
+    assert(std::equal(data.begin(), data.end(), static_cast<unsigned char*>(ptr2.ptr.pin().get())));
+    pool.deallocate(ptr.ptr);
+    pool.deallocate(ptr2.ptr);
+}
+
+void test11() {
+    const std::size_t size = 100 * 1000;
+    std::vector<unsigned char> data(size);
+    for (std::size_t i = 0; i < size; i++) {
+        data[i] = static_cast<unsigned char>(i % 251 * (i / 1024) ^ (i % 300 == 0 ? i : 0));
+    }
+    unsigned char* pd = new unsigned char[size * 4];
+    reloc_pool<16> pool(pd, size * 4);
+
+    // 出力サイズを推測する場合と、小さい領域から伸ばしていく場合
+    for (int i = 0; i < 2; i++) {
+        const std::size_t init = i == 0 ? 0 : 7;
+        test_codec<z_reloc::zlib_codec>(pool, data, init);
+        test_codec<z_reloc::raw_deflate_codec>(pool, data, init);
+        test_codec<z_reloc::gzip_codec>(pool, data, init);
+        test_codec<z_reloc::lz_codec>(pool, data, init);
+    }
+
+    // gzip_codec の出力は gzip 形式
+    z_reloc::sized_ptr gz = z_reloc::compress<z_reloc::gzip_codec>(pool, &data[0], size);
+    {
+        const unsigned char* p = static_cast<const unsigned char*>(gz.ptr.pin().get());
+        assert(p[0] == 0x1f && p[1] == 0x8b);
+        assert(z_reloc::gzip_codec::estimate(p, gz.size) == size);
+    }
+    pool.deallocate(gz.ptr);
+
+    // lz の境界値と壊れたデータ
+    unsigned char out[64];
+    unsigned char back[16];
+    assert(z_reloc::lz_compress("", 0, out) == 3);
+    assert(z_reloc::lz_decompress(out, 3, back, 0));
+    const std::size_t n = z_reloc::lz_compress("aaaaaaaaaaaaaaaa", 16, out);
+    assert(n < 16);
+    assert(z_reloc::lz_decompress(out, n, back, 16));
+    assert(std::memcmp(back, "aaaaaaaaaaaaaaaa", 16) == 0);
+    assert(!z_reloc::lz_decompress(out, n - 1, back, 16));
+    assert(!z_reloc::lz_decompress(out, n, back, 15));
+    out[n - 2] = 0xff; // 距離を壊す
+    assert(!z_reloc::lz_decompress(out, n, back, 16));
+
+    // 入力から展開できるサイズを超えるヘッダは信用しない (2^34 バイト)
+    if (sizeof(std::size_t) > 4) {
+        const unsigned char huge[] = { 'L', 0x80, 0x80, 0x80, 0x80, 0x40, 0x00, 0x00 };
+        std::size_t size;
+        std::size_t header_size;
+        assert(!z_reloc::lz_original_size(huge, sizeof(huge), size, header_size));
+        assert(z_reloc::lz_codec::estimate(huge, sizeof(huge)) == sizeof(huge) * 2);
+        bool thrown = false;
+        try {
+            z_reloc::decompress<z_reloc::lz_codec>(pool, huge, sizeof(huge));
+        } catch (int r) {
+            thrown = r == zlibpp::DATA_ERROR;
+        }
+        assert(thrown);
+    }
+
+    assert(pool.total_free() == pool.size());
+    delete[] pd;
+}
+
+void test12() {
+    // 計測値を直接与えて、選ばれるレベルを確かめる
+    z_reloc::level_tuner tuner(100.0, 1, 9, 4);
+    assert(tuner.level() == 1);
+    const std::size_t mb = 1024 * 1024;
+    tuner.record(1, mb, mb / 2, 5000000);   // 200MB/s, 50%
+    tuner.record(2, mb, mb / 3, 8000000);   // 125MB/s, 33%
+    tuner.record(3, mb, mb / 4, 20000000);  // 50MB/s, 25%
+    assert(tuner.level() == 2);
+    assert(tuner.stats(2).samples == 1);
+    assert(tuner.stats(3).mb_per_sec > 49.9 && tuner.stats(3).mb_per_sec < 50.1);
+    assert(tuner.stats(4).samples == 0);
+
+    // interval 回に 1 回だけ隣のレベルを試す
+    int explored = 0;
+    for (int i = 0; i < 8; i++) {
+        const int l = tuner.next_level();
+        if (l != 2) {
+            assert(l == 1 || l == 3);
+            ++explored;
+        }
+    }
+    assert(explored == 2);
+
+    // 目標を下げると圧縮率の良いレベルを選ぶ
+    tuner.set_target(10.0);
+    assert(tuner.level() == 3);
+    // どれも満たさなければ最も速いもの
+    tuner.set_target(1000.0);
+    assert(tuner.level() == 1);
+
+    // 実際に圧縮する
+    const std::size_t size = 256 * 1024;
+    unsigned char* pd = new unsigned char[size];
+    reloc_pool<16> pool(pd, size);
+    z_reloc::level_tuner t2(0.001, 1, 9, 2);
+    char data[4096];
+    for (std::size_t i = 0; i < sizeof(data); i++) data[i] = "level_tuner"[i % 11] + static_cast<char>(i / 512);
+    for (int i = 0; i < 40; i++) {
+        z_reloc::sized_ptr p = z_reloc::deflate(pool, t2, data, sizeof(data));
+        assert(p.ptr);
+        z_reloc::sized_ptr q = z_reloc::inflate(pool, p.ptr.pin().get(), p.size);
+        assert(q.size == sizeof(data));
+        pool.deallocate(p.ptr);
+        pool.deallocate(q.ptr);
+    }
+    // 目標が十分低いので、試したレベルの中で最も圧縮率の良いものを選ぶ
+    assert(t2.stats(1).samples > 0 && t2.stats(2).samples > 0);
+    assert(t2.stats(t2.level()).ratio <= t2.stats(1).ratio);
+    assert(t2.stats(t2.level()).ratio <= t2.stats(2).ratio);
+    delete[] pd;
+}
+
+void test13() {
+    const std::size_t size = 64 * 1024;
+    std::vector<unsigned char> random(size);
+    std::srand(1);
+    for (std::size_t i = 0; i < size; i++) random[i] = static_cast<unsigned char>(std::rand() >> 4);
+    std::vector<unsigned char> text(size);
+    for (std::size_t i = 0; i < size; i++) text[i] = "incompressible "[i % 15];
+
+    assert(z_reloc::sample_entropy(&random[0], size) > 7.9);
+    assert(z_reloc::sample_entropy(&text[0], size) < 4.0);
+    assert(z_reloc::looks_incompressible(&random[0], size));
+    assert(!z_reloc::looks_incompressible(&text[0], size));
+    // 小さい入力は判定しない
+    assert(!z_reloc::looks_incompressible(&random[0], 100));
+
+    unsigned char* pd = new unsigned char[size * 4];
+    reloc_pool<16> pool(pd, size * 4);
+
+    // 無圧縮ブロックで出力されるので、入力より少し大きいだけ
+    z_reloc::sized_ptr ptr = z_reloc::deflate(pool, &random[0], size);
+    assert(ptr.ptr);
+    assert(ptr.size > size && ptr.size < size + 64);
+    z_reloc::sized_ptr ptr2 = z_reloc::inflate(pool, ptr.ptr.pin().get(), ptr.size, size);
+    assert(ptr2.size == size);
+    assert(std::equal(random.begin(), random.end(), static_cast<unsigned char*>(ptr2.ptr.pin().get())));
+    pool.deallocate(ptr.ptr);
+    pool.deallocate(ptr2.ptr);
+
+    // 圧縮できるデータはそのまま
+    ptr = z_reloc::deflate(pool, &text[0], size);
+    assert(ptr.size < size / 10);
+    pool.deallocate(ptr.ptr);
+
+    delete[] pd;
+}
+
+void test14() {
+    const std::size_t n = 16;
+    const std::size_t size = 16 * 1024;
+    std::vector<std::vector<unsigned char> > data(n);
+    for (std::size_t i = 0; i < n; i++) {
+        data[i].resize(size);
+        for (std::size_t j = 0; j < size; j++) {
+            data[i][j] = static_cast<unsigned char>(j % 97 + i);
+        }
+    }
+    unsigned char* pd = new unsigned char[n * size * 2];
+    reloc_pool<16> pool(pd, n * size * 2);
+    {
+        typedef z_reloc::compressed_cache<reloc_pool<16> > cache_t;
+        cache_t cache(pool, size * 4);
+        std::vector<cache_t::handle> hs(n);
+        for (std::size_t i = 0; i < n; i++) {
+            assert(cache.insert(&data[i][0], size, hs[i]));
+            assert(cache.hot_size() <= size * 4);
+        }
+        assert(cache.count() == n);
+        assert(cache.compressions() >= n - 4);
+        assert(cache.stored_size() < n * size / 2);
+
+        // 圧縮されたエントリも元の内容で読める
+        for (std::size_t r = 0; r < 2; r++) {
+            for (std::size_t i = 0; i < n; i++) {
+                const reloc::pinned_ptr p = cache.pin(hs[i]);
+                assert(p);
+                assert(cache.size(hs[i]) == size);
+                assert(!cache.compressed(hs[i]));
+                assert(std::equal(data[i].begin(), data[i].end(), static_cast<unsigned char*>(p.get())));
+            }
+            assert(cache.hot_size() <= size * 4);
+        }
+        assert(cache.misses() > 0);
+
+        // 同じエントリばかり使うと、それは圧縮されない
+        const std::size_t misses = cache.misses();
+        for (std::size_t i = 0; i < 100; i++) cache.pin(hs[0]);
+        assert(cache.misses() <= misses + 1);
+        assert(!cache.compressed(hs[0]));
+
+        // ピンしている間は圧縮されない
+        {
+            const reloc::pinned_ptr p = cache.pin(hs[1]);
+            assert(cache.shrink(0) == size);
+            assert(!cache.compressed(hs[1]));
+        }
+        assert(cache.shrink(0) == 0);
+
+        // 消したハンドルは使い回される
+        cache.erase(hs[3]);
+        assert(cache.count() == n - 1);
+        cache_t::handle h;
+        assert(cache.insert(&data[3][0], size, h));
+        assert(h == hs[3]);
+
+        // プールが足りなくなったら他のエントリを圧縮して入れる
+        cache.set_budget(n * size * 2);
+        for (std::size_t i = 0; i < n; i++) cache.pin(hs[i]);
+        assert(cache.hot_size() == n * size);
+        std::vector<unsigned char> big(n * size + size, 'x');
+        assert(pool.max_free() < big.size());
+        assert(cache.insert(&big[0], big.size(), h));
+        assert(cache.hot_size() < n * size + big.size());
+    }
+    assert(pool.total_free() == pool.size());
+    delete[] pd;
+}
+
+void test15() {
+    // 大きさの違う入力を混ぜる
+    const std::size_t n = 64;
+    std::vector<std::vector<unsigned char> > data(n);
+    for (std::size_t i = 0; i < n; i++) {
+        data[i].resize(i % 8 == 0 ? 100 * 1000 : i * 37);
+        for (std::size_t j = 0; j < data[i].size(); j++) {
+            data[i][j] = static_cast<unsigned char>(j % 101 * i);
+        }
+    }
+    const std::size_t pool_size = 4 * 1024 * 1024;
+    unsigned char* pd = new unsigned char[pool_size];
+    reloc_pool<16> pool(pd, pool_size);
+
+    for (std::size_t threads = 0; threads <= 2; threads++) {
+        z_reloc::worker_pool workers(threads);
+        z_reloc::deflate_queue<reloc_pool<16> > q(pool, workers, zlibpp::DEFAULT_COMPRESSION, 4 * 1024);
+        for (std::size_t i = 0; i < n; i++) {
+            assert(q.submit(data[i].empty() ? 0 : &data[i][0], data[i].size(), &data[i]));
+        }
+        assert(q.pending() == n);
+
+        std::vector<z_reloc::deflate_completion> done;
+        while (q.pending() != 0) q.wait(done);
+        assert(done.size() == n);
+        assert(q.wait(done) == 0);
+        assert(q.reserved() == 0);
+
+        std::vector<bool> seen(n);
+        for (std::size_t i = 0; i < n; i++) {
+            const z_reloc::deflate_completion& c = done[i];
+            assert(c.result == zlibpp::OK && c.out.ptr);
+            const std::vector<unsigned char>& d = *static_cast<std::vector<unsigned char>*>(c.user);
+            seen[&d - &data[0]] = true;
+
+            z_reloc::sized_ptr p = z_reloc::inflate(pool, c.out.ptr.pin().get(), c.out.size, d.size() + 1);
+            assert(p.size == d.size());
+            assert(std::equal(d.begin(), d.end(), static_cast<unsigned char*>(p.ptr.pin().get())));
+            pool.deallocate(p.ptr);
+            pool.deallocate(c.out.ptr);
+        }
+        assert(std::find(seen.begin(), seen.end(), false) == seen.end());
+    }
+
+    // 引き取っていない出力でプールが埋まりそうなら断る
+    {
+        z_reloc::worker_pool workers(1);
+        z_reloc::deflate_queue<reloc_pool<16> > q(pool, workers);
+        std::vector<unsigned char> big(pool_size / 3);
+        assert(q.submit(&big[0], big.size()));
+        assert(q.submit(&big[0], big.size()));
+        assert(!q.submit(&big[0], big.size()));
+
+        std::vector<z_reloc::deflate_completion> done;
+        while (q.pending() != 0) q.wait(done);
+        assert(q.submit(&big[0], big.size()));
+        while (q.pending() != 0) q.wait(done);
+        for (std::size_t i = 0; i < done.size(); i++) pool.deallocate(done[i].out.ptr);
+    }
+    assert(pool.total_free() == pool.size());
+    delete[] pd;
+}
+
+// release されるまでワーカーを 1 つ塞いでおく
+struct blocker {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool released;
+};
+void block_until_released(void* p) {
+    blocker* const b = static_cast<blocker*>(p);
+    pthread_mutex_lock(&b->mutex);
+    while (!b->released) pthread_cond_wait(&b->cond, &b->mutex);
+    pthread_mutex_unlock(&b->mutex);
+}
+
+void test16() {
+    const std::size_t size = 300 * 1000;
+    unsigned char* pd = new unsigned char[size * 4];
+    reloc_pool<16> pool(pd, size * 4);
+    std::vector<unsigned char> data(size);
+    for (std::size_t i = 0; i < size; i++) {
+        data[i] = static_cast<unsigned char>(i % 251 * (i / 1024));
+    }
+
+    z_reloc::worker_pool workers(2);
+    z_reloc::block_index index;
+    z_reloc::sized_ptr ptr = z_reloc::deflate_indexed(pool, workers, &data[0], size, index,
+        zlibpp::DEFAULT_COMPRESSION, 64 * 1024);
+    assert(ptr.ptr);
+    assert(index.blocks.size() == 5);
+    assert(index.size() == size);
+
+    // 普通の inflate でも展開できる
+    z_reloc::sized_ptr ptr2 = z_reloc::inflate(pool, ptr.ptr.pin().get(), ptr.size, size);
+    assert(ptr2.size == size);
+    assert(std::equal(data.begin(), data.end(), static_cast<unsigned char*>(ptr2.ptr.pin().get())));
+    pool.deallocate(ptr2.ptr);
+
+    // スレッドがあっても無くても同じ結果になる
+    for (std::size_t threads = 0; threads <= 2; threads += 2) {
+        z_reloc::worker_pool w(threads);
+        ptr2 = z_reloc::inflate_parallel(pool, w, ptr.ptr.pin().get(), ptr.size, index);
+        assert(ptr2.size == size);
+        assert(std::equal(data.begin(), data.end(), static_cast<unsigned char*>(ptr2.ptr.pin().get())));
+        pool.deallocate(ptr2.ptr);
+    }
+
+    // 共有している workers に終わらないタスクがあっても、自分のタスクだけを待つ
+    {
+        blocker b = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, false };
+        workers.post(&block_until_released, &b);
+        ptr2 = z_reloc::inflate_parallel(pool, workers, ptr.ptr.pin().get(), ptr.size, index);
+        assert(ptr2.size == size);
+        pool.deallocate(ptr2.ptr);
+        pthread_mutex_lock(&b.mutex);
+        b.released = true;
+        pthread_cond_broadcast(&b.cond);
+        pthread_mutex_unlock(&b.mutex);
+        workers.wait();
+    }
+
+    // 途中の 1 ブロックだけを展開する
+    const std::size_t offset = 200 * 1000;
+    const std::size_t i = index.find(offset);
+    assert(i == 3);
+    assert(index.find(size) == index.blocks.size());
+    ptr2 = z_reloc::inflate_block(pool, ptr.ptr.pin().get(), ptr.size, index, i);
+    assert(ptr2.size == index.blocks[i].size);
+    assert(std::equal(data.begin() + index.blocks[i].offset, data.begin() + index.blocks[i].offset + ptr2.size,
+                      static_cast<unsigned char*>(ptr2.ptr.pin().get())));
+    pool.deallocate(ptr2.ptr);
+
+    // 保存して読み直した索引でも展開できる
+    std::vector<unsigned char> saved;
+    z_reloc::write_block_index(index, saved);
+    z_reloc::block_index index2;
+    assert(z_reloc::read_block_index(&saved[0], saved.size(), index2));
+    assert(index2.blocks.size() == index.blocks.size());
+    ptr2 = z_reloc::inflate_parallel(pool, workers, ptr.ptr.pin().get(), ptr.size, index2);
+    assert(ptr2.size == size);
+    pool.deallocate(ptr2.ptr);
+    assert(!z_reloc::read_block_index(&saved[0], saved.size() - 1, index2));
+
+    // 大きさの合計が溢れる索引は受け付けない
+    {
+        z_reloc::block_index broken = index;
+        broken.blocks[0].size = static_cast<std::size_t>(-1);
+        for (std::size_t j = 1; j < broken.blocks.size(); j++) {
+            broken.blocks[j].offset = broken.blocks[j - 1].offset + broken.blocks[j - 1].size;
+        }
+        assert(broken.size() < size);
+        bool thrown = false;
+        try {
+            z_reloc::inflate_parallel(pool, workers, ptr.ptr.pin().get(), ptr.size, broken);
+        } catch (int r) {
+            thrown = r == zlibpp::DATA_ERROR;
+        }
+        assert(thrown);
+
+        // 圧縮データの位置が溢れる
+        broken = index;
+        broken.blocks[0].compressed_size = static_cast<std::size_t>(-1);
+        for (std::size_t j = 1; j < broken.blocks.size(); j++) {
+            broken.blocks[j].compressed_offset = broken.blocks[j - 1].compressed_offset + broken.blocks[j - 1].compressed_size;
+        }
+        thrown = false;
+        try {
+            z_reloc::inflate_block(pool, ptr.ptr.pin().get(), ptr.size, broken, 0);
+        } catch (int r) {
+            thrown = r == zlibpp::DATA_ERROR;
+        }
+        assert(thrown);
+    }
+
+    // 壊れたデータや合わない索引は DATA_ERROR
+    {
+        bool thrown = false;
+        static_cast<unsigned char*>(ptr.ptr.pin().get())[index.blocks[2].compressed_offset + 10] ^= 0x55;
+        try {
+            z_reloc::inflate_parallel(pool, workers, ptr.ptr.pin().get(), ptr.size, index);
+        } catch (int r) {
+            thrown = r == zlibpp::DATA_ERROR;
+        }
+        assert(thrown);
+
+        thrown = false;
+        try {
+            z_reloc::inflate_parallel(pool, workers, ptr.ptr.pin().get(), ptr.size - 1, index);
+        } catch (int r) {
+            thrown = r == zlibpp::DATA_ERROR;
+        }
+        assert(thrown);
+    }
+    pool.deallocate(ptr.ptr);
+
+    // 空の入力
+    ptr = z_reloc::deflate_indexed(pool, workers, &data[0], 0, index);
+    assert(index.blocks.size() == 1 && index.size() == 0);
+    ptr2 = z_reloc::inflate_parallel(pool, workers, ptr.ptr.pin().get(), ptr.size, index);
+    assert(ptr2.ptr && ptr2.size == 0);
+    pool.deallocate(ptr.ptr);
+    pool.deallocate(ptr2.ptr);
+
+    assert(pool.total_free() == pool.size());
+    delete[] pd;
+}
+
+void test17() {
+    const std::size_t size = 2 * 1024 * 1024;
+    std::vector<unsigned char> data(size);
+    std::srand(17);
+    for (std::size_t i = 0; i < size; i++) {
+        data[i] = static_cast<unsigned char>(i % 7 == 0 ? std::rand() : i / 1000 + i % 13);
+    }
+    unsigned char* pd = new unsigned char[size * 4];
+    reloc_pool<16> pool(pd, size * 4);
+
+    z_reloc::sized_ptr ptr = z_reloc::deflate(pool, &data[0], size, 0, 1.5f, zlibpp::DEFAULT_COMPRESSION);
+    const z_reloc::sized_ptr gz = z_reloc::compress<z_reloc::gzip_codec>(pool, &data[0], size);
+    assert(ptr.ptr && gz.ptr);
+    {
+        const reloc::pinned_ptr in = ptr.ptr.pin();
+
+        z_reloc::access_index index;
+        z_reloc::build_access_index(in.get(), ptr.size, index, 256 * 1024);
+        assert(index.size == size);
+        assert(index.points.size() >= 5);
+        assert(index.points[0].offset == 0);
+        assert(index.windows.size() <= index.points.size() * 32 * 1024);
+        assert(index.find(0) == 0);
+        assert(index.find(size) == index.points.size() - 1);
+
+        // 全体を展開するついでに作っても同じになる
+        z_reloc::access_index index2;
+        z_reloc::sized_ptr whole = z_reloc::inflate(pool, index2, in.get(), ptr.size, size, 1.5f, 256 * 1024);
+        assert(whole.size == size);
+        assert(std::equal(data.begin(), data.end(), static_cast<unsigned char*>(whole.ptr.pin().get())));
+        pool.deallocate(whole.ptr);
+        assert(index2.size == size);
+        assert(index2.points.size() == index.points.size());
+        for (std::size_t i = 0; i < index.points.size(); i++) {
+            assert(index2.points[i].offset == index.points[i].offset);
+            assert(index2.points[i].compressed_offset == index.points[i].compressed_offset);
+            assert(index2.points[i].bits == index.points[i].bits);
+        }
+        assert(index2.windows == index.windows);
+
+        // 途中の一部だけを展開する
+        const std::size_t offsets[] = { 0, 1, 300 * 1000, size / 2, size - 5000 };
+        for (std::size_t i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++) {
+            const std::size_t offset = offsets[i];
+            z_reloc::sized_ptr p = z_reloc::inflate_range(pool, index, in.get(), ptr.size, offset, 4096);
+            assert(p.size == 4096);
+            assert(std::equal(data.begin() + offset, data.begin() + offset + 4096,
+                              static_cast<unsigned char*>(p.ptr.pin().get())));
+            pool.deallocate(p.ptr);
+
+            // 索引が無くても同じ結果になる
+            p = z_reloc::inflate_range(pool, in.get(), ptr.size, offset, 4096);
+            assert(p.size == 4096);
+            assert(std::equal(data.begin() + offset, data.begin() + offset + 4096,
+                              static_cast<unsigned char*>(p.ptr.pin().get())));
+            pool.deallocate(p.ptr);
+        }
+
+        // 最後を越える分は切り詰める
+        z_reloc::sized_ptr p = z_reloc::inflate_range(pool, index, in.get(), ptr.size, size - 100, 4096);
+        assert(p.size == 100);
+        pool.deallocate(p.ptr);
+        p = z_reloc::inflate_range(pool, in.get(), ptr.size, size - 100, 4096);
+        assert(p.size == 100);
+        pool.deallocate(p.ptr);
+        p = z_reloc::inflate_range(pool, index, in.get(), ptr.size, size + 1, 4096);
+        assert(p.ptr && p.size == 0);
+        pool.deallocate(p.ptr);
+        // 範囲が空なら入力は読まない
+        p = z_reloc::inflate_range(pool, index, "garbage", 7, size, 4096);
+        assert(p.ptr && p.size == 0);
+        pool.deallocate(p.ptr);
+        p = z_reloc::inflate_range(pool, index, "garbage", 7, 0, 0);
+        assert(p.ptr && p.size == 0);
+        pool.deallocate(p.ptr);
+
+        // gzip 形式でも使える
+        const reloc::pinned_ptr gin = gz.ptr.pin();
+        z_reloc::build_access_index(gin.get(), gz.size, index, 256 * 1024);
+        assert(index.size == size);
+        p = z_reloc::inflate_range(pool, index, gin.get(), gz.size, size / 3, 10000);
+        assert(p.size == 10000);
+        assert(std::equal(data.begin() + size / 3, data.begin() + size / 3 + 10000,
+                          static_cast<unsigned char*>(p.ptr.pin().get())));
+        pool.deallocate(p.ptr);
+    }
+    pool.deallocate(ptr.ptr);
+    pool.deallocate(gz.ptr);
+    assert(pool.total_free() == pool.size());
+    delete[] pd;
+}
+
+void test18() {
+    const std::size_t size = 200 * 1000;
+    std::vector<unsigned char> data(size);
+    for (std::size_t i = 0; i < size; i++) {
+        data[i] = static_cast<unsigned char>(i % 251 * (i / 1024));
+    }
+    unsigned char* pd = new unsigned char[size * 2];
+    reloc_pool<16> pool(pd, size * 2);
+
+    z_reloc::sized_ptr ptr = z_reloc::deflate(pool, &data[0], size);
+    z_reloc::sized_ptr gz = z_reloc::compress<z_reloc::gzip_codec>(pool, &data[0], size);
+    const std::size_t free = pool.total_free();
+    {
+        const reloc::pinned_ptr in = ptr.ptr.pin();
+        unsigned char* const p = static_cast<unsigned char*>(in.get());
+
+        // プールを使わずに、大きさとチェックサムが分かる
+        z_reloc::verifier v(4096);
+        z_reloc::verify_result r = v.verify(p, ptr.size);
+        assert(r.result == zlibpp::OK);
+        assert(r.size == size);
+        assert(r.adler == zlibpp::adler32(1, &data[0], size));
+        assert(r.crc == zlibpp::crc32(0, &data[0], size));
+        assert(pool.total_free() == free);
+        r = v.verify(p, ptr.size, z_reloc::verify_crc32);
+        assert(r.result == zlibpp::OK && r.adler == 1 && r.crc == zlibpp::crc32(0, &data[0], size));
+
+        // gzip 形式も同じ verifier で調べられる
+        r = v.verify(gz.ptr.pin().get(), gz.size);
+        assert(r.result == zlibpp::OK && r.size == size);
+        assert(r.crc == zlibpp::crc32(0, &data[0], size));
+
+        // 途中で終わっている
+        r = z_reloc::verify(p, ptr.size / 2);
+        assert(r.result == zlibpp::BUF_ERROR);
+        assert(r.size < size);
+
+        // 後ろに余計なデータがある
+        r = v.verify(p, ptr.size + 1);
+        assert(r.result == zlibpp::DATA_ERROR && r.size == size);
+
+        // Adler-32 が違う
+        p[ptr.size - 1] ^= 1;
+        r = v.verify(p, ptr.size);
+        assert(r.result == zlibpp::DATA_ERROR);
+        p[ptr.size - 1] ^= 1;
+        assert(v.verify(p, ptr.size).result == zlibpp::OK);
+    }
+    pool.deallocate(ptr.ptr);
+    pool.deallocate(gz.ptr);
+    delete[] pd;
+}
+
+void test19() {
+    const std::size_t size = 30000;
+    std::vector<unsigned char> data(size);
+    for (std::size_t i = 0; i < size; i++) {
+        data[i] = static_cast<unsigned char>(i % 251 * (i / 1024));
+    }
+    const std::size_t pool_size = 64 * 1024;
+    unsigned char* pd = new unsigned char[pool_size];
+    reloc_pool<16> pool(pd, pool_size);
+
+    z_reloc::try_result r = z_reloc::try_deflate(pool, &data[0], size);
+    assert(r && r.error == z_reloc::error_none && r.zlib_result == zlibpp::OK);
+    // プールの外に移しておく
+    std::vector<unsigned char> c(static_cast<unsigned char*>(r.value.ptr.pin().get()),
+                                 static_cast<unsigned char*>(r.value.ptr.pin().get()) + r.value.size);
+    pool.deallocate(r.value.ptr);
+
+    r = z_reloc::try_inflate(pool, &c[0], c.size());
+    assert(r && r.value.size == size);
+    assert(std::equal(data.begin(), data.end(), static_cast<unsigned char*>(r.value.ptr.pin().get())));
+    pool.deallocate(r.value.ptr);
+
+    // 失敗したら何も残らない
+    r = z_reloc::try_inflate(pool, &c[0], c.size() / 2);
+    assert(!r && r.error == z_reloc::error_buf && r.zlib_result == zlibpp::BUF_ERROR && !r.value.ptr);
+    assert(pool.total_free() == pool.size());
+    c[c.size() - 1] ^= 1;
+    r = z_reloc::try_inflate(pool, &c[0], c.size());
+    assert(!r && r.error == z_reloc::error_data && r.zlib_result == zlibpp::DATA_ERROR);
+    assert(pool.total_free() == pool.size());
+    c[c.size() - 1] ^= 1;
+
+    r = z_reloc::try_deflate(pool, &data[0], size, 0, 1.5f, 42);
+    assert(!r && r.error == z_reloc::error_stream_init && r.zlib_result == zlibpp::STREAM_ERROR);
+
+    // 真ん中にピンされたブロックがあると、伸ばす時に新しい領域が入らない
+    reloc::reloc_ptr filler = pool.allocate(pool_size / 2);
+    reloc::reloc_ptr blocker = pool.allocate(16);
+    pool.deallocate(filler);
+    {
+        const reloc::pinned_ptr pin = blocker.pin();
+        r = z_reloc::try_inflate(pool, &c[0], c.size(), 400);
+        assert(!r && r.error == z_reloc::error_pool_exhausted && r.zlib_result == zlibpp::OK);
+        assert(r.requested > pool.max_free());
+        assert(pool.total_free() == pool.size() - 16);
+
+        // 最も大きい空き領域を最初に確保して試し直す
+        r = z_reloc::try_inflate(pool, &c[0], c.size(), 400, 1.5f, 0, true);
+        assert(r && r.value.size == size);
+        assert(std::equal(data.begin(), data.end(), static_cast<unsigned char*>(r.value.ptr.pin().get())));
+        pool.deallocate(r.value.ptr);
+    }
+    pool.deallocate(blocker);
+    delete[] pd;
+}
+
+struct pressure_log {
+    std::vector<reloc::pressure_level> levels;
+    std::size_t total_free;
+};
+
+void record_pressure(void* context, reloc::pressure_level level, std::size_t total_free, std::size_t max_free) {
+    pressure_log& log = *static_cast<pressure_log*>(context);
+    log.levels.push_back(level);
+    log.total_free = total_free;
+}
+
+void test20() {
+    typedef z_reloc::compressed_cache<reloc_pool<16> > cache_type;
+    const std::size_t pool_size = 16 * 1024;
+    unsigned char* pd = new unsigned char[pool_size];
+    reloc_pool<16> pool(pd, pool_size);
+    pressure_log log;
+    pool.set_watermarks(8 * 1024, 2 * 1024, &record_pressure, &log);
+    assert(log.levels.empty() && pool.pressure() == reloc::pressure_none);
+
+    // budget を大きくして、自分からは圧縮しないようにしておく
+    cache_type cache(pool, pool_size);
+    std::vector<unsigned char> data(1200);
+    for (std::size_t i = 0; i < data.size(); i++) data[i] = static_cast<unsigned char>(i % 7);
+    cache_type::handle hs[12];
+    for (int i = 0; i < 12; i++) assert(cache.insert(&data[0], data.size(), hs[i]));
+    assert(cache.compressions() == 0);
+    assert(log.levels.size() == 2);
+    assert(log.levels[0] == reloc::pressure_low && log.levels[1] == reloc::pressure_critical);
+    assert(log.total_free == pool.total_free() && pool.pressure() == reloc::pressure_critical);
+    assert(!pool.allocate(5000));
+
+    // 確保に失敗する前にキャッシュを圧縮させる
+    pool.add_reclaimer(&cache_type::reclaim, &cache);
+    reloc::reloc_ptr p = pool.allocate(5000);
+    assert(p);
+    assert(cache.compressions() > 0 && cache.hot_size() <= 12 * 1200 - 5000);
+    assert(pool.pressure() == reloc::pressure_low && log.levels.back() == reloc::pressure_low);
+    {
+        const reloc::pinned_ptr pin = cache.pin(hs[0]);
+        assert(pin && std::equal(data.begin(), data.end(), static_cast<unsigned char*>(pin.get())));
+    }
+    pool.deallocate(p);
+
+    // 登録を解除すると呼ばれない
+    pool.remove_reclaimer(&cache_type::reclaim, &cache);
+    const std::size_t compressions = cache.compressions();
+    p = pool.allocate(pool.total_free() + 16);
+    assert(!p && cache.compressions() == compressions);
+
+    cache.clear();
+    assert(pool.pressure() == reloc::pressure_none && log.levels.back() == reloc::pressure_none);
+    assert(pool.check());
+    delete[] pd;
+}
+
+// 呼ばれた回数を数えるだけで、何も解放しない
+std::size_t count_reclaim(void* context, std::size_t) {
+    ++*static_cast<int*>(context);
+    return 0;
+}
+void* count_overflow_alloc(void* context, std::size_t, std::size_t) {
+    ++*static_cast<int*>(context);
+    return 0;
+}
+void count_overflow_free(void*, void*, std::size_t) {
+}
+
+void test21() {
+    // 圧縮できないデータなので、4 倍の推測では空き領域に収まらない
+    const std::size_t size = 16 * 1024;
+    std::vector<unsigned char> data(size);
+    std::srand(1);
+    for (std::size_t i = 0; i < size; i++) data[i] = static_cast<unsigned char>(std::rand() >> 4);
+    const std::size_t pool_size = 64 * 1024;
+    unsigned char* pd = new unsigned char[pool_size];
+    reloc_pool<16> pool(pd, pool_size);
+
+    z_reloc::sized_ptr ptr = z_reloc::deflate(pool, &data[0], size);
+    std::vector<unsigned char> c(static_cast<unsigned char*>(ptr.ptr.pin().get()),
+                                 static_cast<unsigned char*>(ptr.ptr.pin().get()) + ptr.size);
+    pool.deallocate(ptr.ptr);
+    assert(c.size() > size);
+
+    reloc::reloc_ptr filler = pool.allocate(16 * 1024);
+    assert(z_reloc::detail::estimate_inflate_size(&c[0], c.size()) > pool.max_free());
+    // 推測したサイズを確保できなくても、小さく始めて展開できる。
+    // 推測が外れただけでは reclaimer もプールの外への確保も使わない
+    int reclaimed = 0;
+    int overflowed = 0;
+    pool.add_reclaimer(&count_reclaim, &reclaimed);
+    const reloc::overflow_allocator counter = { &count_overflow_alloc, &count_overflow_free, &overflowed };
+    pool.set_overflow(counter);
+    z_reloc::sized_ptr ptr2 = z_reloc::inflate(pool, &c[0], c.size());
+    assert(ptr2.ptr && ptr2.size == size);
+    assert(std::equal(data.begin(), data.end(), static_cast<unsigned char*>(ptr2.ptr.pin().get())));
+    assert(reclaimed == 0 && overflowed == 0);
+    pool.deallocate(ptr2.ptr);
+    pool.remove_reclaimer(&count_reclaim, &reclaimed);
+    const reloc::overflow_allocator none = { 0, 0, 0 };
+    pool.set_overflow(none);
+
+    // gzip の ISIZE が壊れていても、圧縮率の上限を超えるサイズは確保しようとしない
+    z_reloc::sized_ptr gz = z_reloc::compress<z_reloc::gzip_codec>(pool, "abcabcabc", 9);
+    std::vector<unsigned char> g(static_cast<unsigned char*>(gz.ptr.pin().get()),
+                                 static_cast<unsigned char*>(gz.ptr.pin().get()) + gz.size);
+    pool.deallocate(gz.ptr);
+    assert(z_reloc::gzip_codec::estimate(&g[0], g.size()) == 9);
+    for (std::size_t i = 4; i > 0; i--) g[g.size() - i] = 0xff;
+    assert(z_reloc::gzip_codec::estimate(&g[0], g.size()) == g.size() * 1032);
+    // 上限に切り詰めた推測値はプールに収まるので、最初にそれだけ確保される
+    assert(g.size() * 1032 < pool.max_free());
+    pressure_log log;
+    pool.set_watermarks(pool.total_free() - g.size() * 1000, 0, &record_pressure, &log);
+    bool thrown = false;
+    try {
+        z_reloc::decompress<z_reloc::gzip_codec>(pool, &g[0], g.size());
+    } catch (int r) {
+        // 展開し終わったところで ISIZE が合わない
+        thrown = r == zlibpp::DATA_ERROR;
+    }
+    assert(thrown);
+    assert(log.levels.size() == 2);
+    assert(log.levels[0] == reloc::pressure_low && log.levels[1] == reloc::pressure_none);
+    pool.set_watermarks(0, 0, 0, 0);
+    assert(pool.total_free() == pool.size() - 16 * 1024);
+
+    pool.deallocate(filler);
+    delete[] pd;
+}
+
 int main() {
     test1();
     test2();
+    test3();
+    test4();
+    test5();
+    test6();
+    test7();
+    test8();
+    test9();
+    test10();
+    test11();
+    test12();
+    test13();
+    test14();
+    test15();
+    test16();
+    test17();
+    test18();
+    test19();
+    test20();
+    test21();
 }
 
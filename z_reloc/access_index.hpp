@@ -0,0 +1,276 @@
+#ifndef Z_RELOC_ACCESS_INDEX_HPP_INCLUDED
+#define Z_RELOC_ACCESS_INDEX_HPP_INCLUDED
+
+// 圧縮データの途中から展開するための索引 (zlib の examples/zran.c と同じやり方)
+//
+//     z_reloc::access_index index;
+//     z_reloc::build_access_index(in, size, index);      // 展開して捨てながら作る
+//     // または z_reloc::inflate(pool, index, in, size); // 全体を展開するついでに作る
+//     z_reloc::sized_ptr p = z_reloc::inflate_range(pool, index, in, size, offset, length);
+//
+// deflate のブロックの境界のうち、span バイト毎に 1 つを「アクセスポイント」として、
+// 展開後の位置、圧縮データの位置 (ビット単位)、その直前の 32KB の展開後のデータを記録しておく。
+// 途中から展開する時は、offset の手前のアクセスポイントから raw deflate として展開を始め、
+// offset までは読み捨てて length バイトだけをプールに確保する。
+// 1 つのアクセスポイントにつき 32KB を使うので、span は索引の大きさと読み捨てる量の兼ね合いで決める。
+// 普通の deflate の出力に対して使えるので、圧縮する側は何もしなくてよい。
+
+#include <cstddef>
+#include <vector>
+
+#include <zlibpp/zlibpp.hpp>
+#include <reloc/reloc_ptr.hpp>
+#include <reloc/pinned_ptr.hpp>
+#include "z_reloc.hpp"
+
+namespace z_reloc {
+
+struct access_point {
+    // 展開後のデータの中の位置
+    std::size_t offset;
+    // 圧縮データの中の、この位置から始まるバイトの位置。
+    // bits が 0 でなければ、その 1 つ前のバイトの上位 bits ビットから始まる。
+    std::size_t compressed_offset;
+    int bits;
+    // access_index::windows の中の、直前の展開後のデータの位置と大きさ
+    std::size_t window_offset;
+    std::size_t window_size;
+};
+
+struct access_index {
+    std::vector<access_point> points;
+    std::vector<unsigned char> windows;
+    // 展開後の全体の大きさ
+    std::size_t size;
+
+    access_index() : size(0) { }
+
+    void clear() {
+        points.clear();
+        windows.clear();
+        size = 0;
+    }
+    // offset 以前で最も近いアクセスポイントの番号。無ければ points.size() を返す
+    std::size_t find(std::size_t offset) const {
+        std::size_t lo = 0;
+        std::size_t hi = points.size();
+        while (lo < hi) {
+            const std::size_t mid = lo + (hi - lo) / 2;
+            if (points[mid].offset <= offset) lo = mid + 1;
+            else hi = mid;
+        }
+        return lo == 0 ? points.size() : lo - 1;
+    }
+};
+
+namespace detail {
+
+const std::size_t access_window_size = 32 * 1024;
+
+// inflate を BLOCK で呼んだ後に、必要ならアクセスポイントを追加する
+class access_index_builder {
+    access_index& index_;
+    std::size_t span_;
+    std::size_t last_;
+
+public:
+    access_index_builder(access_index& index, std::size_t span)
+        : index_(index), span_(span), last_(0) {
+        index_.clear();
+    }
+
+    // 最後のブロック以外の境界で止まっていて、前のアクセスポイントから span 以上進んでいたら true
+    bool due(const zlibpp::inflate_stream& is) const {
+        const int dt = is.data_type();
+        if ((dt & 128) == 0 || (dt & 64) != 0) return false;
+        return index_.points.empty() || is->total_out - last_ >= span_;
+    }
+
+    // 直前の展開後のデータは w1, w2 をこの順に繋げたもの
+    void add(const zlibpp::inflate_stream& is,
+        const unsigned char* w1, std::size_t n1, const unsigned char* w2, std::size_t n2) {
+
+        const access_point p = {
+            is->total_out, is->total_in, is.data_type() & 7, index_.windows.size(), n1 + n2
+        };
+        index_.windows.insert(index_.windows.end(), w1, w1 + n1);
+        index_.windows.insert(index_.windows.end(), w2, w2 + n2);
+        index_.points.push_back(p);
+        last_ = is->total_out;
+    }
+
+    void finish(std::size_t size) {
+        index_.size = size;
+    }
+};
+
+// 全体を展開しながらアクセスポイントを追加していくストリーム。
+// 出力先は連続しているので、直前の 32KB は next_out の手前にある。
+class indexing_inflate_stream {
+    zlibpp::inflate_stream is_;
+    access_index_builder builder_;
+
+public:
+    indexing_inflate_stream(access_index& index, std::size_t span)
+        : is_(zlibpp::MAX_WINDOW_BITS + 32), builder_(index, span) { }
+
+    int inflate(int) {
+        while (true) {
+            const int result = is_.inflate(zlibpp::BLOCK);
+            if (result == zlibpp::STREAM_END) builder_.finish(is_->total_out);
+            if (result != zlibpp::OK) return result;
+            if (builder_.due(is_)) {
+                const std::size_t n = is_->total_out < access_window_size ? is_->total_out : access_window_size;
+                const unsigned char* const w = static_cast<const unsigned char*>(is_->next_out) - n;
+                builder_.add(is_, w, n, 0, 0);
+            }
+            if (is_->avail_in == 0 || is_->avail_out == 0) return result;
+        }
+    }
+
+    zlibpp::stream* operator->() const { return is_.operator->(); }
+
+    typedef zlibpp::inflate_stream indexing_inflate_stream::*unspecified_bool_type;
+    operator unspecified_bool_type() const {
+        return is_ ? &indexing_inflate_stream::is_ : 0;
+    }
+};
+
+// is の現在の位置から skip バイトを読み捨てて、その後の最大 length バイトをプールに展開する
+template<class Pool>
+sized_ptr inflate_skip(Pool& pool, zlibpp::inflate_stream& is, std::size_t skip, std::size_t length) {
+    std::vector<unsigned char> scratch(skip < access_window_size ? skip + 1 : access_window_size);
+    while (skip != 0) {
+        is->next_out = &scratch[0];
+        is->avail_out = skip < scratch.size() ? skip : scratch.size();
+        const std::size_t before = is->total_out;
+        const int result = is.inflate(zlibpp::NO_FLUSH);
+        skip -= is->total_out - before;
+        if (result == zlibpp::STREAM_END) {
+            length = 0;
+            break;
+        }
+        if (result != zlibpp::OK) throw result;
+    }
+
+    reloc::reloc_ptr p = pool.allocate(length);
+    if (!p) return sized_ptr();
+    int result = zlibpp::OK;
+    std::size_t size = 0;
+    {
+        const reloc::pinned_ptr pin = p.pin();
+        is->next_out = pin.get();
+        is->avail_out = length;
+        while (is->avail_out != 0 && result == zlibpp::OK) result = is.inflate(zlibpp::NO_FLUSH);
+        size = length - is->avail_out;
+    }
+    if (result != zlibpp::OK && result != zlibpp::STREAM_END) {
+        pool.deallocate(p);
+        throw result;
+    }
+    if (size != length) p = pool.reallocate(p, size);
+    sized_ptr sp = { p, size };
+    return sp;
+}
+
+}
+
+// in を展開して捨てながら、span バイト毎にアクセスポイントを作る。
+// 使うのは 32KB の作業用のバッファだけで、プールは使わない。
+// zlib がエラーを返した場合は例外を投げる。
+inline void build_access_index(const void* in, std::size_t in_size, access_index& index,
+    std::size_t span = 1024 * 1024) {
+
+    detail::access_index_builder builder(index, span);
+    zlibpp::inflate_stream is(zlibpp::MAX_WINDOW_BITS + 32);
+    if (!is) throw zlibpp::MEM_ERROR;
+
+    // 出力は window に繰り返し書き込む
+    std::vector<unsigned char> window(detail::access_window_size);
+    unsigned char* const w = &window[0];
+    is->next_in = in;
+    is->avail_in = in_size;
+    is->avail_out = 0;
+    while (true) {
+        if (is->avail_out == 0) {
+            is->next_out = w;
+            is->avail_out = window.size();
+        }
+        const int result = is.inflate(zlibpp::BLOCK);
+        if (result == zlibpp::STREAM_END) break;
+        if (result != zlibpp::OK) throw result;
+        if (builder.due(is)) {
+            // 次に書き込む位置より後ろが古いデータ
+            const std::size_t pos = static_cast<unsigned char*>(is->next_out) - w;
+            if (is->total_out >= window.size()) {
+                builder.add(is, w + pos, window.size() - pos, w, pos);
+            } else {
+                builder.add(is, w, pos, 0, 0);
+            }
+        }
+    }
+    builder.finish(is->total_out);
+}
+
+// 全体を展開しながら index を作る。他の引数の意味は z_reloc.hpp の inflate と同じ。
+template<class Pool>
+sized_ptr inflate(Pool& pool, access_index& index, const void* in, std::size_t in_size,
+    std::size_t out_init_size = 0, float rate = 1.5f, std::size_t span = 1024 * 1024) {
+
+    detail::indexing_inflate_stream is(index, span);
+    if (!is) throw zlibpp::MEM_ERROR;
+    if (out_init_size == 0) out_init_size = detail::estimate_inflate_size(in, in_size);
+    return detail::zlib_reloc(pool, in, in_size, out_init_size, rate, is, &detail::indexing_inflate_stream::inflate);
+}
+
+// 展開後のデータの [offset, offset + length) だけをプールに展開する。
+// データがそれより短ければ、あるところまでになる。
+// 索引が無いので先頭から展開して offset まで読み捨てる。
+template<class Pool>
+sized_ptr inflate_range(Pool& pool, const void* in, std::size_t in_size, std::size_t offset, std::size_t length) {
+    zlibpp::inflate_stream is(zlibpp::MAX_WINDOW_BITS + 32);
+    if (!is) throw zlibpp::MEM_ERROR;
+    is->next_in = in;
+    is->avail_in = in_size;
+    return detail::inflate_skip(pool, is, offset, length);
+}
+
+// index の offset の手前のアクセスポイントから展開する
+template<class Pool>
+sized_ptr inflate_range(Pool& pool, const access_index& index, const void* in, std::size_t in_size,
+    std::size_t offset, std::size_t length) {
+
+    if (offset >= index.size) length = 0;
+    else if (length > index.size - offset) length = index.size - offset;
+    // 展開するものが無ければ、入力は読まずに空の結果を返す
+    if (length == 0) {
+        const reloc::reloc_ptr p = pool.allocate(0);
+        if (!p) return sized_ptr();
+        const sized_ptr sp = { p, 0 };
+        return sp;
+    }
+
+    const std::size_t i = index.find(offset);
+    if (i == index.points.size()) return inflate_range(pool, in, in_size, offset, length);
+    const access_point& ap = index.points[i];
+    if (ap.compressed_offset > in_size || (ap.bits != 0 && ap.compressed_offset == 0)) throw zlibpp::DATA_ERROR;
+
+    zlibpp::inflate_stream is(-zlibpp::MAX_WINDOW_BITS);
+    if (!is) throw zlibpp::MEM_ERROR;
+    const unsigned char* const src = static_cast<const unsigned char*>(in);
+    if (ap.bits != 0) {
+        const int result = is.prime(ap.bits, src[ap.compressed_offset - 1] >> (8 - ap.bits));
+        if (result != zlibpp::OK) throw result;
+    }
+    if (ap.window_size != 0) {
+        const int result = is.set_dictionary(&index.windows[ap.window_offset], ap.window_size);
+        if (result != zlibpp::OK) throw result;
+    }
+    is->next_in = src + ap.compressed_offset;
+    is->avail_in = in_size - ap.compressed_offset;
+    return detail::inflate_skip(pool, is, offset - ap.offset, length);
+}
+
+}
+
+#endif // Z_RELOC_ACCESS_INDEX_HPP_INCLUDED
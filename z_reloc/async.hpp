@@ -0,0 +1,261 @@
+#ifndef Z_RELOC_ASYNC_HPP_INCLUDED
+#define Z_RELOC_ASYNC_HPP_INCLUDED
+
+// 圧縮を worker_pool で行い、終わったものを後で受け取る
+//
+//     z_reloc::worker_pool workers(2);
+//     z_reloc::deflate_queue<Pool> q(pool, workers);
+//     if (!q.submit(in, size, user)) {
+//         // プールの空きが足りないので、poll して出力を引き取るか後で試す
+//     }
+//     std::vector<z_reloc::deflate_completion> done;
+//     q.poll(done); // 終わっているものだけ。待つなら q.wait(done)
+//
+// submit した入力は、完了を受け取るまで有効で、動かないこと (プールの領域ならピンしておく)。
+// ワーカーは作業用のバッファに圧縮するだけで、出力をプールに確保してコピーするのは
+// poll, wait を呼んだスレッドなので、プールを操作するのは常に呼び出し側のスレッドになる。
+//
+// 小さい入力は batch_size バイトまでまとめて 1 つのタスクにし、
+// 1 つのストリームを reset しながら使い回して圧縮する。
+// z_reloc.hpp の deflate と同じく、looks_incompressible な入力は無圧縮で出力する。
+// まとめ途中のものは、溜まるか poll, wait, flush を呼んだ時にワーカーに渡される。
+//
+// workers は deflate_parallel, deflate_batch, inflate_parallel と共有してよい。
+// それらは自分が post したタスクだけを待つ (worker_pool::task_group)。
+//
+// まだ引き取っていない出力の上限 (deflateBound) の合計を覚えておき、
+// プールの total_free() がそれを下回る場合は submit が失敗する。
+// deflate_queue はスレッドセーフではない。
+
+#include <cstddef>
+#include <cstring>
+#include <vector>
+#include <pthread.h>
+
+#include <zlibpp/zlibpp.hpp>
+#include <reloc/reloc_ptr.hpp>
+#include <reloc/pinned_ptr.hpp>
+#include "z_reloc.hpp"
+#include "worker_pool.hpp"
+
+namespace z_reloc {
+
+struct deflate_completion {
+    // submit に渡したもの
+    void* user;
+    // 出力。プールに確保できなければ空
+    sized_ptr out;
+    // zlib の戻り値。成功なら zlibpp::OK
+    int result;
+};
+
+namespace detail {
+
+struct async_job {
+    const void* in;
+    std::size_t size;
+    void* user;
+    // 出力の上限。プールの空きを確認する時に使う
+    std::size_t bound;
+    std::vector<unsigned char> out;
+    int result;
+};
+
+struct async_shared {
+    pthread_mutex_t mutex;
+    pthread_cond_t done;
+    // 終わったタスク
+    std::vector<std::vector<async_job>*> finished;
+    // ワーカーに渡して、まだ終わっていないタスクの数
+    std::size_t running;
+};
+
+struct async_task {
+    async_shared* shared;
+    std::vector<async_job>* jobs;
+    int level;
+};
+
+inline void deflate_async_task(void* p) {
+    const async_task t = *static_cast<async_task*>(p);
+    delete static_cast<async_task*>(p);
+
+    std::vector<async_job>& jobs = *t.jobs;
+    zlibpp::stream_ptr normal;
+    // 圧縮できないデータ用
+    zlibpp::stream_ptr stored;
+    for (std::size_t i = 0; i < jobs.size(); i++) {
+        async_job& job = jobs[i];
+        const bool incompressible = t.level != zlibpp::NO_COMPRESSION && looks_incompressible(job.in, job.size);
+        zlibpp::stream_ptr& sp = incompressible ? stored : normal;
+        if (!sp) zlibpp::deflate_init(sp, incompressible ? zlibpp::NO_COMPRESSION : t.level);
+        if (!sp) {
+            job.result = zlibpp::MEM_ERROR;
+            continue;
+        }
+        try {
+            job.out.resize(job.bound == 0 ? 1 : job.bound);
+        } catch (...) {
+            job.result = zlibpp::MEM_ERROR;
+            continue;
+        }
+        sp->next_in = job.in;
+        sp->avail_in = job.size;
+        sp->next_out = &job.out[0];
+        sp->avail_out = job.out.size();
+        int result = zlibpp::deflate(sp, zlibpp::FINISH);
+        if (result == zlibpp::STREAM_END) {
+            job.out.resize(sp->total_out);
+            result = zlibpp::OK;
+        } else if (result == zlibpp::OK) {
+            result = zlibpp::BUF_ERROR;
+        }
+        // 失敗した時も次のジョブの前に必ずリセットする。リセットできなければ次のジョブで作り直す
+        if (zlibpp::deflate_reset(sp) != zlibpp::OK) sp.reset();
+        job.result = result;
+    }
+
+    pthread_mutex_lock(&t.shared->mutex);
+    t.shared->finished.push_back(t.jobs);
+    --t.shared->running;
+    pthread_cond_broadcast(&t.shared->done);
+    pthread_mutex_unlock(&t.shared->mutex);
+}
+
+}
+
+template<class Pool>
+class deflate_queue {
+    Pool& pool_;
+    worker_pool& workers_;
+    int level_;
+    std::size_t batch_size_;
+    std::size_t max_jobs_;
+    // deflateBound を求めるためだけのストリーム
+    zlibpp::deflate_stream bound_stream_;
+
+    detail::async_shared shared_;
+    // まとめ途中のタスク
+    std::vector<detail::async_job>* batch_;
+    std::size_t batch_bytes_;
+    // 引き取っていない出力の上限の合計
+    std::size_t reserved_;
+    std::size_t jobs_;
+
+    deflate_queue(const deflate_queue&);
+    deflate_queue& operator=(const deflate_queue&);
+
+    void post_batch() {
+        if (!batch_) return;
+        detail::async_task* t = new detail::async_task();
+        t->shared = &shared_;
+        t->jobs = batch_;
+        t->level = level_;
+        batch_ = 0;
+        batch_bytes_ = 0;
+
+        pthread_mutex_lock(&shared_.mutex);
+        ++shared_.running;
+        pthread_mutex_unlock(&shared_.mutex);
+        workers_.post(&detail::deflate_async_task, t);
+    }
+
+    // 終わったタスクの出力をプールに確保して out に追加する
+    std::size_t collect(std::vector<deflate_completion>& out) {
+        std::vector<std::vector<detail::async_job>*> finished;
+        pthread_mutex_lock(&shared_.mutex);
+        finished.swap(shared_.finished);
+        pthread_mutex_unlock(&shared_.mutex);
+
+        std::size_t n = 0;
+        for (std::size_t i = 0; i < finished.size(); i++) {
+            std::vector<detail::async_job>& jobs = *finished[i];
+            for (std::size_t j = 0; j < jobs.size(); j++) {
+                const detail::async_job& job = jobs[j];
+                deflate_completion c = { job.user, sized_ptr(), job.result };
+                if (job.result == zlibpp::OK) {
+                    c.out.ptr = pool_.allocate(job.out.size());
+                    if (c.out.ptr) {
+                        std::memcpy(c.out.ptr.pin().get(), &job.out[0], job.out.size());
+                        c.out.size = job.out.size();
+                    }
+                }
+                out.push_back(c);
+                reserved_ -= job.bound;
+                --jobs_;
+                ++n;
+            }
+            delete finished[i];
+        }
+        return n;
+    }
+
+public:
+    // batch_size バイトに満たない入力はまとめてからワーカーに渡す。0 ならまとめない。
+    // 引き取っていないものが max_jobs 個あると submit が失敗する。
+    deflate_queue(Pool& pool, worker_pool& workers, int level = zlibpp::BEST_COMPRESSION,
+        std::size_t batch_size = 64 * 1024, std::size_t max_jobs = 1024)
+        : pool_(pool), workers_(workers), level_(level), batch_size_(batch_size), max_jobs_(max_jobs),
+          bound_stream_(level), batch_(0), batch_bytes_(0), reserved_(0), jobs_(0) {
+        pthread_mutex_init(&shared_.mutex, 0);
+        pthread_cond_init(&shared_.done, 0);
+        shared_.running = 0;
+    }
+    // ワーカーに渡したものが終わるのを待ってから破棄する。引き取っていない出力は捨てる。
+    ~deflate_queue() {
+        delete batch_;
+        pthread_mutex_lock(&shared_.mutex);
+        while (shared_.running != 0) pthread_cond_wait(&shared_.done, &shared_.mutex);
+        pthread_mutex_unlock(&shared_.mutex);
+        for (std::size_t i = 0; i < shared_.finished.size(); i++) delete shared_.finished[i];
+        pthread_cond_destroy(&shared_.done);
+        pthread_mutex_destroy(&shared_.mutex);
+    }
+
+    // in_size バイトの圧縮を依頼する。
+    // 出力の上限だけのプールの空きが無いか、引き取っていないものが多すぎる場合は false を返す。
+    bool submit(const void* in, std::size_t in_size, void* user = 0) {
+        const std::size_t bound = bound_stream_.bound(in_size);
+        if (jobs_ >= max_jobs_ || pool_.total_free() < reserved_ + bound) return false;
+
+        if (!batch_) batch_ = new std::vector<detail::async_job>();
+        const detail::async_job job = { in, in_size, user, bound, std::vector<unsigned char>(), zlibpp::OK };
+        batch_->push_back(job);
+        batch_bytes_ += in_size;
+        reserved_ += bound;
+        ++jobs_;
+        if (batch_bytes_ >= batch_size_) post_batch();
+        return true;
+    }
+
+    // まとめ途中のものをワーカーに渡す
+    void flush() {
+        post_batch();
+    }
+
+    // 終わっているものを out に追加して、その数を返す。待たない。
+    std::size_t poll(std::vector<deflate_completion>& out) {
+        post_batch();
+        return collect(out);
+    }
+
+    // 1 つ以上終わるまで待ってから poll する。何も依頼していなければ 0 を返す。
+    std::size_t wait(std::vector<deflate_completion>& out) {
+        post_batch();
+        pthread_mutex_lock(&shared_.mutex);
+        while (shared_.finished.empty() && shared_.running != 0) {
+            pthread_cond_wait(&shared_.done, &shared_.mutex);
+        }
+        pthread_mutex_unlock(&shared_.mutex);
+        return collect(out);
+    }
+
+    // 引き取っていないものの数
+    std::size_t pending() const { return jobs_; }
+    // 引き取っていない出力の上限の合計
+    std::size_t reserved() const { return reserved_; }
+};
+
+}
+
+#endif // Z_RELOC_ASYNC_HPP_INCLUDED
@@ -0,0 +1,135 @@
+#ifndef Z_RELOC_BATCH_HPP_INCLUDED
+#define Z_RELOC_BATCH_HPP_INCLUDED
+
+// 小さいデータをたくさん、まとめて圧縮する
+//
+//     std::vector<z_reloc::batch_input> in(n);
+//     std::vector<z_reloc::sized_ptr> out(n);
+//     z_reloc::deflate_batch(pool, &in[0], n, &out[0]);
+//
+// 1 つのストリームを reset しながら使い回して作業用のバッファへ圧縮し、
+// 出力は reloc_pool::allocate_batch でまとめて確保してからコピーする。
+// workers を渡すと、入力をスレッド数で分けて並列に圧縮する。
+// プールを操作するのは呼び出したスレッドだけ。
+
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+#include <zlibpp/zlibpp.hpp>
+#include <reloc/reloc_ptr.hpp>
+#include <reloc/pinned_ptr.hpp>
+#include "z_reloc.hpp"
+#include "worker_pool.hpp"
+
+namespace z_reloc {
+
+struct batch_input {
+    const void* data;
+    std::size_t size;
+};
+
+namespace detail {
+
+struct batch_task {
+    const batch_input* in;
+    std::size_t n;
+    int level;
+    // 作業用のバッファ内の、各出力を書き込む位置と大きさ
+    unsigned char* scratch;
+    const std::size_t* offsets;
+    const std::size_t* capacities;
+    std::size_t* sizes;
+    int result;
+};
+
+inline void deflate_batch_task(void* p) {
+    batch_task& t = *static_cast<batch_task*>(p);
+    t.result = zlibpp::OK;
+    if (t.n == 0) return;
+
+    zlibpp::deflate_stream ds(t.level);
+    if (!ds) {
+        t.result = zlibpp::MEM_ERROR;
+        return;
+    }
+    for (std::size_t i = 0; i < t.n; i++) {
+        if (i != 0 && (t.result = ds.reset()) != zlibpp::OK) return;
+        ds->next_in = t.in[i].data;
+        ds->avail_in = t.in[i].size;
+        ds->next_out = t.scratch + t.offsets[i];
+        ds->avail_out = t.capacities[i];
+        const int result = ds.deflate(zlibpp::FINISH);
+        if (result != zlibpp::STREAM_END) {
+            t.result = result == zlibpp::OK ? zlibpp::BUF_ERROR : result;
+            return;
+        }
+        t.sizes[i] = ds->total_out;
+    }
+}
+
+}
+
+// 全て確保できた場合だけ out に入れて true を返す。
+// zlib がエラーを返した場合は例外を投げる。
+template<class Pool>
+bool deflate_batch(Pool& pool, const batch_input* in, std::size_t n, sized_ptr* out,
+    int level = zlibpp::BEST_COMPRESSION, worker_pool* workers = 0) {
+
+    if (n == 0) return true;
+
+    std::vector<std::size_t> offsets(n);
+    std::vector<std::size_t> capacities(n);
+    std::vector<std::size_t> sizes(n);
+    std::size_t scratch_size = 0;
+    {
+        // ストリームを作らずに、どのレベルでも足りる保守的な上限を使う
+        const zlibpp::stream_ptr none;
+        for (std::size_t i = 0; i < n; i++) {
+            offsets[i] = scratch_size;
+            capacities[i] = zlibpp::deflate_bound(none, in[i].size);
+            scratch_size += capacities[i];
+        }
+    }
+    std::vector<unsigned char> scratch(scratch_size == 0 ? 1 : scratch_size);
+
+    const std::size_t threads = workers ? workers->size() : 0;
+    const std::size_t tasks = threads < 2 ? 1 : threads < n ? threads : n;
+    std::vector<detail::batch_task> ts(tasks);
+    for (std::size_t i = 0; i < tasks; i++) {
+        const std::size_t first = n * i / tasks;
+        const std::size_t last = n * (i + 1) / tasks;
+        detail::batch_task t = {
+            in + first, last - first, level,
+            &scratch[0], &offsets[first], &capacities[first], &sizes[first], zlibpp::OK
+        };
+        ts[i] = t;
+    }
+    if (tasks == 1) {
+        detail::deflate_batch_task(&ts[0]);
+    } else {
+        // 他の用途と共有している workers でも、自分のタスクだけを待つ
+        worker_pool::task_group group;
+        for (std::size_t i = 0; i < tasks; i++) workers->post(group, &detail::deflate_batch_task, &ts[i]);
+        workers->wait(group);
+    }
+    for (std::size_t i = 0; i < tasks; i++) {
+        if (ts[i].result != zlibpp::OK) throw ts[i].result;
+    }
+
+    std::vector<reloc::reloc_ptr> ps(n);
+    if (!pool.allocate_batch(&sizes[0], n, &ps[0])) return false;
+    for (std::size_t i = 0; i < n; i++) {
+        {
+            reloc::pinned_ptr pin = ps[i].pin();
+            std::memcpy(pin.get(), &scratch[offsets[i]], sizes[i]);
+        }
+        out[i].ptr = ps[i];
+        out[i].size = sizes[i];
+    }
+    return true;
+}
+
+}
+
+#endif // Z_RELOC_BATCH_HPP_INCLUDED
@@ -0,0 +1,296 @@
+#ifndef Z_RELOC_BLOCK_INDEX_HPP_INCLUDED
+#define Z_RELOC_BLOCK_INDEX_HPP_INCLUDED
+
+// 単独で展開できるブロックに分けて圧縮し、その位置の一覧 (block_index) を作る
+//
+//     z_reloc::block_index index;
+//     z_reloc::sized_ptr p = z_reloc::deflate_indexed(pool, workers, in, size, index);
+//     z_reloc::sized_ptr q = z_reloc::inflate_parallel(pool, workers, p.ptr.pin().get(), p.size, index);
+//     // offset を含むブロックだけを展開する
+//     z_reloc::sized_ptr r = z_reloc::inflate_block(pool, p.ptr.pin().get(), p.size, index, index.find(offset));
+//
+// 各ブロックは辞書を使わずに raw deflate で圧縮し、最後以外は SYNC_FLUSH でバイト境界に揃える。
+// 全体は parallel.hpp の deflate_parallel と同じく普通の zlib ストリームなので、
+// 索引が無くても inflate で展開できる (辞書を使わない分、圧縮率は少し落ちる)。
+// 索引は write_block_index, read_block_index で圧縮データとは別に保存できる。
+
+#include <cstddef>
+#include <vector>
+#include <algorithm>
+
+#include <zlibpp/zlibpp.hpp>
+#include <reloc/reloc_ptr.hpp>
+#include <reloc/pinned_ptr.hpp>
+#include "z_reloc.hpp"
+#include "worker_pool.hpp"
+#include "parallel.hpp"
+
+namespace z_reloc {
+
+struct indexed_block {
+    // 展開後のデータの中の位置と大きさ
+    std::size_t offset;
+    std::size_t size;
+    // 圧縮データの中の位置と大きさ
+    std::size_t compressed_offset;
+    std::size_t compressed_size;
+    // 展開後のデータの Adler-32
+    unsigned long adler;
+};
+
+struct block_index {
+    std::vector<indexed_block> blocks;
+
+    // 展開後の全体の大きさ
+    std::size_t size() const {
+        return blocks.empty() ? 0 : blocks.back().offset + blocks.back().size;
+    }
+    // offset を含むブロックの番号。範囲外なら blocks.size() を返す
+    std::size_t find(std::size_t offset) const {
+        std::size_t lo = 0;
+        std::size_t hi = blocks.size();
+        while (lo < hi) {
+            const std::size_t mid = lo + (hi - lo) / 2;
+            if (blocks[mid].offset + blocks[mid].size <= offset) lo = mid + 1;
+            else hi = mid;
+        }
+        return lo < blocks.size() && blocks[lo].offset <= offset ? lo : blocks.size();
+    }
+};
+
+namespace detail {
+
+struct inflate_block_task {
+    const unsigned char* in;
+    std::size_t in_size;
+    unsigned char* out;
+    std::size_t out_size;
+    bool last;
+    unsigned long adler;
+    int result;
+};
+
+// ワーカーで実行される
+inline void inflate_indexed_block(void* p) {
+    inflate_block_task& t = *static_cast<inflate_block_task*>(p);
+    zlibpp::inflate_stream is(-zlibpp::MAX_WINDOW_BITS);
+    if (!is) {
+        t.result = zlibpp::MEM_ERROR;
+        return;
+    }
+    // 空のブロックでも書き込み先が要る
+    unsigned char dummy;
+    is->next_in = t.in;
+    is->avail_in = t.in_size;
+    is->next_out = t.out_size == 0 ? &dummy : t.out;
+    is->avail_out = t.out_size;
+    const int result = is.inflate(zlibpp::SYNC_FLUSH);
+
+    // 最後のブロックはストリームの終わりまで、それ以外は入力を使い切ってぴったり埋まること
+    const bool ok = t.last ? result == zlibpp::STREAM_END : result == zlibpp::OK && is->avail_in == 0;
+    if (!ok || is->total_out != t.out_size) {
+        t.result = result == zlibpp::OK || result == zlibpp::STREAM_END ? zlibpp::DATA_ERROR : result;
+        return;
+    }
+    t.result = zlibpp::adler32(1, t.out, t.out_size) == t.adler ? zlibpp::OK : zlibpp::DATA_ERROR;
+}
+
+inline void check_block_index(const block_index& index, std::size_t in_size) {
+    // ヘッダ 2 バイトの後から隙間なく並んでいて、Adler-32 の 4 バイトが残ること。
+    // 索引は read_block_index で読んだものかもしれないので、足し算が溢れないことも確認する。
+    if (index.blocks.empty() || in_size < 6) throw zlibpp::DATA_ERROR;
+    const std::size_t max = static_cast<std::size_t>(-1);
+    const std::size_t end = in_size - 4;
+    std::size_t offset = 0;
+    std::size_t pos = 2;
+    for (std::size_t i = 0; i < index.blocks.size(); i++) {
+        const indexed_block& b = index.blocks[i];
+        if (b.offset != offset || b.compressed_offset != pos) throw zlibpp::DATA_ERROR;
+        if (b.size > max - offset || b.compressed_size > end - pos) throw zlibpp::DATA_ERROR;
+        offset += b.size;
+        pos += b.compressed_size;
+    }
+    if (pos != end) throw zlibpp::DATA_ERROR;
+}
+
+}
+
+// 入力を block_size 毎に分けて、単独で展開できるように並列に圧縮し、index に各ブロックの位置を入れる。
+// 空の入力も 1 つのブロックになる。
+// プールが足りなければ空の sized_ptr を返し、zlib がエラーを返した場合は例外を投げる。
+template<class Pool>
+sized_ptr deflate_indexed(Pool& pool, worker_pool& workers, const void* in, std::size_t in_size,
+    block_index& index, int level = zlibpp::BEST_COMPRESSION, std::size_t block_size = 128 * 1024) {
+
+    if (block_size == 0) block_size = 1;
+    std::vector<detail::parallel_block> blocks;
+    const sized_ptr sp = detail::deflate_blocks(pool, workers, in, in_size, level, block_size, true, blocks);
+    if (!sp.ptr) return sp;
+
+    index.blocks.resize(blocks.size());
+    std::size_t offset = 0;
+    std::size_t pos = 2;
+    for (std::size_t i = 0; i < blocks.size(); i++) {
+        const indexed_block b = { offset, blocks[i].in_size, pos, blocks[i].out_size, blocks[i].adler };
+        index.blocks[i] = b;
+        offset += b.size;
+        pos += b.compressed_size;
+    }
+    return sp;
+}
+
+// deflate_indexed の出力を、ブロック毎に worker_pool で並列に展開する。
+// 出力は index から分かる大きさで 1 つだけ確保し、その中に各ワーカーが直接書き込む。
+// in が index と合わない場合や、展開した結果の Adler-32 が違う場合は zlibpp::DATA_ERROR を投げる。
+template<class Pool>
+sized_ptr inflate_parallel(Pool& pool, worker_pool& workers, const void* in, std::size_t in_size,
+    const block_index& index) {
+
+    detail::check_block_index(index, in_size);
+    const unsigned char* const src = static_cast<const unsigned char*>(in);
+    const std::size_t n = index.blocks.size();
+    const std::size_t size = index.size();
+
+    reloc::reloc_ptr p = pool.allocate(size);
+    if (!p) return sized_ptr();
+
+    unsigned long adler = 1;
+    {
+        reloc::pinned_ptr pin = p.pin();
+        unsigned char* const out = static_cast<unsigned char*>(pin.get());
+
+        std::vector<detail::inflate_block_task> tasks(n);
+        for (std::size_t i = 0; i < n; i++) {
+            const indexed_block& b = index.blocks[i];
+            const detail::inflate_block_task t = {
+                src + b.compressed_offset, b.compressed_size, out + b.offset, b.size,
+                i + 1 == n, b.adler, zlibpp::OK
+            };
+            tasks[i] = t;
+        }
+        worker_pool::task_group group;
+        for (std::size_t i = 0; i < n; i++) {
+            workers.post(group, &detail::inflate_indexed_block, &tasks[i]);
+        }
+        workers.wait(group);
+
+        for (std::size_t i = 0; i < n; i++) {
+            if (tasks[i].result != zlibpp::OK) {
+                pin.reset();
+                pool.deallocate(p);
+                throw tasks[i].result;
+            }
+            adler = zlibpp::adler32_combine(adler, index.blocks[i].adler, index.blocks[i].size);
+        }
+    }
+
+    const unsigned char* const t = src + in_size - 4;
+    const unsigned long expected =
+        static_cast<unsigned long>(t[0]) << 24 | static_cast<unsigned long>(t[1]) << 16 |
+        static_cast<unsigned long>(t[2]) << 8 | static_cast<unsigned long>(t[3]);
+    if (adler != expected) {
+        pool.deallocate(p);
+        throw zlibpp::DATA_ERROR;
+    }
+    sized_ptr sp = { p, size };
+    return sp;
+}
+
+// i 番目のブロックだけを展開する
+template<class Pool>
+sized_ptr inflate_block(Pool& pool, const void* in, std::size_t in_size,
+    const block_index& index, std::size_t i) {
+
+    detail::check_block_index(index, in_size);
+    if (i >= index.blocks.size()) throw zlibpp::BUF_ERROR;
+    const indexed_block& b = index.blocks[i];
+
+    reloc::reloc_ptr p = pool.allocate(b.size);
+    if (!p) return sized_ptr();
+    detail::inflate_block_task t = {
+        static_cast<const unsigned char*>(in) + b.compressed_offset, b.compressed_size, 0, b.size,
+        i + 1 == index.blocks.size(), b.adler, zlibpp::OK
+    };
+    {
+        const reloc::pinned_ptr pin = p.pin();
+        t.out = static_cast<unsigned char*>(pin.get());
+        detail::inflate_indexed_block(&t);
+    }
+    if (t.result != zlibpp::OK) {
+        pool.deallocate(p);
+        throw t.result;
+    }
+    sized_ptr sp = { p, b.size };
+    return sp;
+}
+
+namespace detail {
+
+inline void write_leb128(std::vector<unsigned char>& out, std::size_t v) {
+    do {
+        out.push_back(static_cast<unsigned char>((v & 0x7f) | (v >= 0x80 ? 0x80 : 0)));
+        v >>= 7;
+    } while (v != 0);
+}
+
+inline bool read_leb128(const unsigned char*& p, const unsigned char* end, std::size_t& v) {
+    v = 0;
+    for (std::size_t shift = 0; p != end && shift < sizeof(std::size_t) * 8; shift += 7) {
+        const unsigned char b = *p++;
+        v |= static_cast<std::size_t>(b & 0x7f) << shift;
+        if ((b & 0x80) == 0) return true;
+    }
+    return false;
+}
+
+const unsigned char block_index_magic = 'I';
+
+}
+
+// index を out の後ろに追加する。
+// 形式は 'I', ブロック数, 各ブロックの (展開後の大きさ, 圧縮後の大きさ, Adler-32) で、
+// 数は LEB128、Adler-32 は 4 バイトのビッグエンディアン。位置は大きさから求める。
+inline void write_block_index(const block_index& index, std::vector<unsigned char>& out) {
+    out.push_back(detail::block_index_magic);
+    detail::write_leb128(out, index.blocks.size());
+    for (std::size_t i = 0; i < index.blocks.size(); i++) {
+        const indexed_block& b = index.blocks[i];
+        detail::write_leb128(out, b.size);
+        detail::write_leb128(out, b.compressed_size);
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            out.push_back(static_cast<unsigned char>(b.adler >> shift));
+        }
+    }
+}
+
+// write_block_index で書いたものを読む。壊れていれば false を返す。
+inline bool read_block_index(const void* in, std::size_t in_size, block_index& index) {
+    const unsigned char* p = static_cast<const unsigned char*>(in);
+    const unsigned char* const end = p + in_size;
+    std::size_t n;
+    if (p == end || *p++ != detail::block_index_magic || !detail::read_leb128(p, end, n)) return false;
+    // 1 ブロックにつき最低 6 バイト
+    if (n > static_cast<std::size_t>(end - p) / 6) return false;
+
+    std::vector<indexed_block> blocks(n);
+    std::size_t offset = 0;
+    std::size_t pos = 2;
+    for (std::size_t i = 0; i < n; i++) {
+        indexed_block& b = blocks[i];
+        if (!detail::read_leb128(p, end, b.size) || !detail::read_leb128(p, end, b.compressed_size)) return false;
+        if (end - p < 4) return false;
+        b.adler = static_cast<unsigned long>(p[0]) << 24 | static_cast<unsigned long>(p[1]) << 16 |
+                  static_cast<unsigned long>(p[2]) << 8 | static_cast<unsigned long>(p[3]);
+        p += 4;
+        b.offset = offset;
+        b.compressed_offset = pos;
+        offset += b.size;
+        pos += b.compressed_size;
+    }
+    index.blocks.swap(blocks);
+    return true;
+}
+
+}
+
+#endif // Z_RELOC_BLOCK_INDEX_HPP_INCLUDED
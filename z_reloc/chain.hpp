@@ -0,0 +1,205 @@
+#ifndef Z_RELOC_CHAIN_HPP_INCLUDED
+#define Z_RELOC_CHAIN_HPP_INCLUDED
+
+// 出力を 1 つの領域に伸ばしていく代わりに、固定サイズの領域を繋げていく圧縮･展開
+//
+//     z_reloc::chain c;
+//     z_reloc::deflate_chain(pool, c, in, size);
+//     {
+//         z_reloc::chain_view v(c); // 全ての領域をピンする
+//         for (std::size_t i = 0; i < v.count(); i++) {
+//             iov[i].iov_base = const_cast<void*>(v[i].data);
+//             iov[i].iov_len = v[i].size;
+//         }
+//         writev(fd, iov, v.count());
+//     }
+//     z_reloc::deallocate(pool, c);
+//
+// 書き終わった領域はそのままなので、出力をコピーすることはないし、
+// 出力全体が入る大きさの連続した空き領域も必要ない。
+// 1 つの領域が必要になったら coalesce で繋げる。
+
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+#include <zlibpp/zlibpp.hpp>
+#include <reloc/reloc_ptr.hpp>
+#include <reloc/pinned_ptr.hpp>
+#include "z_reloc.hpp"
+
+namespace z_reloc {
+
+struct chain {
+    std::vector<sized_ptr> segments;
+    // 全ての領域のサイズの合計
+    std::size_t size;
+
+    chain() : size(0) { }
+};
+
+template<class Pool>
+void deallocate(Pool& pool, chain& c) {
+    for (std::size_t i = 0; i < c.segments.size(); i++) {
+        pool.deallocate(c.segments[i].ptr);
+    }
+    c.segments.clear();
+    c.size = 0;
+}
+
+// 全ての領域を 1 つの領域にコピーして返す。c は空になる。
+// 確保できなかった場合は空の sized_ptr を返し、c はそのまま。
+template<class Pool>
+sized_ptr coalesce(Pool& pool, chain& c) {
+    if (c.segments.size() == 1) {
+        const sized_ptr sp = c.segments[0];
+        c.segments.clear();
+        c.size = 0;
+        return sp;
+    }
+    const reloc::reloc_ptr p = pool.allocate(c.size);
+    if (!p) return sized_ptr();
+    {
+        reloc::pinned_ptr dst = p.pin();
+        unsigned char* out = static_cast<unsigned char*>(dst.get());
+        for (std::size_t i = 0; i < c.segments.size(); i++) {
+            reloc::pinned_ptr src = c.segments[i].ptr.pin();
+            std::memcpy(out, src.get(), c.segments[i].size);
+            out += c.segments[i].size;
+        }
+    }
+    const sized_ptr sp = { p, c.size };
+    deallocate(pool, c);
+    return sp;
+}
+
+// chain の全ての領域をピンして、アドレスの一覧として見せる
+class chain_view {
+public:
+    struct buffer {
+        const void* data;
+        std::size_t size;
+    };
+
+private:
+    std::vector<reloc::pinned_ptr> pins_;
+    std::vector<buffer> buffers_;
+
+    chain_view(const chain_view&);
+    chain_view& operator=(const chain_view&);
+
+public:
+    explicit chain_view(const chain& c) {
+        pins_.reserve(c.segments.size());
+        buffers_.reserve(c.segments.size());
+        for (std::size_t i = 0; i < c.segments.size(); i++) {
+            pins_.push_back(c.segments[i].ptr.pin());
+            const buffer b = { pins_.back().get(), c.segments[i].size };
+            buffers_.push_back(b);
+        }
+    }
+
+    std::size_t count() const { return buffers_.size(); }
+    const buffer& operator[](std::size_t n) const { return buffers_[n]; }
+
+    // offset バイト目から size バイトを out へコピーし、コピーしたバイト数を返す
+    std::size_t copy(std::size_t offset, void* out, std::size_t size) const {
+        unsigned char* dst = static_cast<unsigned char*>(out);
+        std::size_t copied = 0;
+        for (std::size_t i = 0; i < buffers_.size() && copied < size; i++) {
+            const buffer& b = buffers_[i];
+            if (offset >= b.size) {
+                offset -= b.size;
+                continue;
+            }
+            const std::size_t n = b.size - offset < size - copied ? b.size - offset : size - copied;
+            std::memcpy(dst + copied, static_cast<const unsigned char*>(b.data) + offset, n);
+            copied += n;
+            offset = 0;
+        }
+        return copied;
+    }
+};
+
+namespace detail {
+
+template<class Stream, class StreamFunc, class Pool>
+bool zlib_chain(Pool& pool, chain& out,
+    const void* in, std::size_t in_size, std::size_t segment_size,
+    Stream& s, StreamFunc func) {
+
+    assert(segment_size > 0);
+
+    chain c;
+    s->next_in = in;
+    s->avail_in = in_size;
+
+    while (true) {
+        reloc::reloc_ptr p = pool.allocate(segment_size);
+        if (!p) {
+            deallocate(pool, c);
+            return false;
+        }
+        const sized_ptr sp = { p, segment_size };
+        c.segments.push_back(sp);
+
+        int result;
+        {
+            reloc::pinned_ptr pin = p.pin();
+            s->next_out = pin.get();
+            s->avail_out = segment_size;
+            do {
+                result = (s.*func)(zlibpp::FINISH);
+            } while (result == zlibpp::OK && s->avail_out != 0);
+        }
+        const std::size_t written = segment_size - s->avail_out;
+        c.size += written;
+
+        if (result == zlibpp::STREAM_END) {
+            // 最後の領域を縮める
+            if (written == 0) {
+                pool.deallocate(p);
+                c.segments.pop_back();
+            } else if (written != segment_size) {
+                c.segments.back().ptr = pool.reallocate(p, written);
+                c.segments.back().size = written;
+            }
+            break;
+        }
+        // 出力が一杯になっただけなら次の領域へ
+        if (result != zlibpp::OK && !(result == zlibpp::BUF_ERROR && s->avail_out == 0)) {
+            deallocate(pool, c);
+            throw result;
+        }
+    }
+
+    deallocate(pool, out);
+    out.segments.swap(c.segments);
+    out.size = c.size;
+    return true;
+}
+
+}
+
+// 出力を segment_size 毎の領域に分けて out へ入れる。
+// プールから確保できなかった場合は false を返し、out はそのまま。
+template<class Pool>
+bool deflate_chain(Pool& pool, chain& out, const void* in, std::size_t in_size,
+    std::size_t segment_size = 64 * 1024, int level = zlibpp::BEST_COMPRESSION,
+    const zlibpp::allocator* alloc = 0) {
+
+    zlibpp::deflate_stream ds(level, alloc);
+    return detail::zlib_chain(pool, out, in, in_size, segment_size, ds, &zlibpp::deflate_stream::deflate);
+}
+
+template<class Pool>
+bool inflate_chain(Pool& pool, chain& out, const void* in, std::size_t in_size,
+    std::size_t segment_size = 64 * 1024, const zlibpp::allocator* alloc = 0) {
+
+    zlibpp::inflate_stream is(alloc);
+    return detail::zlib_chain(pool, out, in, in_size, segment_size, is, &zlibpp::inflate_stream::inflate);
+}
+
+}
+
+#endif // Z_RELOC_CHAIN_HPP_INCLUDED
@@ -0,0 +1,103 @@
+#ifndef Z_RELOC_CODEC_HPP_INCLUDED
+#define Z_RELOC_CODEC_HPP_INCLUDED
+
+// 圧縮形式をテンプレート引数で選べる圧縮･展開
+//
+//     z_reloc::sized_ptr p = z_reloc::compress<z_reloc::gzip_codec>(pool, in, size);
+//     z_reloc::sized_ptr q = z_reloc::decompress<z_reloc::gzip_codec>(pool, p.ptr.pin().get(), p.size);
+//
+// Codec は次のものを持つ型。
+//
+//   static int default_level()
+//     レベルを指定しなかった時のレベル
+//   static std::size_t estimate(const void* in, std::size_t in_size)
+//     展開後のサイズの推測値
+//   class compressor
+//     explicit compressor(int level)
+//     int run(int flush)                  zlibpp::deflate と同じように動くこと
+//     std::size_t bound(std::size_t n)    n バイトを圧縮した時のサイズの上限
+//     zlibpp::stream* operator->()
+//     operator unspecified_bool_type()    初期化に失敗したら false
+//   class decompressor
+//     decompressor()
+//     int run(int flush)                  zlibpp::inflate と同じように動くこと
+//     zlibpp::stream* operator->()
+//     operator unspecified_bool_type()
+//
+// zlib (zlib_codec, raw_deflate_codec, gzip_codec) と、lz.hpp の lz_codec がある。
+
+#include <cstddef>
+
+#include <zlibpp/zlibpp.hpp>
+#include "z_reloc.hpp"
+
+namespace z_reloc {
+
+// WindowBits は zlib の deflateInit2 に渡すもの。
+// 8〜15 なら zlib 形式、負なら raw deflate、16 を足すと gzip 形式になる。
+template<int WindowBits>
+struct basic_zlib_codec {
+    static int default_level() { return zlibpp::DEFAULT_COMPRESSION; }
+    static std::size_t estimate(const void* in, std::size_t in_size) {
+        return detail::estimate_inflate_size(in, in_size);
+    }
+
+    class compressor {
+        zlibpp::deflate_stream ds_;
+
+    public:
+        explicit compressor(int level) : ds_(level, WindowBits, zlibpp::DEFAULT_MEM_LEVEL) { }
+        int run(int flush) { return ds_.deflate(flush); }
+        std::size_t bound(std::size_t n) const { return ds_.bound(n); }
+        zlibpp::stream* operator->() const { return ds_.operator->(); }
+
+        typedef zlibpp::deflate_stream compressor::*unspecified_bool_type;
+        operator unspecified_bool_type() const {
+            return ds_ ? &compressor::ds_ : 0;
+        }
+    };
+
+    class decompressor {
+        zlibpp::inflate_stream is_;
+
+    public:
+        decompressor() : is_(WindowBits) { }
+        int run(int flush) { return is_.inflate(flush); }
+        zlibpp::stream* operator->() const { return is_.operator->(); }
+
+        typedef zlibpp::inflate_stream decompressor::*unspecified_bool_type;
+        operator unspecified_bool_type() const {
+            return is_ ? &decompressor::is_ : 0;
+        }
+    };
+};
+
+// 15 は zlibpp::MAX_WINDOW_BITS と同じ
+typedef basic_zlib_codec<15> zlib_codec;
+typedef basic_zlib_codec<-15> raw_deflate_codec;
+typedef basic_zlib_codec<15 + 16> gzip_codec;
+
+// 引数の意味は z_reloc.hpp の deflate, inflate と同じ
+template<class Codec, class Pool>
+sized_ptr compress(Pool& pool, const void* in, std::size_t in_size,
+    std::size_t out_init_size = 0, float rate = 1.5f, int level = Codec::default_level()) {
+
+    typename Codec::compressor c(level);
+    if (!c) throw zlibpp::MEM_ERROR;
+    if (out_init_size == 0) out_init_size = c.bound(in_size);
+    return detail::zlib_reloc(pool, in, in_size, out_init_size, rate, c, &Codec::compressor::run);
+}
+
+template<class Codec, class Pool>
+sized_ptr decompress(Pool& pool, const void* in, std::size_t in_size,
+    std::size_t out_init_size = 0, float rate = 1.5f) {
+
+    typename Codec::decompressor d;
+    if (!d) throw zlibpp::MEM_ERROR;
+    if (out_init_size == 0) out_init_size = Codec::estimate(in, in_size);
+    return detail::zlib_reloc(pool, in, in_size, out_init_size, rate, d, &Codec::decompressor::run);
+}
+
+}
+
+#endif // Z_RELOC_CODEC_HPP_INCLUDED
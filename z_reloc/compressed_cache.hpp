@@ -0,0 +1,259 @@
+#ifndef Z_RELOC_COMPRESSED_CACHE_HPP_INCLUDED
+#define Z_RELOC_COMPRESSED_CACHE_HPP_INCLUDED
+
+// 最近使われていないエントリを圧縮しておくキャッシュ
+//
+//     z_reloc::compressed_cache<Pool> cache(pool, 1024 * 1024); // 展開済みは 1MB まで
+//     z_reloc::compressed_cache<Pool>::handle h;
+//     if (cache.insert(data, size, h)) {
+//         reloc::pinned_ptr p = cache.pin(h); // 圧縮されていたらここで展開される
+//         use(p.get(), cache.size(h));
+//     }
+//     cache.erase(h);
+//
+// エントリはハンドル (番号) で指し、圧縮･展開で領域が入れ替わっても変わらない。
+// 展開済みのエントリの合計サイズが budget を超えたら、CLOCK で使われていないものから圧縮する。
+// pin で得たポインタが生きている間、そのエントリは圧縮されない。
+// 圧縮形式は Codec で選べる (codec.hpp)。デフォルトは速度を優先した lz_codec。
+// reclaim を reloc_pool に登録しておくと、プールが足りない時にも圧縮する。
+// compressed_cache はスレッドセーフではない。
+
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+#include <reloc/reloc_ptr.hpp>
+#include <reloc/pinned_ptr.hpp>
+#include "z_reloc.hpp"
+#include "codec.hpp"
+#include "lz.hpp"
+
+namespace z_reloc {
+
+template<class Pool, class Codec = lz_codec>
+class compressed_cache {
+public:
+    typedef std::size_t handle;
+
+    // これより小さいエントリは圧縮しない
+    static std::size_t min_compress_size() { return 64; }
+
+private:
+    struct entry {
+        reloc::reloc_ptr ptr;
+        // 展開後のサイズ
+        std::size_t size;
+        // ptr のサイズ
+        std::size_t stored_size;
+        bool used;
+        bool compressed;
+        // 前回 CLOCK の針が通ってから使われたか
+        bool referenced;
+        // 圧縮しても小さくならなかった
+        bool incompressible;
+    };
+
+    Pool& pool_;
+    std::vector<entry> entries_;
+    std::vector<handle> free_handles_;
+    std::size_t budget_;
+    int level_;
+    std::size_t hand_;
+
+    std::size_t count_;
+    std::size_t hot_size_;
+    std::size_t stored_size_;
+    std::size_t hits_;
+    std::size_t misses_;
+    std::size_t compressions_;
+
+    compressed_cache(const compressed_cache&);
+    compressed_cache& operator=(const compressed_cache&);
+
+    bool compress(entry& e) {
+        sized_ptr c;
+        {
+            // 圧縮中にリロケートされないようにピンしておく
+            const reloc::pinned_ptr pin = e.ptr.pin();
+            c = z_reloc::compress<Codec>(pool_, pin.get(), e.size, e.size, 1.5f, level_);
+        }
+        if (!c.ptr) return false;
+        if (c.size >= e.size) {
+            pool_.deallocate(c.ptr);
+            e.incompressible = true;
+            return false;
+        }
+        pool_.deallocate(e.ptr);
+        e.ptr = c.ptr;
+        stored_size_ = stored_size_ - e.stored_size + c.size;
+        hot_size_ -= e.size;
+        e.stored_size = c.size;
+        e.compressed = true;
+        ++compressions_;
+        return true;
+    }
+
+    bool decompress(entry& e) {
+        sized_ptr d;
+        {
+            const reloc::pinned_ptr pin = e.ptr.pin();
+            d = z_reloc::decompress<Codec>(pool_, pin.get(), e.stored_size, e.size, 1.5f);
+        }
+        if (!d.ptr) return false;
+        if (d.size != e.size) {
+            pool_.deallocate(d.ptr);
+            throw zlibpp::DATA_ERROR;
+        }
+        pool_.deallocate(e.ptr);
+        e.ptr = d.ptr;
+        stored_size_ = stored_size_ - e.stored_size + d.size;
+        hot_size_ += e.size;
+        e.stored_size = d.size;
+        e.compressed = false;
+        return true;
+    }
+
+    // CLOCK の針を進めながら、展開済みのサイズが target 以下になるまで圧縮する。
+    // 針が 2 周しても足りなければ諦める。
+    void sweep(std::size_t target) {
+        const std::size_t n = entries_.size();
+        for (std::size_t i = 0; i < n * 2 && hot_size_ > target; i++) {
+            entry& e = entries_[hand_];
+            hand_ = (hand_ + 1) % n;
+            if (!e.used || e.compressed || e.incompressible || e.ptr.get()->pinned != 0) continue;
+            if (e.referenced) {
+                e.referenced = false;
+                continue;
+            }
+            compress(e);
+        }
+    }
+
+public:
+    // budget は展開済みのエントリの合計サイズの上限。
+    // level は Codec::compressor に渡すレベル。
+    compressed_cache(Pool& pool, std::size_t budget, int level = Codec::default_level())
+        : pool_(pool), budget_(budget), level_(level), hand_(0), count_(0),
+          hot_size_(0), stored_size_(0), hits_(0), misses_(0), compressions_(0) { }
+    // 全てのエントリを解放する。ピンされたままのエントリがあってはならない。
+    ~compressed_cache() {
+        clear();
+    }
+
+    // data をコピーしたエントリを作って h に入れる。
+    // プールが足りなければ他のエントリを圧縮して再度試し、それでも駄目なら false を返す。
+    bool insert(const void* data, std::size_t size, handle& h) {
+        // 確保してから push_back で例外が起きないように
+        if (free_handles_.empty()) entries_.reserve(entries_.size() + 1);
+        reloc::reloc_ptr p = pool_.allocate(size);
+        if (!p) {
+            sweep(0);
+            p = pool_.allocate(size);
+            if (!p) return false;
+        }
+        std::memcpy(p.pin().get(), data, size);
+
+        const entry e = { p, size, size, true, false, true, size < min_compress_size() };
+        if (free_handles_.empty()) {
+            h = entries_.size();
+            entries_.push_back(e);
+        } else {
+            h = free_handles_.back();
+            free_handles_.pop_back();
+            entries_[h] = e;
+        }
+        ++count_;
+        hot_size_ += size;
+        stored_size_ += size;
+        sweep(budget_);
+        return true;
+    }
+
+    // h の展開済みのデータをピンして返す。
+    // 圧縮されていれば展開し、プールが足りなければ他のエントリを圧縮して再度試す。
+    // それでも展開できなければ空の pinned_ptr を返す。
+    reloc::pinned_ptr pin(handle h) {
+        entry& e = entries_[h];
+        e.referenced = true;
+        if (!e.compressed) {
+            ++hits_;
+            return e.ptr.pin();
+        }
+        ++misses_;
+        if (!decompress(e)) {
+            sweep(0);
+            if (!decompress(e)) return reloc::pinned_ptr();
+        }
+        // ピンしてから他のエントリを圧縮する
+        reloc::pinned_ptr pin = e.ptr.pin();
+        sweep(budget_);
+        return pin;
+    }
+
+    void erase(handle h) {
+        entry& e = entries_[h];
+        if (!e.used) return;
+        pool_.deallocate(e.ptr);
+        if (!e.compressed) hot_size_ -= e.size;
+        stored_size_ -= e.stored_size;
+        --count_;
+        e = entry();
+        free_handles_.push_back(h);
+    }
+
+    void clear() {
+        for (std::size_t i = 0; i < entries_.size(); i++) {
+            if (entries_[i].used) pool_.deallocate(entries_[i].ptr);
+        }
+        entries_.clear();
+        free_handles_.clear();
+        hand_ = 0;
+        count_ = 0;
+        hot_size_ = 0;
+        stored_size_ = 0;
+    }
+
+    // 使われていないエントリから圧縮して、展開済みのサイズを target 以下にしようとする。
+    // 減らせた後の展開済みのサイズを返す。
+    std::size_t shrink(std::size_t target) {
+        sweep(target);
+        return hot_size_;
+    }
+
+    // reloc_pool::add_reclaimer に登録して、プールが足りない時に圧縮させるための関数。
+    //     pool.add_reclaimer(&cache_type::reclaim, &cache);
+    // 使われていないエントリから、展開済みのサイズが required 減るまで圧縮して、減ったサイズを返す。
+    // キャッシュを破棄する前に remove_reclaimer で登録を解除すること。
+    static std::size_t reclaim(void* context, std::size_t required) {
+        compressed_cache& c = *static_cast<compressed_cache*>(context);
+        const std::size_t before = c.stored_size_;
+        c.sweep(c.hot_size_ > required ? c.hot_size_ - required : 0);
+        return before - c.stored_size_;
+    }
+
+    // 展開後のサイズ
+    std::size_t size(handle h) const { return entries_[h].size; }
+    bool compressed(handle h) const { return entries_[h].compressed; }
+
+    std::size_t budget() const { return budget_; }
+    void set_budget(std::size_t budget) {
+        budget_ = budget;
+        sweep(budget_);
+    }
+
+    // エントリの数
+    std::size_t count() const { return count_; }
+    // 展開済みのエントリの合計サイズ
+    std::size_t hot_size() const { return hot_size_; }
+    // プールの中で使っているサイズ
+    std::size_t stored_size() const { return stored_size_; }
+    // pin した時に展開済みだった回数と、展開が必要だった回数
+    std::size_t hits() const { return hits_; }
+    std::size_t misses() const { return misses_; }
+    // 圧縮した回数
+    std::size_t compressions() const { return compressions_; }
+};
+
+}
+
+#endif // Z_RELOC_COMPRESSED_CACHE_HPP_INCLUDED
@@ -0,0 +1,228 @@
+#ifndef Z_RELOC_DICTIONARY_HPP_INCLUDED
+#define Z_RELOC_DICTIONARY_HPP_INCLUDED
+
+// 辞書を使った圧縮･展開
+//
+// 小さくて似たようなデータは、それだけでは殆ど圧縮できないが、
+// よく出てくる文字列を辞書として事前に与えておくと、それを参照して圧縮できる。
+//
+//     std::vector<unsigned char> d;
+//     z_reloc::train_dictionary(samples, n, 16 * 1024, d);
+//     z_reloc::dictionary<Pool> dict(pool, &d[0], d.size());
+//     z_reloc::sized_ptr p = z_reloc::deflate(pool, dict, in, size);
+//     z_reloc::sized_ptr q = z_reloc::inflate(pool, dict, p.ptr.pin().get(), p.size);
+//
+// 展開する時も同じ辞書が必要になる。
+
+#include <cstddef>
+#include <cstring>
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <stdint.h>
+
+#include <zlibpp/zlibpp.hpp>
+#include <reloc/reloc_ptr.hpp>
+#include <reloc/pinned_ptr.hpp>
+#include "z_reloc.hpp"
+#include "batch.hpp"
+
+namespace z_reloc {
+
+// 辞書をプールの領域にコピーして、破棄するまでピンしておく。
+// 全てのストリームはこの領域を直接参照する。
+// ピンされた領域はリロケーションの邪魔になるので、プールを使い始める前に作っておくとよい。
+template<class Pool>
+class dictionary {
+    Pool& pool_;
+    reloc::reloc_ptr ptr_;
+    reloc::pinned_ptr pin_;
+    std::size_t size_;
+    unsigned long id_;
+
+    dictionary(const dictionary&);
+    dictionary& operator=(const dictionary&);
+
+public:
+    // zlib が使えるのは最後の 32KB まで
+    dictionary(Pool& pool, const void* data, std::size_t size)
+        : pool_(pool), size_(0), id_(0) {
+        if (size > 32 * 1024) {
+            data = static_cast<const unsigned char*>(data) + (size - 32 * 1024);
+            size = 32 * 1024;
+        }
+        ptr_ = pool_.allocate(size);
+        if (!ptr_) return;
+        pin_ = ptr_.pin();
+        std::memcpy(pin_.get(), data, size);
+        size_ = size;
+        id_ = zlibpp::adler32(1, data, size);
+    }
+    ~dictionary() {
+        pin_.reset();
+        pool_.deallocate(ptr_);
+    }
+
+    const void* data() const { return size_ == 0 ? 0 : pin_.get(); }
+    std::size_t size() const { return size_; }
+    // zlib のヘッダに書かれる辞書の Adler-32
+    unsigned long id() const { return id_; }
+
+    typedef reloc::reloc_ptr dictionary::*unspecified_bool_type;
+    operator unspecified_bool_type() const {
+        return ptr_ ? &dictionary::ptr_ : 0;
+    }
+};
+
+namespace detail {
+
+// 辞書を設定してから圧縮するストリーム
+class dict_deflate_stream {
+    zlibpp::deflate_stream ds_;
+    int result_;
+
+public:
+    dict_deflate_stream(int level, const void* dict, std::size_t dict_size, const zlibpp::allocator* alloc)
+        : ds_(level, alloc), result_(zlibpp::OK) {
+        if (ds_) result_ = ds_.set_dictionary(dict, dict_size);
+    }
+    int deflate(int flush) {
+        return result_ != zlibpp::OK ? result_ : ds_.deflate(flush);
+    }
+    std::size_t bound(std::size_t source_len) const { return ds_.bound(source_len); }
+    zlibpp::stream* operator->() const { return ds_.operator->(); }
+    int init_result() const { return ds_.init_result(); }
+};
+
+// inflate が辞書を要求してきたら設定する
+class dict_inflate_stream {
+    zlibpp::inflate_stream is_;
+    const void* dict_;
+    std::size_t dict_size_;
+
+public:
+    dict_inflate_stream(const void* dict, std::size_t dict_size, const zlibpp::allocator* alloc)
+        : is_(alloc), dict_(dict), dict_size_(dict_size) { }
+    int inflate(int flush) {
+        int result = is_.inflate(flush);
+        if (result == zlibpp::NEED_DICT) {
+            // 違う辞書なら DATA_ERROR になる
+            result = is_.set_dictionary(dict_, dict_size_);
+            if (result == zlibpp::OK) result = is_.inflate(flush);
+        }
+        return result;
+    }
+    zlibpp::stream* operator->() const { return is_.operator->(); }
+    int init_result() const { return is_.init_result(); }
+};
+
+}
+
+// dict を使う deflate, inflate。
+// 他の引数の意味は z_reloc.hpp の deflate, inflate と同じ。
+template<class Pool, class DictPool>
+sized_ptr deflate(Pool& pool, const dictionary<DictPool>& dict, const void* in, std::size_t in_size,
+    std::size_t out_init_size = 0, float rate = 1.5f, int level = zlibpp::BEST_COMPRESSION,
+    const zlibpp::allocator* alloc = 0) {
+
+    detail::dict_deflate_stream ds(level, dict.data(), dict.size(), alloc);
+    if (ds.init_result() != zlibpp::OK) throw ds.init_result();
+    if (out_init_size == 0) out_init_size = ds.bound(in_size);
+    return detail::zlib_reloc(pool, in, in_size, out_init_size, rate, ds, &detail::dict_deflate_stream::deflate);
+}
+
+template<class Pool, class DictPool>
+sized_ptr inflate(Pool& pool, const dictionary<DictPool>& dict, const void* in, std::size_t in_size,
+    std::size_t out_init_size = 0, float rate = 1.5f, const zlibpp::allocator* alloc = 0) {
+
+    detail::dict_inflate_stream is(dict.data(), dict.size(), alloc);
+    if (is.init_result() != zlibpp::OK) throw is.init_result();
+    if (out_init_size == 0) out_init_size = detail::estimate_inflate_size(in, in_size);
+    return detail::zlib_reloc(pool, in, in_size, out_init_size, rate, is, &detail::dict_inflate_stream::inflate);
+}
+
+namespace detail {
+
+inline uint64_t dictionary_hash(const unsigned char* p, std::size_t n) {
+    // FNV-1a
+    uint64_t h = 14695981039346656037ULL;
+    for (std::size_t i = 0; i < n; i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+struct dictionary_candidate {
+    std::size_t samples; // 含まれているサンプルの数
+    std::size_t last_sample;
+    const unsigned char* ptr; // 最初に出てきた位置
+};
+
+struct dictionary_candidate_pred {
+    bool operator()(const dictionary_candidate& a, const dictionary_candidate& b) const {
+        return a.samples > b.samples || (a.samples == b.samples && a.ptr < b.ptr);
+    }
+};
+
+}
+
+// サンプルから辞書を作るいい加減な実装。
+// 長さ key_size の部分文字列のうち、多くのサンプルに含まれているものから順に
+// その位置から segment_size バイトを取り出して、最大 dict_size バイトまで並べる。
+// zlib は近い位置を参照する方が短く表せるので、よく出てくるものほど後ろに置く。
+// 2 つ以上のサンプルに含まれていないものは使わない。
+inline void train_dictionary(const batch_input* samples, std::size_t n, std::size_t dict_size,
+    std::vector<unsigned char>& dict, std::size_t key_size = 8, std::size_t segment_size = 32) {
+
+    typedef std::map<uint64_t, detail::dictionary_candidate> map_t;
+    map_t counts;
+    for (std::size_t s = 0; s < n; s++) {
+        const unsigned char* const p = static_cast<const unsigned char*>(samples[s].data);
+        const std::size_t size = samples[s].size;
+        for (std::size_t i = 0; i + key_size <= size; i++) {
+            const uint64_t h = detail::dictionary_hash(p + i, key_size);
+            map_t::iterator it = counts.find(h);
+            if (it == counts.end()) {
+                const std::size_t len = size - i < segment_size ? size - i : segment_size;
+                if (len < segment_size) continue;
+                detail::dictionary_candidate c = { 1, s, p + i };
+                counts.insert(std::make_pair(h, c));
+            } else if (it->second.last_sample != s) {
+                ++it->second.samples;
+                it->second.last_sample = s;
+            }
+        }
+    }
+
+    std::vector<detail::dictionary_candidate> cands;
+    for (map_t::const_iterator it = counts.begin(); it != counts.end(); ++it) {
+        if (it->second.samples >= 2) cands.push_back(it->second);
+    }
+    std::sort(cands.begin(), cands.end(), detail::dictionary_candidate_pred());
+
+    // 既に選んだ範囲に含まれている部分文字列は選ばない
+    std::set<uint64_t> chosen;
+    std::vector<const unsigned char*> segments;
+    std::size_t total = 0;
+    for (std::size_t i = 0; i < cands.size() && total + segment_size <= dict_size; i++) {
+        const unsigned char* const p = cands[i].ptr;
+        if (chosen.count(detail::dictionary_hash(p, key_size))) continue;
+        for (std::size_t j = 0; j + key_size <= segment_size; j++) {
+            chosen.insert(detail::dictionary_hash(p + j, key_size));
+        }
+        segments.push_back(p);
+        total += segment_size;
+    }
+
+    dict.clear();
+    dict.reserve(total);
+    for (std::size_t i = segments.size(); i != 0; i--) {
+        dict.insert(dict.end(), segments[i - 1], segments[i - 1] + segment_size);
+    }
+}
+
+}
+
+#endif // Z_RELOC_DICTIONARY_HPP_INCLUDED
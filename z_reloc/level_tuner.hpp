@@ -0,0 +1,140 @@
+#ifndef Z_RELOC_LEVEL_TUNER_HPP_INCLUDED
+#define Z_RELOC_LEVEL_TUNER_HPP_INCLUDED
+
+// 圧縮レベル毎の圧縮率と速度を計測して、目標の速度を満たすレベルを選ぶ
+//
+//     z_reloc::level_tuner tuner(50.0); // 50MB/s 以上
+//     for (...) {
+//         z_reloc::sized_ptr p = z_reloc::deflate(pool, tuner, in, size);
+//     }
+//     tuner.level(); // 現在選んでいるレベル
+//     tuner.stats(6).mb_per_sec;
+//
+// 普段は選んだレベルだけを使い、interval 回に 1 回だけ隣のレベルを試して計測し直す。
+// 目標を満たすレベルのうち最も圧縮率の良いものを選び、
+// 1 つも満たさなければ最も速いものを選ぶ。
+// level_tuner はスレッドセーフではない。
+
+#include <cstddef>
+#include <stdint.h>
+
+#include <zlibpp/zlibpp.hpp>
+#include <reloc/detail/clock.hpp>
+#include "z_reloc.hpp"
+
+namespace z_reloc {
+
+struct level_stats {
+    std::size_t samples;
+    // 出力サイズ / 入力サイズ の移動平均
+    double ratio;
+    double mb_per_sec;
+};
+
+class level_tuner {
+    static const int max_levels = 10;
+
+    level_stats stats_[max_levels];
+    double target_;
+    int min_level_;
+    int max_level_;
+    std::size_t interval_;
+    std::size_t calls_;
+    int level_;
+    // 次に試すのが上のレベルか
+    bool explore_up_;
+
+    void choose() {
+        int best = -1;
+        int fastest = -1;
+        for (int l = min_level_; l <= max_level_; l++) {
+            const level_stats& s = stats_[l];
+            if (s.samples == 0) continue;
+            if (fastest < 0 || stats_[fastest].mb_per_sec < s.mb_per_sec) fastest = l;
+            if (s.mb_per_sec >= target_ && (best < 0 || s.ratio < stats_[best].ratio)) best = l;
+        }
+        if (best >= 0) level_ = best;
+        else if (fastest >= 0) level_ = fastest;
+    }
+
+public:
+    // 重みは新しい計測値の割合
+    static double weight() { return 0.25; }
+
+    explicit level_tuner(double target_mb_per_sec,
+        int min_level = zlibpp::BEST_SPEED, int max_level = zlibpp::BEST_COMPRESSION, std::size_t interval = 32)
+        : target_(target_mb_per_sec), min_level_(min_level < 0 ? 0 : min_level),
+          max_level_(max_level >= max_levels ? max_levels - 1 : max_level),
+          interval_(interval == 0 ? 1 : interval), calls_(0), explore_up_(true) {
+        if (max_level_ < min_level_) max_level_ = min_level_;
+        for (int l = 0; l < max_levels; l++) {
+            const level_stats s = { 0, 0.0, 0.0 };
+            stats_[l] = s;
+        }
+        // 速い方から始めて、上のレベルを試していく
+        level_ = min_level_;
+    }
+
+    // 次の圧縮に使うレベル
+    int next_level() {
+        if (++calls_ % interval_ != 0) return level_;
+
+        // 試す方向を交互に変える。端なら反対側
+        const bool up = explore_up_ ? level_ < max_level_ : level_ == min_level_;
+        explore_up_ = !explore_up_;
+        if (up && level_ < max_level_) return level_ + 1;
+        if (!up && level_ > min_level_) return level_ - 1;
+        return level_;
+    }
+
+    // level で in_size バイトを out_size バイトに圧縮するのに elapsed_ns ナノ秒掛かった
+    void record(int level, std::size_t in_size, std::size_t out_size, uint64_t elapsed_ns) {
+        if (level < min_level_ || level > max_level_ || in_size == 0) return;
+        if (elapsed_ns == 0) elapsed_ns = 1;
+        const double ratio = static_cast<double>(out_size) / in_size;
+        const double mb_per_sec = in_size / (1024.0 * 1024.0) / (elapsed_ns / 1e9);
+
+        level_stats& s = stats_[level];
+        if (s.samples == 0) {
+            s.ratio = ratio;
+            s.mb_per_sec = mb_per_sec;
+        } else {
+            s.ratio += (ratio - s.ratio) * weight();
+            s.mb_per_sec += (mb_per_sec - s.mb_per_sec) * weight();
+        }
+        ++s.samples;
+        choose();
+    }
+
+    int level() const { return level_; }
+    double target() const { return target_; }
+    void set_target(double target_mb_per_sec) {
+        target_ = target_mb_per_sec;
+        choose();
+    }
+    // level の計測値。計測していなければ samples が 0
+    const level_stats& stats(int level) const {
+        return stats_[level < 0 ? 0 : level >= max_levels ? max_levels - 1 : level];
+    }
+};
+
+// tuner が選んだレベルで圧縮し、計測値を tuner に記録する。
+// 他の引数の意味は z_reloc.hpp の deflate と同じ。
+template<class Pool>
+sized_ptr deflate(Pool& pool, level_tuner& tuner, const void* in, std::size_t in_size,
+    std::size_t out_init_size = 0, float rate = 1.5f, const zlibpp::allocator* alloc = 0) {
+
+    // 圧縮できないデータは計測しない
+    if (looks_incompressible(in, in_size)) {
+        return deflate(pool, in, in_size, out_init_size, rate, zlibpp::NO_COMPRESSION, alloc);
+    }
+    const int level = tuner.next_level();
+    const uint64_t t = reloc::detail::now_ns();
+    const sized_ptr sp = deflate(pool, in, in_size, out_init_size, rate, level, alloc);
+    if (sp.ptr) tuner.record(level, in_size, sp.size, reloc::detail::now_ns() - t);
+    return sp;
+}
+
+}
+
+#endif // Z_RELOC_LEVEL_TUNER_HPP_INCLUDED
@@ -0,0 +1,284 @@
+#ifndef Z_RELOC_LZ_HPP_INCLUDED
+#define Z_RELOC_LZ_HPP_INCLUDED
+
+// 圧縮率より速度を優先する、LZ4 に似た単純な LZ77 の実装と、それを使う codec
+//
+// 形式:
+//   'L' 展開後のサイズ (LEB128)
+//   シーケンスの列
+//     トークン 1 バイト (上位 4 ビットがリテラル長、下位 4 ビットが一致長 - 4)
+//     リテラル長が 15 ならその後に追加の長さ (255 が続く限り足す)
+//     リテラル
+//     距離 2 バイト (リトルエンディアン)
+//     一致長が 15 + 4 以上ならその後に追加の長さ
+//   最後のシーケンスはリテラルだけで、距離と一致長を持たない
+//
+// ハッシュテーブルで 4 バイトの一致を探して、見つかったものをそのまま使う (貪欲法)。
+// 一度に全ての入力を処理するので、compress, decompress に渡す入力は全体であること。
+
+#include <cstddef>
+#include <cstring>
+#include <vector>
+#include <stdint.h>
+
+#include <zlibpp/zlibpp.hpp>
+
+namespace z_reloc {
+
+namespace detail {
+
+const unsigned char lz_magic = 'L';
+const std::size_t lz_hash_bits = 14;
+const std::size_t lz_max_distance = 65535;
+// 入力 1 バイトあたりの展開後のサイズの上限 (一致長の追加の長さ 1 バイトで 255 バイト)
+const std::size_t lz_max_ratio = 255;
+
+inline uint32_t lz_read32(const unsigned char* p) {
+    uint32_t v;
+    std::memcpy(&v, p, 4);
+    return v;
+}
+inline std::size_t lz_hash(uint32_t v) {
+    return static_cast<std::size_t>((v * 2654435761U) >> (32 - lz_hash_bits));
+}
+
+inline unsigned char* lz_write_length(unsigned char* op, std::size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = static_cast<unsigned char>(len);
+    return op;
+}
+
+inline unsigned char* lz_write_sequence(unsigned char* op,
+    const unsigned char* literal, std::size_t literal_len, std::size_t match_len, std::size_t distance) {
+
+    const std::size_t ml = match_len == 0 ? 0 : match_len - 4;
+    unsigned char* const token = op++;
+    *token = static_cast<unsigned char>((literal_len < 15 ? literal_len : 15) << 4 | (ml < 15 ? ml : 15));
+    if (literal_len >= 15) op = lz_write_length(op, literal_len - 15);
+    std::memcpy(op, literal, literal_len);
+    op += literal_len;
+    if (match_len == 0) return op;
+
+    *op++ = static_cast<unsigned char>(distance);
+    *op++ = static_cast<unsigned char>(distance >> 8);
+    if (ml >= 15) op = lz_write_length(op, ml - 15);
+    return op;
+}
+
+inline bool lz_read_length(const unsigned char*& ip, const unsigned char* iend, std::size_t& len) {
+    unsigned char b;
+    do {
+        if (ip == iend) return false;
+        b = *ip++;
+        len += b;
+    } while (b == 255);
+    return true;
+}
+
+}
+
+// n バイトを圧縮した時のサイズの上限
+inline std::size_t lz_bound(std::size_t n) {
+    return n + n / 255 + 16 + 1 + 10;
+}
+
+// out には lz_bound(n) バイト以上の領域が必要。圧縮後のサイズを返す。
+inline std::size_t lz_compress(const void* in, std::size_t n, void* out) {
+    const unsigned char* const src = static_cast<const unsigned char*>(in);
+    unsigned char* const dst = static_cast<unsigned char*>(out);
+    unsigned char* op = dst;
+
+    *op++ = detail::lz_magic;
+    std::size_t rest = n;
+    do {
+        *op++ = static_cast<unsigned char>((rest & 0x7f) | (rest >= 0x80 ? 0x80 : 0));
+        rest >>= 7;
+    } while (rest != 0);
+
+    std::vector<uint32_t> table(static_cast<std::size_t>(1) << detail::lz_hash_bits, 0);
+    std::size_t anchor = 0;
+    std::size_t i = 0;
+    while (i + 4 <= n) {
+        const uint32_t v = detail::lz_read32(src + i);
+        uint32_t& slot = table[detail::lz_hash(v)];
+        const std::size_t cand = slot;
+        slot = static_cast<uint32_t>(i);
+        // 4GB を超える位置は参照しない
+        if (static_cast<std::size_t>(slot) != i) break;
+
+        if (cand < i && i - cand <= detail::lz_max_distance && detail::lz_read32(src + cand) == v) {
+            std::size_t len = 4;
+            while (i + len < n && src[cand + len] == src[i + len]) ++len;
+            op = detail::lz_write_sequence(op, src + anchor, i - anchor, len, i - cand);
+            i += len;
+            anchor = i;
+        } else {
+            ++i;
+        }
+    }
+    op = detail::lz_write_sequence(op, src + anchor, n - anchor, 0, 0);
+    return op - dst;
+}
+
+// 展開後のサイズを読む。header_size にはヘッダのサイズが入る。
+// 残りの入力から展開できるサイズを超えていれば、壊れているので false を返す。
+inline bool lz_original_size(const void* in, std::size_t n, std::size_t& size, std::size_t& header_size) {
+    const unsigned char* const src = static_cast<const unsigned char*>(in);
+    if (n == 0 || src[0] != detail::lz_magic) return false;
+    size = 0;
+    for (std::size_t i = 1, shift = 0; i < n && shift < sizeof(std::size_t) * 8; i++, shift += 7) {
+        size |= static_cast<std::size_t>(src[i] & 0x7f) << shift;
+        if ((src[i] & 0x80) == 0) {
+            header_size = i + 1;
+            const std::size_t rest = n - header_size;
+            return rest > static_cast<std::size_t>(-1) / detail::lz_max_ratio || size <= rest * detail::lz_max_ratio;
+        }
+    }
+    return false;
+}
+
+// out_size は展開後のサイズと一致していること。壊れていたら false を返す。
+inline bool lz_decompress(const void* in, std::size_t n, void* out, std::size_t out_size) {
+    std::size_t size;
+    std::size_t header_size;
+    if (!lz_original_size(in, n, size, header_size) || size != out_size) return false;
+
+    const unsigned char* ip = static_cast<const unsigned char*>(in) + header_size;
+    const unsigned char* const iend = static_cast<const unsigned char*>(in) + n;
+    unsigned char* const dst = static_cast<unsigned char*>(out);
+    unsigned char* op = dst;
+    unsigned char* const oend = dst + out_size;
+
+    while (true) {
+        if (ip == iend) return false;
+        const unsigned char token = *ip++;
+
+        std::size_t literal_len = token >> 4;
+        if (literal_len == 15 && !detail::lz_read_length(ip, iend, literal_len)) return false;
+        if (literal_len > static_cast<std::size_t>(iend - ip) ||
+            literal_len > static_cast<std::size_t>(oend - op)) return false;
+        std::memcpy(op, ip, literal_len);
+        ip += literal_len;
+        op += literal_len;
+        if (ip == iend) break;
+
+        if (iend - ip < 2) return false;
+        const std::size_t distance = ip[0] | static_cast<std::size_t>(ip[1]) << 8;
+        ip += 2;
+        if (distance == 0 || distance > static_cast<std::size_t>(op - dst)) return false;
+
+        std::size_t match_len = token & 15;
+        if (match_len == 15 && !detail::lz_read_length(ip, iend, match_len)) return false;
+        match_len += 4;
+        if (match_len > static_cast<std::size_t>(oend - op)) return false;
+        const unsigned char* m = op - distance;
+        if (distance >= match_len) {
+            std::memcpy(op, m, match_len);
+        } else {
+            // 重なっているので 1 バイトずつ
+            for (std::size_t i = 0; i < match_len; i++) op[i] = m[i];
+        }
+        op += match_len;
+    }
+    return op == oend;
+}
+
+// lz_compress, lz_decompress を z_reloc の Codec にしたもの (codec.hpp)
+struct lz_codec {
+    static int default_level() { return 0; }
+    static std::size_t estimate(const void* in, std::size_t in_size) {
+        std::size_t size;
+        std::size_t header_size;
+        return lz_original_size(in, in_size, size, header_size) && size != 0 ? size : in_size * 2;
+    }
+
+private:
+    // 出力先が足りない時は、一旦 buf_ に出力してから少しずつコピーする
+    class basic_coder {
+    protected:
+        zlibpp::stream s_;
+        std::vector<unsigned char> buf_;
+        std::size_t pos_;
+        bool started_;
+
+        basic_coder() : pos_(0), started_(false) {
+            std::memset(&s_, 0, sizeof(s_));
+        }
+        void consume_input() {
+            s_.next_in = static_cast<const unsigned char*>(s_.next_in) + s_.avail_in;
+            s_.total_in += s_.avail_in;
+            s_.avail_in = 0;
+        }
+        void put(std::size_t n) {
+            s_.next_out = static_cast<unsigned char*>(s_.next_out) + n;
+            s_.avail_out -= n;
+            s_.total_out += n;
+        }
+        int drain() {
+            const std::size_t n = buf_.size() - pos_ < s_.avail_out ? buf_.size() - pos_ : s_.avail_out;
+            if (n != 0) std::memcpy(s_.next_out, &buf_[pos_], n);
+            pos_ += n;
+            put(n);
+            return pos_ == buf_.size() ? zlibpp::STREAM_END : zlibpp::OK;
+        }
+
+    public:
+        zlibpp::stream* operator->() { return &s_; }
+
+        typedef zlibpp::stream basic_coder::*unspecified_bool_type;
+        operator unspecified_bool_type() const { return &basic_coder::s_; }
+    };
+
+public:
+    class compressor : public basic_coder {
+    public:
+        explicit compressor(int) { }
+        std::size_t bound(std::size_t n) const { return lz_bound(n); }
+        int run(int) {
+            if (!started_) {
+                started_ = true;
+                const unsigned char* const in = static_cast<const unsigned char*>(s_.next_in);
+                const std::size_t n = s_.avail_in;
+                if (s_.avail_out >= lz_bound(n)) {
+                    put(lz_compress(in, n, s_.next_out));
+                    consume_input();
+                    return zlibpp::STREAM_END;
+                }
+                buf_.resize(lz_bound(n));
+                buf_.resize(lz_compress(in, n, &buf_[0]));
+                consume_input();
+            }
+            return drain();
+        }
+    };
+
+    class decompressor : public basic_coder {
+    public:
+        int run(int) {
+            if (!started_) {
+                started_ = true;
+                std::size_t size;
+                std::size_t header_size;
+                if (!lz_original_size(s_.next_in, s_.avail_in, size, header_size)) return zlibpp::DATA_ERROR;
+                if (s_.avail_out >= size) {
+                    if (!lz_decompress(s_.next_in, s_.avail_in, s_.next_out, size)) return zlibpp::DATA_ERROR;
+                    put(size);
+                    consume_input();
+                    return zlibpp::STREAM_END;
+                }
+                buf_.resize(size == 0 ? 1 : size);
+                if (!lz_decompress(s_.next_in, s_.avail_in, &buf_[0], size)) return zlibpp::DATA_ERROR;
+                buf_.resize(size);
+                consume_input();
+            }
+            return drain();
+        }
+    };
+};
+
+}
+
+#endif // Z_RELOC_LZ_HPP_INCLUDED
@@ -0,0 +1,141 @@
+#ifndef Z_RELOC_NOTHROW_HPP_INCLUDED
+#define Z_RELOC_NOTHROW_HPP_INCLUDED
+
+// 例外を投げずに圧縮・展開する
+//
+//     z_reloc::try_result r = z_reloc::try_inflate(pool, in, size);
+//     if (!r) {
+//         if (r.error == z_reloc::error_pool_exhausted) ...  // r.requested バイトを確保できなかった
+//         if (r.error == z_reloc::error_data) ...            // 壊れている (r.zlib_result に zlib の戻り値)
+//     }
+//     use(r.value.ptr, r.value.size);
+//
+// z_reloc.hpp の deflate, inflate と同じことをするが、失敗の理由を全て戻り値で返すので、
+// -fno-exceptions でも使える (z_reloc.hpp の例外を投げる関数を呼ばなければ、それらはインスタンス化されない)。
+// 失敗した時は、途中まで確保した出力を解放してから try_result をそのまま返すだけで、何も確保しない。
+// ただし、プールやストリーム自身が new で確保する管理用の領域は別。
+//
+// relocate_retry を true にすると、プールが足りなかった時に pool.relocate() で全体を詰めてから、
+// その時点の max_free() を最初に確保してもう一度だけ試す。
+// 伸ばす途中で古い出力と新しい出力を同時に持つ必要がなくなるので、出力が最も大きい空き領域に収まれば成功する。
+
+#include <cstddef>
+
+#include <zlibpp/zlibpp.hpp>
+#include <reloc/reloc_ptr.hpp>
+#include "z_reloc.hpp"
+
+namespace z_reloc {
+
+enum error_code {
+    error_none,
+    // プールに出力を確保できなかった
+    error_pool_exhausted,
+    // ストリームを作れなかった。zlib_result は deflate_init などの戻り値
+    error_stream_init,
+    // 入力が壊れている (zlibpp::DATA_ERROR, zlibpp::NEED_DICT)
+    error_data,
+    // 入力が途中で終わっている (zlibpp::BUF_ERROR)
+    error_buf,
+    // その他の zlib のエラー
+    error_stream
+};
+
+struct try_result {
+    // 成功した時の出力。失敗したら空
+    sized_ptr value;
+    error_code error;
+    // zlib の戻り値。error_pool_exhausted なら zlibpp::OK
+    int zlib_result;
+    // error_pool_exhausted の時に確保できなかったサイズ
+    std::size_t requested;
+
+    typedef sized_ptr try_result::*unspecified_bool_type;
+    operator unspecified_bool_type() const {
+        return error == error_none ? &try_result::value : 0;
+    }
+};
+
+namespace detail {
+
+inline try_result make_try_result(const sized_ptr& value, int result, std::size_t requested) {
+    try_result r = { value, error_none, result, requested };
+    if (result == zlibpp::DATA_ERROR || result == zlibpp::NEED_DICT) r.error = error_data;
+    else if (result == zlibpp::BUF_ERROR) r.error = error_buf;
+    else if (result != zlibpp::OK) r.error = error_stream;
+    else if (!value.ptr) r.error = error_pool_exhausted;
+    return r;
+}
+
+inline try_result stream_init_failed(int result) {
+    const try_result r = { sized_ptr(), error_stream_init, result, 0 };
+    return r;
+}
+
+template<class Pool>
+try_result try_deflate_once(Pool& pool, const void* in, std::size_t in_size,
+    std::size_t out_init_size, float rate, int level, const zlibpp::allocator* alloc) {
+
+    zlibpp::deflate_stream ds(level, alloc);
+    if (!ds) return stream_init_failed(ds.init_result());
+    if (out_init_size == 0) out_init_size = ds.bound(in_size);
+    int result;
+    std::size_t requested;
+    const sized_ptr sp = zlib_reloc(pool, in, in_size, out_init_size, rate,
+        ds, &zlibpp::deflate_stream::deflate, result, requested);
+    return make_try_result(sp, result, requested);
+}
+
+template<class Pool>
+try_result try_inflate_once(Pool& pool, const void* in, std::size_t in_size,
+    std::size_t out_init_size, float rate, const zlibpp::allocator* alloc) {
+
+    zlibpp::inflate_stream is(alloc);
+    if (!is) return stream_init_failed(is.init_result());
+    if (out_init_size == 0) out_init_size = estimate_inflate_size(in, in_size);
+    int result;
+    std::size_t requested;
+    const sized_ptr sp = zlib_reloc(pool, in, in_size, out_init_size, rate,
+        is, &zlibpp::inflate_stream::inflate, result, requested);
+    return make_try_result(sp, result, requested);
+}
+
+// プールが足りなかった時に、詰めてから最も大きい空き領域の大きさで試し直すか
+template<class Pool>
+bool retry_size(Pool& pool, const try_result& r, bool relocate_retry, std::size_t& size) {
+    if (!relocate_retry || r.error != error_pool_exhausted) return false;
+    pool.relocate();
+    size = pool.max_free();
+    return size != 0;
+}
+
+}
+
+// 引数は z_reloc.hpp の deflate と同じ
+template<class Pool>
+try_result try_deflate(Pool& pool, const void* in, std::size_t in_size,
+    std::size_t out_init_size = 0, float rate = 1.5f, int level = zlibpp::BEST_COMPRESSION,
+    const zlibpp::allocator* alloc = 0, bool relocate_retry = false) {
+
+    if (level != zlibpp::NO_COMPRESSION && looks_incompressible(in, in_size)) level = zlibpp::NO_COMPRESSION;
+    const try_result r = detail::try_deflate_once(pool, in, in_size, out_init_size, rate, level, alloc);
+    std::size_t size;
+    if (!detail::retry_size(pool, r, relocate_retry, size)) return r;
+    return detail::try_deflate_once(pool, in, in_size, size, rate, level, alloc);
+}
+
+// 引数は z_reloc.hpp の inflate と同じ
+template<class Pool>
+try_result try_inflate(Pool& pool, const void* in, std::size_t in_size,
+    std::size_t out_init_size = 0, float rate = 1.5f, const zlibpp::allocator* alloc = 0,
+    bool relocate_retry = false) {
+
+    const try_result r = detail::try_inflate_once(pool, in, in_size, out_init_size, rate, alloc);
+    std::size_t size;
+    if (!detail::retry_size(pool, r, relocate_retry, size)) return r;
+    return detail::try_inflate_once(pool, in, in_size, size, rate, alloc);
+}
+
+}
+
+#endif // Z_RELOC_NOTHROW_HPP_INCLUDED
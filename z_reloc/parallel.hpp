@@ -0,0 +1,177 @@
+#ifndef Z_RELOC_PARALLEL_HPP_INCLUDED
+#define Z_RELOC_PARALLEL_HPP_INCLUDED
+
+// 入力をブロックに分けて、worker_pool で並列に圧縮する (pigz と同じやり方)
+//
+// 各ブロックは直前の 32KB を辞書にして raw deflate で圧縮し、
+// 最後以外は SYNC_FLUSH でバイト境界に揃えて終わらせる。
+// それらを順に繋げて zlib のヘッダと、adler32_combine で求めた Adler-32 を付けると、
+// 普通の inflate で展開できる 1 つの zlib ストリームになる。
+// 辞書を使わずに各ブロックを単独で展開できるようにしたものは block_index.hpp にある。
+
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+#include <zlibpp/zlibpp.hpp>
+#include <reloc/reloc_ptr.hpp>
+#include <reloc/pinned_ptr.hpp>
+#include "z_reloc.hpp"
+#include "worker_pool.hpp"
+
+namespace z_reloc {
+
+namespace detail {
+
+struct parallel_block {
+    const unsigned char* in;
+    std::size_t in_size;
+    const unsigned char* dict;
+    std::size_t dict_size;
+    unsigned char* out;
+    std::size_t out_capacity;
+    std::size_t out_size;
+    int level;
+    bool last;
+    unsigned long adler;
+    int result;
+};
+
+// ワーカーで実行される
+inline void deflate_parallel_block(void* p) {
+    parallel_block& b = *static_cast<parallel_block*>(p);
+    b.adler = zlibpp::adler32(1, b.in, b.in_size);
+
+    zlibpp::deflate_stream ds(b.level, -zlibpp::MAX_WINDOW_BITS, zlibpp::DEFAULT_MEM_LEVEL);
+    if (!ds) {
+        b.result = zlibpp::MEM_ERROR;
+        return;
+    }
+    if (b.dict_size != 0) {
+        b.result = ds.set_dictionary(b.dict, b.dict_size);
+        if (b.result != zlibpp::OK) return;
+    }
+    ds->next_in = b.in;
+    ds->avail_in = b.in_size;
+    ds->next_out = b.out;
+    ds->avail_out = b.out_capacity;
+    const int result = ds.deflate(b.last ? zlibpp::FINISH : zlibpp::SYNC_FLUSH);
+    b.out_size = ds->total_out;
+
+    if (b.last) {
+        b.result = result == zlibpp::STREAM_END ? zlibpp::OK : zlibpp::BUF_ERROR;
+    } else {
+        // 出力が一杯だと、フラッシュし切れていない可能性がある
+        b.result = result == zlibpp::OK && ds->avail_in == 0 && ds->avail_out != 0 ? result : zlibpp::BUF_ERROR;
+    }
+}
+
+// deflateInit が書き出すのと同じ zlib のヘッダ
+inline unsigned int zlib_header(int level) {
+    if (level == zlibpp::DEFAULT_COMPRESSION) level = 6;
+    const unsigned int flags = level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+    unsigned int h = (0x78 << 8) | (flags << 6);
+    h += 31 - h % 31;
+    return h;
+}
+
+// 入力を block_size 毎に分けて並列に圧縮し、1 つの zlib ストリームにする。
+// independent なら前のブロックを辞書にせず、各ブロックを単独で展開できるようにする。
+// blocks には各ブロックの情報が残る (out は出力の中の位置ではないので使えない)。
+template<class Pool>
+sized_ptr deflate_blocks(Pool& pool, worker_pool& workers, const void* in, std::size_t in_size,
+    int level, std::size_t block_size, bool independent, std::vector<parallel_block>& blocks) {
+
+    const std::size_t window_size = 32 * 1024;
+    const unsigned char* const src = static_cast<const unsigned char*>(in);
+    // 空の入力も 1 つのブロックにする
+    const std::size_t n = in_size == 0 ? 1 : (in_size + block_size - 1) / block_size;
+    blocks.resize(n);
+
+    // ヘッダ 2 バイト, 各ブロック, Adler-32 の 4 バイト
+    std::size_t out_size = 2 + 4;
+    const zlibpp::stream_ptr none;
+    for (std::size_t i = 0; i < n; i++) {
+        parallel_block& b = blocks[i];
+        const std::size_t offset = i * block_size;
+        b.in = src + offset;
+        b.in_size = i + 1 < n ? block_size : in_size - offset;
+        b.dict_size = i == 0 || independent ? 0 : window_size;
+        b.dict = b.in - b.dict_size;
+        // ストリームが無い時の、最も保守的な上限に SYNC_FLUSH の分を足したもの
+        b.out_capacity = zlibpp::deflate_bound(none, b.in_size) + 8;
+        b.out_size = 0;
+        b.level = level;
+        b.last = i + 1 == n;
+        b.adler = 1;
+        b.result = zlibpp::OK;
+        out_size += b.out_capacity;
+    }
+
+    reloc::reloc_ptr p = pool.allocate(out_size);
+    if (!p) return sized_ptr();
+
+    unsigned long adler = 1;
+    std::size_t pos = 2;
+    {
+        reloc::pinned_ptr pin = p.pin();
+        unsigned char* const out = static_cast<unsigned char*>(pin.get());
+
+        std::size_t offset = 2;
+        for (std::size_t i = 0; i < n; i++) {
+            blocks[i].out = out + offset;
+            offset += blocks[i].out_capacity;
+        }
+        worker_pool::task_group group;
+        for (std::size_t i = 0; i < n; i++) {
+            workers.post(group, &deflate_parallel_block, &blocks[i]);
+        }
+        workers.wait(group);
+
+        for (std::size_t i = 0; i < n; i++) {
+            if (blocks[i].result != zlibpp::OK) {
+                pin.reset();
+                pool.deallocate(p);
+                throw blocks[i].result;
+            }
+        }
+
+        const unsigned int h = zlib_header(level);
+        out[0] = static_cast<unsigned char>(h >> 8);
+        out[1] = static_cast<unsigned char>(h);
+        for (std::size_t i = 0; i < n; i++) {
+            const parallel_block& b = blocks[i];
+            std::memmove(out + pos, b.out, b.out_size);
+            pos += b.out_size;
+            adler = zlibpp::adler32_combine(adler, b.adler, b.in_size);
+        }
+        out[pos++] = static_cast<unsigned char>(adler >> 24);
+        out[pos++] = static_cast<unsigned char>(adler >> 16);
+        out[pos++] = static_cast<unsigned char>(adler >> 8);
+        out[pos++] = static_cast<unsigned char>(adler);
+    }
+
+    p = pool.reallocate(p, pos);
+    sized_ptr sp = { p, pos };
+    return sp;
+}
+
+}
+
+// 出力は入力全体の deflateBound 程度の領域を 1 つ確保して、ワーカー毎に区切って書き込み、
+// 最後に詰めて縮める。プールの操作は全てこの関数を呼んだスレッドで行う。
+// 入力が block_size 以下なら普通の deflate と同じ。
+template<class Pool>
+sized_ptr deflate_parallel(Pool& pool, worker_pool& workers, const void* in, std::size_t in_size,
+    int level = zlibpp::BEST_COMPRESSION, std::size_t block_size = 128 * 1024) {
+
+    if (block_size < 32 * 1024) block_size = 32 * 1024;
+    if (in_size <= block_size) return deflate(pool, in, in_size, 0, 1.5f, level);
+
+    std::vector<detail::parallel_block> blocks;
+    return detail::deflate_blocks(pool, workers, in, in_size, level, block_size, false, blocks);
+}
+
+}
+
+#endif // Z_RELOC_PARALLEL_HPP_INCLUDED
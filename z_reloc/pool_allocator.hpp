@@ -0,0 +1,73 @@
+#ifndef Z_RELOC_POOL_ALLOCATOR_HPP_INCLUDED
+#define Z_RELOC_POOL_ALLOCATOR_HPP_INCLUDED
+
+#include <cstddef>
+#include <new>
+
+#include <zlibpp/zlibpp.hpp>
+#include <reloc/reloc_ptr.hpp>
+#include <reloc/pinned_ptr.hpp>
+
+// zlib の内部状態を reloc_pool から確保するアロケータ
+//
+//     z_reloc::pool_allocator<Pool> pa(pool);
+//     zlibpp::allocator a = pa.get();
+//     z_reloc::sized_ptr sp = z_reloc::deflate(pool, in, size, 0, 1.5f, level, &a);
+//
+// 確保した領域はストリームが破棄されるまでピンされたままになるので、
+// その間はリロケーションの妨げになる。
+
+namespace z_reloc {
+
+template<class Pool>
+class pool_allocator {
+    Pool& pool_;
+
+    // 確保した領域の先頭に置いて、解放する時に使う
+    struct header {
+        reloc::reloc_ptr handle;
+        reloc::pinned_ptr pin;
+    };
+    // zlib に渡す領域のアライメントを保つため、ヘッダは 16 バイト単位で取る
+    static std::size_t header_size() {
+        return (sizeof(header) + 15) / 16 * 16;
+    }
+
+    static void* do_alloc(void* opaque, std::size_t size) {
+        Pool& pool = static_cast<pool_allocator*>(opaque)->pool_;
+        reloc::reloc_ptr handle;
+        try {
+            handle = pool.allocate(header_size() + size);
+        } catch (...) {
+            return 0;
+        }
+        if (!handle) return 0;
+        reloc::pinned_ptr pin = handle.pin();
+        header* h = new (pin.get()) header();
+        h->handle = handle;
+        h->pin = pin;
+        return static_cast<unsigned char*>(pin.get()) + header_size();
+    }
+    static void do_free(void* opaque, void* p) {
+        Pool& pool = static_cast<pool_allocator*>(opaque)->pool_;
+        header* h = reinterpret_cast<header*>(static_cast<unsigned char*>(p) - header_size());
+        const reloc::reloc_ptr handle = h->handle;
+        h->~header();
+        pool.deallocate(handle);
+    }
+
+    pool_allocator(const pool_allocator&);
+    pool_allocator& operator=(const pool_allocator&);
+
+public:
+    explicit pool_allocator(Pool& pool) : pool_(pool) { }
+
+    zlibpp::allocator get() {
+        zlibpp::allocator a = { &pool_allocator::do_alloc, &pool_allocator::do_free, this };
+        return a;
+    }
+};
+
+}
+
+#endif // Z_RELOC_POOL_ALLOCATOR_HPP_INCLUDED
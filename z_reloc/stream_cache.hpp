@@ -0,0 +1,216 @@
+#ifndef Z_RELOC_STREAM_CACHE_HPP_INCLUDED
+#define Z_RELOC_STREAM_CACHE_HPP_INCLUDED
+
+// 使い終わった zlib のストリームを reset して取っておき、
+// 同じ設定 (レベル, window_bits) のストリームが必要になった時に使い回す。
+// 小さいデータを何度も圧縮する場合に、deflateInit での内部状態の確保と初期化を省ける。
+//
+//     z_reloc::stream_cache cache;
+//     for (...) {
+//         z_reloc::sized_ptr p = z_reloc::deflate(pool, cache, in, size);
+//     }
+//
+// stream_cache はスレッドセーフではないので、スレッド毎に用意して使う。
+
+#include <cstddef>
+#include <vector>
+
+#include <zlibpp/zlibpp.hpp>
+#include "z_reloc.hpp"
+
+namespace z_reloc {
+
+class stream_cache {
+    enum kind { deflate_kind, inflate_kind };
+
+    struct entry {
+        int kind;
+        int level;
+        int window_bits;
+        zlibpp::stream_ptr::move_type stream;
+    };
+    std::vector<entry> entries_;
+    std::size_t capacity_;
+    const zlibpp::allocator* alloc_;
+
+    std::size_t hits_;
+    std::size_t misses_;
+
+    stream_cache(const stream_cache&);
+    stream_cache& operator=(const stream_cache&);
+
+    bool take(int kind, int level, int window_bits, zlibpp::stream_ptr& sp) {
+        // 最近戻されたものから探す
+        for (std::size_t i = entries_.size(); i != 0; i--) {
+            const entry& e = entries_[i - 1];
+            if (e.kind == kind && e.level == level && e.window_bits == window_bits) {
+                sp.reset(e.stream);
+                entries_.erase(entries_.begin() + (i - 1));
+                ++hits_;
+                return true;
+            }
+        }
+        ++misses_;
+        return false;
+    }
+
+    void put(int kind, int level, int window_bits, zlibpp::stream_ptr& sp) {
+        if (capacity_ == 0) {
+            sp.reset();
+            return;
+        }
+        // 一杯なら一番古いものを捨てる
+        if (entries_.size() >= capacity_) {
+            zlibpp::stream_ptr old(entries_.front().stream);
+            entries_.erase(entries_.begin());
+        }
+        entry e = { kind, level, window_bits, sp.release() };
+        entries_.push_back(e);
+    }
+
+public:
+    // capacity 個を超えたら古いものから破棄する。
+    // alloc はこのキャッシュが作る全てのストリームで使う。
+    explicit stream_cache(std::size_t capacity = 8, const zlibpp::allocator* alloc = 0)
+        : capacity_(capacity), alloc_(alloc), hits_(0), misses_(0) {
+        entries_.reserve(capacity);
+    }
+    ~stream_cache() {
+        clear();
+    }
+
+    // リセット済みのストリームを取り出す。無ければ新しく作る。
+    void acquire_deflate(zlibpp::stream_ptr& sp, int level, int window_bits = zlibpp::MAX_WINDOW_BITS) {
+        if (take(deflate_kind, level, window_bits, sp)) return;
+        zlibpp::deflate_init2(sp, level, window_bits, zlibpp::DEFAULT_MEM_LEVEL, alloc_);
+    }
+    void acquire_inflate(zlibpp::stream_ptr& sp, int window_bits = zlibpp::MAX_WINDOW_BITS) {
+        if (take(inflate_kind, 0, window_bits, sp)) return;
+        zlibpp::inflate_init2(sp, window_bits, alloc_);
+    }
+
+    // 使い終わったストリームを戻す。sp は空になる。
+    // 途中で失敗したストリームでも reset できれば使い回す。
+    void release_deflate(zlibpp::stream_ptr& sp, int level, int window_bits = zlibpp::MAX_WINDOW_BITS) {
+        if (!sp) return;
+        if (zlibpp::deflate_reset(sp) != zlibpp::OK) {
+            sp.reset();
+            return;
+        }
+        put(deflate_kind, level, window_bits, sp);
+    }
+    void release_inflate(zlibpp::stream_ptr& sp, int window_bits = zlibpp::MAX_WINDOW_BITS) {
+        if (!sp) return;
+        if (zlibpp::inflate_reset(sp) != zlibpp::OK) {
+            sp.reset();
+            return;
+        }
+        put(inflate_kind, 0, window_bits, sp);
+    }
+
+    void clear() {
+        for (std::size_t i = 0; i < entries_.size(); i++) {
+            zlibpp::stream_ptr sp(entries_[i].stream);
+        }
+        entries_.clear();
+    }
+
+    std::size_t size() const { return entries_.size(); }
+    std::size_t capacity() const { return capacity_; }
+    std::size_t hits() const { return hits_; }
+    std::size_t misses() const { return misses_; }
+};
+
+// stream_cache から借りて、スコープを抜けたら戻すストリーム
+class cached_deflate_stream {
+    stream_cache& cache_;
+    zlibpp::stream_ptr sp_;
+    int level_;
+    int window_bits_;
+
+    cached_deflate_stream(const cached_deflate_stream&);
+    cached_deflate_stream& operator=(const cached_deflate_stream&);
+
+public:
+    cached_deflate_stream(stream_cache& cache, int level, int window_bits = zlibpp::MAX_WINDOW_BITS)
+        : cache_(cache), level_(level), window_bits_(window_bits) {
+        cache_.acquire_deflate(sp_, level_, window_bits_);
+    }
+    ~cached_deflate_stream() {
+        cache_.release_deflate(sp_, level_, window_bits_);
+    }
+
+    int deflate(int flush) {
+        return zlibpp::deflate(sp_, flush);
+    }
+    std::size_t bound(std::size_t source_len) const {
+        return zlibpp::deflate_bound(sp_, source_len);
+    }
+
+    zlibpp::stream* get() const { return sp_.get(); }
+    zlibpp::stream* operator->() const { return sp_.get(); }
+    zlibpp::stream& operator*() const { return *sp_; }
+
+    typedef zlibpp::stream_ptr cached_deflate_stream::*unspecified_bool_type;
+    operator unspecified_bool_type() const {
+        return sp_ ? &cached_deflate_stream::sp_ : 0;
+    }
+};
+
+class cached_inflate_stream {
+    stream_cache& cache_;
+    zlibpp::stream_ptr sp_;
+    int window_bits_;
+
+    cached_inflate_stream(const cached_inflate_stream&);
+    cached_inflate_stream& operator=(const cached_inflate_stream&);
+
+public:
+    explicit cached_inflate_stream(stream_cache& cache, int window_bits = zlibpp::MAX_WINDOW_BITS)
+        : cache_(cache), window_bits_(window_bits) {
+        cache_.acquire_inflate(sp_, window_bits_);
+    }
+    ~cached_inflate_stream() {
+        cache_.release_inflate(sp_, window_bits_);
+    }
+
+    int inflate(int flush) {
+        return zlibpp::inflate(sp_, flush);
+    }
+
+    zlibpp::stream* get() const { return sp_.get(); }
+    zlibpp::stream* operator->() const { return sp_.get(); }
+    zlibpp::stream& operator*() const { return *sp_; }
+
+    typedef zlibpp::stream_ptr cached_inflate_stream::*unspecified_bool_type;
+    operator unspecified_bool_type() const {
+        return sp_ ? &cached_inflate_stream::sp_ : 0;
+    }
+};
+
+// cache のストリームを使う deflate, inflate。
+// 引数の意味は z_reloc.hpp の deflate, inflate と同じ。
+template<class Pool>
+sized_ptr deflate(Pool& pool, stream_cache& cache, const void* in, std::size_t in_size,
+    std::size_t out_init_size = 0, float rate = 1.5f, int level = zlibpp::BEST_COMPRESSION) {
+
+    if (level != zlibpp::NO_COMPRESSION && looks_incompressible(in, in_size)) level = zlibpp::NO_COMPRESSION;
+    cached_deflate_stream ds(cache, level);
+    if (!ds) throw zlibpp::MEM_ERROR;
+    if (out_init_size == 0) out_init_size = ds.bound(in_size);
+    return detail::zlib_reloc(pool, in, in_size, out_init_size, rate, ds, &cached_deflate_stream::deflate);
+}
+
+template<class Pool>
+sized_ptr inflate(Pool& pool, stream_cache& cache, const void* in, std::size_t in_size,
+    std::size_t out_init_size = 0, float rate = 1.5f) {
+
+    cached_inflate_stream is(cache);
+    if (!is) throw zlibpp::MEM_ERROR;
+    if (out_init_size == 0) out_init_size = detail::estimate_inflate_size(in, in_size);
+    return detail::zlib_reloc(pool, in, in_size, out_init_size, rate, is, &cached_inflate_stream::inflate);
+}
+
+}
+
+#endif // Z_RELOC_STREAM_CACHE_HPP_INCLUDED
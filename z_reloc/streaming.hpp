@@ -0,0 +1,232 @@
+#ifndef Z_RELOC_STREAMING_HPP_INCLUDED
+#define Z_RELOC_STREAMING_HPP_INCLUDED
+
+// 入力を少しずつ渡して、出力を少しずつ取り出す圧縮･展開
+//
+//     z_reloc::deflater<Pool> d(pool, zlibpp::BEST_SPEED);
+//     while (n = fread(buf, 1, sizeof(buf), in)) {
+//         const char* p = buf;
+//         while (n != 0) {
+//             const std::size_t m = d.write(p, n);
+//             p += m; n -= m;
+//             // 出力が溜まったら書き出す
+//             while (std::size_t k = d.read(out, sizeof(out))) fwrite(out, 1, k, fp);
+//         }
+//     }
+//     while (!d.finish()) { ... read ... }
+//     while (std::size_t k = d.read(out, sizeof(out))) fwrite(out, 1, k, fp);
+//
+// 出力は chunk_size 毎のプールの領域に書き込まれる。
+// 読み出されていない領域が max_chunks 個に達すると write はそれ以上入力を受け付けないので、
+// プールの使用量は chunk_size * (max_chunks + 1) 程度に収まる。
+// 書き込み中以外は出力の領域をピンしないので、リロケーションの邪魔にならない。
+
+#include <cstddef>
+#include <cstring>
+#include <deque>
+
+#include <zlibpp/zlibpp.hpp>
+#include <reloc/reloc_ptr.hpp>
+#include <reloc/pinned_ptr.hpp>
+#include "z_reloc.hpp"
+
+namespace z_reloc {
+
+namespace detail {
+
+template<class Pool>
+class stream_coder {
+public:
+    typedef int (*coder_func)(const zlibpp::stream_ptr& sp, int flush);
+
+private:
+    Pool& pool_;
+    coder_func func_;
+    std::size_t chunk_size_;
+    std::size_t max_chunks_;
+
+    // 書き終わって読み出されるのを待っている領域
+    std::deque<sized_ptr> chunks_;
+    std::size_t read_pos_;
+    std::size_t pending_;
+
+    // 書き込み中の領域
+    reloc::reloc_ptr current_;
+    std::size_t current_size_;
+
+    bool finished_;
+
+    stream_coder(const stream_coder&);
+    stream_coder& operator=(const stream_coder&);
+
+    bool prepare() {
+        if (current_) return true;
+        if (chunks_.size() >= max_chunks_) return false;
+        current_ = pool_.allocate(chunk_size_);
+        current_size_ = 0;
+        return current_;
+    }
+    void push_current(std::size_t size) {
+        if (size == 0) {
+            pool_.deallocate(current_);
+        } else {
+            if (size != chunk_size_) current_ = pool_.reallocate(current_, size);
+            const sized_ptr sp = { current_, size };
+            chunks_.push_back(sp);
+            pending_ += size;
+        }
+        current_ = reloc::reloc_ptr();
+        current_size_ = 0;
+    }
+
+    int run(int flush) {
+        reloc::pinned_ptr pin = current_.pin();
+        sp->next_out = static_cast<unsigned char*>(pin.get()) + current_size_;
+        sp->avail_out = chunk_size_ - current_size_;
+        const int result = func_(sp, flush);
+        current_size_ = chunk_size_ - sp->avail_out;
+        sp->next_out = 0;
+        sp->avail_out = 0;
+        return result;
+    }
+
+protected:
+    zlibpp::stream_ptr sp;
+
+    stream_coder(Pool& pool, coder_func func, std::size_t chunk_size, std::size_t max_chunks)
+        : pool_(pool), func_(func), chunk_size_(chunk_size == 0 ? 1 : chunk_size),
+          max_chunks_(max_chunks == 0 ? 1 : max_chunks),
+          read_pos_(0), pending_(0), current_size_(0), finished_(false) { }
+
+    ~stream_coder() {
+        pool_.deallocate(current_);
+        for (std::size_t i = 0; i < chunks_.size(); i++) {
+            pool_.deallocate(chunks_[i].ptr);
+        }
+    }
+
+public:
+    // in から最大 size バイトを入力として使い、使ったバイト数を返す。
+    // 出力が溜まっているか、プールから確保できない場合は size より少なくなる。
+    // zlib がエラーを返した場合は例外を投げる。
+    std::size_t write(const void* in, std::size_t size) {
+        if (!sp) throw zlibpp::MEM_ERROR;
+        if (finished_ || size == 0) return 0;
+
+        sp->next_in = in;
+        sp->avail_in = size;
+        while (sp->avail_in != 0 && prepare()) {
+            const int result = run(zlibpp::NO_FLUSH);
+            if (result == zlibpp::STREAM_END) {
+                // 入力の途中でストリームが終わった
+                finished_ = true;
+                push_current(current_size_);
+                break;
+            }
+            if (result != zlibpp::OK && result != zlibpp::BUF_ERROR) throw result;
+            if (current_size_ == chunk_size_) push_current(chunk_size_);
+            else if (result == zlibpp::BUF_ERROR) break;
+        }
+        const std::size_t used = size - sp->avail_in;
+        sp->next_in = 0;
+        sp->avail_in = 0;
+        return used;
+    }
+
+    // 入力の終わりを伝える。
+    // ストリームの最後まで出力できれば true を返す。
+    // false なら、出力が溜まっているかプールから確保できないので、
+    // 出力を読み出してからもう一度呼ぶこと。
+    bool finish() {
+        if (!sp) throw zlibpp::MEM_ERROR;
+        while (!finished_ && prepare()) {
+            const int result = run(zlibpp::FINISH);
+            if (result == zlibpp::STREAM_END) {
+                finished_ = true;
+                push_current(current_size_);
+                break;
+            }
+            if (result != zlibpp::OK && result != zlibpp::BUF_ERROR) throw result;
+            // 出力に余裕があるのに進まないのは、入力が途中で切れている
+            if (current_size_ != chunk_size_) throw zlibpp::BUF_ERROR;
+            push_current(chunk_size_);
+        }
+        return finished_;
+    }
+
+    // 溜まっている出力を最大 size バイト out へコピーし、コピーしたバイト数を返す。
+    // 読み終わった領域はプールへ返す。
+    std::size_t read(void* out, std::size_t size) {
+        unsigned char* dst = static_cast<unsigned char*>(out);
+        std::size_t copied = 0;
+        while (copied < size && !chunks_.empty()) {
+            const sized_ptr& c = chunks_.front();
+            const std::size_t n = c.size - read_pos_ < size - copied ? c.size - read_pos_ : size - copied;
+            {
+                reloc::pinned_ptr pin = c.ptr.pin();
+                std::memcpy(dst + copied, static_cast<const unsigned char*>(pin.get()) + read_pos_, n);
+            }
+            copied += n;
+            read_pos_ += n;
+            pending_ -= n;
+            if (read_pos_ == c.size) {
+                pool_.deallocate(c.ptr);
+                chunks_.pop_front();
+                read_pos_ = 0;
+            }
+        }
+        return copied;
+    }
+
+    // 書き終わった領域を 1 つ、コピーせずに取り出す。
+    // 取り出した領域は呼び出し側で解放すること。
+    // read の途中だった領域は取り出せない。
+    bool pop(sized_ptr& chunk) {
+        if (chunks_.empty() || read_pos_ != 0) return false;
+        chunk = chunks_.front();
+        chunks_.pop_front();
+        pending_ -= chunk.size;
+        return true;
+    }
+
+    // 読み出されていない出力のバイト数
+    std::size_t pending() const { return pending_; }
+    // ストリームの最後まで出力した
+    bool finished() const { return finished_; }
+    // 最後まで出力して、全て読み出した
+    bool done() const { return finished_ && chunks_.empty(); }
+
+    std::size_t total_in() const { return sp ? sp->total_in : 0; }
+    std::size_t total_out() const { return sp ? sp->total_out : 0; }
+
+    typedef zlibpp::stream_ptr stream_coder::*unspecified_bool_type;
+    operator unspecified_bool_type() const {
+        return sp ? &stream_coder::sp : 0;
+    }
+};
+
+}
+
+template<class Pool>
+class deflater : public detail::stream_coder<Pool> {
+public:
+    explicit deflater(Pool& pool, int level = zlibpp::BEST_COMPRESSION,
+        std::size_t chunk_size = 64 * 1024, std::size_t max_chunks = 4, const zlibpp::allocator* alloc = 0)
+        : detail::stream_coder<Pool>(pool, &zlibpp::deflate, chunk_size, max_chunks) {
+        zlibpp::deflate_init(this->sp, level, alloc);
+    }
+};
+
+template<class Pool>
+class inflater : public detail::stream_coder<Pool> {
+public:
+    explicit inflater(Pool& pool,
+        std::size_t chunk_size = 64 * 1024, std::size_t max_chunks = 4, const zlibpp::allocator* alloc = 0)
+        : detail::stream_coder<Pool>(pool, &zlibpp::inflate, chunk_size, max_chunks) {
+        zlibpp::inflate_init(this->sp, alloc);
+    }
+};
+
+}
+
+#endif // Z_RELOC_STREAMING_HPP_INCLUDED
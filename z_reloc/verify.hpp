@@ -0,0 +1,95 @@
+#ifndef Z_RELOC_VERIFY_HPP_INCLUDED
+#define Z_RELOC_VERIFY_HPP_INCLUDED
+
+// 圧縮データを展開できるかどうかだけを調べる
+//
+//     z_reloc::verifier v;
+//     for (...) {
+//         const z_reloc::verify_result r = v.verify(p.ptr.pin().get(), p.size);
+//         if (r.result != zlibpp::OK) ...
+//         r.size; r.adler; r.crc;
+//     }
+//
+// 展開したデータは小さな作業用のバッファに上書きしながら捨てるので、プールは使わない。
+// zlib 形式と gzip 形式のトレーラのチェックサムは zlib が確認する。
+// verifier はストリームと作業用のバッファを使い回すので、たくさん調べる時は 1 つを使い続けるとよい。
+
+#include <cstddef>
+#include <vector>
+
+#include <zlibpp/zlibpp.hpp>
+
+namespace z_reloc {
+
+// verify で求めるチェックサム
+enum {
+    verify_adler32 = 1,
+    verify_crc32 = 2
+};
+
+struct verify_result {
+    // 最後まで展開できて、後ろに余計なデータが無ければ zlibpp::OK。
+    // 途中で終わっていれば zlibpp::BUF_ERROR、壊れていれば zlibpp::DATA_ERROR など。
+    int result;
+    // 展開後の大きさ (result が OK でなければ、そこまでに展開できた分)
+    std::size_t size;
+    // 展開後のデータの Adler-32 と CRC-32 (求めなかったものは初期値の 1, 0 のまま)
+    unsigned long adler;
+    unsigned long crc;
+};
+
+class verifier {
+    zlibpp::inflate_stream is_;
+    std::vector<unsigned char> window_;
+
+    verifier(const verifier&);
+    verifier& operator=(const verifier&);
+
+public:
+    // window_bits は zlibpp::inflate_init2 と同じで、デフォルトでは zlib 形式と gzip 形式を自動で判別する。
+    explicit verifier(std::size_t window_size = 32 * 1024, int window_bits = zlibpp::MAX_WINDOW_BITS + 32)
+        : is_(window_bits), window_(window_size == 0 ? 1 : window_size) { }
+
+    // checksums は verify_adler32, verify_crc32 の組み合わせ。
+    // 0 でもトレーラのチェックサムは zlib が確認するので、壊れていれば分かる。
+    verify_result verify(const void* in, std::size_t in_size, int checksums = verify_adler32 | verify_crc32) {
+        verify_result r = { zlibpp::OK, 0, 1, 0 };
+        if (!is_) {
+            r.result = zlibpp::MEM_ERROR;
+            return r;
+        }
+        if ((r.result = is_.reset()) != zlibpp::OK) return r;
+
+        unsigned char* const w = &window_[0];
+        is_->next_in = in;
+        is_->avail_in = in_size;
+        while (true) {
+            is_->next_out = w;
+            is_->avail_out = window_.size();
+            const int result = is_.inflate(zlibpp::NO_FLUSH);
+            const std::size_t n = static_cast<unsigned char*>(is_->next_out) - w;
+            if (checksums & verify_adler32) r.adler = zlibpp::adler32(r.adler, w, n);
+            if (checksums & verify_crc32) r.crc = zlibpp::crc32(r.crc, w, n);
+            r.size += n;
+
+            if (result == zlibpp::STREAM_END) {
+                r.result = is_->avail_in == 0 ? zlibpp::OK : zlibpp::DATA_ERROR;
+                break;
+            }
+            if (result != zlibpp::OK) {
+                r.result = result;
+                break;
+            }
+        }
+        return r;
+    }
+};
+
+inline verify_result verify(const void* in, std::size_t in_size, int checksums = verify_adler32 | verify_crc32) {
+    verifier v;
+    return v.verify(in, in_size, checksums);
+}
+
+}
+
+#endif // Z_RELOC_VERIFY_HPP_INCLUDED
@@ -0,0 +1,157 @@
+#ifndef Z_RELOC_WORKER_POOL_HPP_INCLUDED
+#define Z_RELOC_WORKER_POOL_HPP_INCLUDED
+
+// 固定数のスレッドで関数を実行するだけのいい加減なスレッドプール (pthread のみ)
+//
+//     z_reloc::worker_pool workers(z_reloc::worker_pool::hardware_concurrency());
+//     workers.post(func, arg);
+//     workers.wait();
+//
+// 他の用途 (deflate_queue など) と共有している時は、task_group で自分が post したものだけを待つ。
+//
+//     z_reloc::worker_pool::task_group group;
+//     workers.post(group, func, arg);
+//     workers.wait(group);
+//
+// reloc_pool はスレッドセーフではないので、ワーカーの中でプールを操作してはいけない。
+// プールの操作は post, wait を呼ぶスレッドで行い、ワーカーにはピンしたアドレスだけを渡す。
+
+#include <cstddef>
+#include <deque>
+#include <vector>
+#include <pthread.h>
+#include <unistd.h>
+
+namespace z_reloc {
+
+class worker_pool {
+public:
+    // post した関数のうち、終わっていないものの数を数える
+    class task_group {
+        std::size_t pending_;
+        friend class worker_pool;
+
+        task_group(const task_group&);
+        task_group& operator=(const task_group&);
+
+    public:
+        task_group() : pending_(0) { }
+    };
+
+private:
+    struct task {
+        void (*func)(void*);
+        void* arg;
+        task_group* group;
+    };
+    std::deque<task> tasks_;
+    std::vector<pthread_t> threads_;
+    pthread_mutex_t mutex_;
+    pthread_cond_t posted_;
+    pthread_cond_t done_;
+    // キューにあるものと実行中のものの数
+    std::size_t pending_;
+    bool stop_;
+
+    worker_pool(const worker_pool&);
+    worker_pool& operator=(const worker_pool&);
+
+    static void* run(void* p) {
+        worker_pool* self = static_cast<worker_pool*>(p);
+        pthread_mutex_lock(&self->mutex_);
+        while (true) {
+            while (self->tasks_.empty() && !self->stop_) {
+                pthread_cond_wait(&self->posted_, &self->mutex_);
+            }
+            if (self->tasks_.empty()) break;
+            const task t = self->tasks_.front();
+            self->tasks_.pop_front();
+
+            pthread_mutex_unlock(&self->mutex_);
+            t.func(t.arg);
+            pthread_mutex_lock(&self->mutex_);
+
+            if (t.group) --t.group->pending_;
+            // 全体と task_group のどちらを待っているか分からないので、group の分も起こす
+            if (--self->pending_ == 0 || (t.group && t.group->pending_ == 0)) {
+                pthread_cond_broadcast(&self->done_);
+            }
+        }
+        pthread_mutex_unlock(&self->mutex_);
+        return 0;
+    }
+
+public:
+    // threads が 0 なら、post したスレッドでその場で実行する
+    explicit worker_pool(std::size_t threads) : pending_(0), stop_(false) {
+        pthread_mutex_init(&mutex_, 0);
+        pthread_cond_init(&posted_, 0);
+        pthread_cond_init(&done_, 0);
+        for (std::size_t i = 0; i < threads; i++) {
+            pthread_t th;
+            if (pthread_create(&th, 0, &worker_pool::run, this) != 0) break;
+            threads_.push_back(th);
+        }
+    }
+    // キューに残っているものを全て実行してから終了する
+    ~worker_pool() {
+        pthread_mutex_lock(&mutex_);
+        stop_ = true;
+        pthread_cond_broadcast(&posted_);
+        pthread_mutex_unlock(&mutex_);
+        for (std::size_t i = 0; i < threads_.size(); i++) {
+            pthread_join(threads_[i], 0);
+        }
+        pthread_cond_destroy(&done_);
+        pthread_cond_destroy(&posted_);
+        pthread_mutex_destroy(&mutex_);
+    }
+
+    static std::size_t hardware_concurrency() {
+        const long n = sysconf(_SC_NPROCESSORS_ONLN);
+        return n > 0 ? static_cast<std::size_t>(n) : 1;
+    }
+
+    std::size_t size() const { return threads_.size(); }
+
+    // func は例外を投げてはいけない
+    void post(void (*func)(void*), void* arg) {
+        post(func, arg, 0);
+    }
+    // group を渡すと、wait(group) でこれを待てる
+    void post(task_group& group, void (*func)(void*), void* arg) {
+        post(func, arg, &group);
+    }
+
+    // post した全ての関数が終わるまで待つ
+    void wait() {
+        pthread_mutex_lock(&mutex_);
+        while (pending_ != 0) pthread_cond_wait(&done_, &mutex_);
+        pthread_mutex_unlock(&mutex_);
+    }
+    // group に post した関数が全て終わるまで待つ。他の関数は待たない
+    void wait(task_group& group) {
+        pthread_mutex_lock(&mutex_);
+        while (group.pending_ != 0) pthread_cond_wait(&done_, &mutex_);
+        pthread_mutex_unlock(&mutex_);
+    }
+
+private:
+    void post(void (*func)(void*), void* arg, task_group* group) {
+        if (threads_.empty()) {
+            func(arg);
+            return;
+        }
+        const task t = { func, arg, group };
+        pthread_mutex_lock(&mutex_);
+        tasks_.push_back(t);
+        ++pending_;
+        if (group) ++group->pending_;
+        pthread_cond_signal(&posted_);
+        pthread_mutex_unlock(&mutex_);
+    }
+};
+
+}
+
+#endif // Z_RELOC_WORKER_POOL_HPP_INCLUDED
@@ -2,15 +2,24 @@
 #define Z_RELOC_Z_RELOC_HPP_INCLUDED
 
 #include <cstddef>
+#include <cassert>
 #include <utility>
 #include <new>
 #include <exception>
+#include <cmath>
 
 #include <zlibpp/zlibpp.hpp>
 #include <reloc/reloc_ptr.hpp>
 
 // reloc_pool を使って zlib 圧縮を行うクラス
 
+// deflate は、入力のサンプルのエントロピー (ビット/バイト) がこの値以上なら
+// 圧縮できないデータとみなし、一致の探索をせずに無圧縮ブロックで出力する。
+// 8 より大きくすれば判定しない。
+#ifndef Z_RELOC_INCOMPRESSIBLE_ENTROPY
+#define Z_RELOC_INCOMPRESSIBLE_ENTROPY 7.5
+#endif
+
 namespace z_reloc {
 
 struct sized_ptr {
@@ -20,10 +29,80 @@ struct sized_ptr {
 
 namespace detail {
 
+// deflate の圧縮率の上限 (1 バイトの繰り返しで約 1032:1)
+const std::size_t max_deflate_ratio = 1032;
+
+// 展開後のサイズを推測する。あくまでヒントで、確保できなければ zlib_reloc が小さく始め直す。
+inline std::size_t estimate_inflate_size(const void* in, std::size_t in_size) {
+    const std::size_t max = static_cast<std::size_t>(-1);
+    const unsigned char* const p = static_cast<const unsigned char*>(in);
+    // gzip ならトレーラの ISIZE (展開後のサイズを 2^32 で割った余り) を使う。
+    // 壊れているかもしれないので、圧縮率の上限を超える値は上限で切る。
+    if (in_size >= 18 && p[0] == 0x1f && p[1] == 0x8b) {
+        const unsigned char* const t = p + in_size - 4;
+        const std::size_t isize =
+            static_cast<std::size_t>(t[0]) | static_cast<std::size_t>(t[1]) << 8 |
+            static_cast<std::size_t>(t[2]) << 16 | static_cast<std::size_t>(t[3]) << 24;
+        const std::size_t limit = in_size > max / max_deflate_ratio ? max : in_size * max_deflate_ratio;
+        if (isize != 0) return isize < limit ? isize : limit;
+    }
+    // 分からないので、圧縮率を 1/4 程度とみなしておく
+    return in_size > max / 4 ? max : in_size * 4;
+}
+
+// 最初に確保するサイズ (ヒント) を確保できなかった時に、代わりに確保するサイズ
+const std::size_t fallback_out_size = 8;
+
+// 判定するのはこのサイズ以上の入力だけ
+const std::size_t probe_min_size = 4 * 1024;
+
+}
+
+// 入力全体から均等に最大 4KB を取り出して、バイトの出現頻度からエントロピーを求める。
+// 既に圧縮されたデータや暗号化されたデータは 8 に近くなる。
+inline double sample_entropy(const void* in, std::size_t size) {
+    const unsigned char* const p = static_cast<const unsigned char*>(in);
+    const std::size_t windows = 8;
+    const std::size_t window_size = 512;
+
+    std::size_t counts[256] = { 0 };
+    std::size_t n = 0;
+    if (size <= windows * window_size) {
+        for (std::size_t i = 0; i < size; i++) ++counts[p[i]];
+        n = size;
+    } else {
+        const std::size_t step = (size - window_size) / (windows - 1);
+        for (std::size_t w = 0; w < windows; w++) {
+            const unsigned char* q = p + w * step;
+            for (std::size_t i = 0; i < window_size; i++) ++counts[q[i]];
+        }
+        n = windows * window_size;
+    }
+    if (n == 0) return 0.0;
+
+    double e = 0.0;
+    for (std::size_t i = 0; i < 256; i++) {
+        if (counts[i] == 0) continue;
+        const double f = static_cast<double>(counts[i]) / n;
+        e -= f * std::log(f);
+    }
+    return e / std::log(2.0);
+}
+
+inline bool looks_incompressible(const void* in, std::size_t size) {
+    return size >= detail::probe_min_size && sample_entropy(in, size) >= Z_RELOC_INCOMPRESSIBLE_ENTROPY;
+}
+
+namespace detail {
+
+// 例外を投げない版。
+// zlib がエラーを返したら result にその値を入れて、空の sized_ptr を返す。
+// プールが足りなければ result は zlibpp::OK のままで、requested に確保できなかったサイズを入れて空の sized_ptr を返す。
+// 成功すれば result は zlibpp::OK、requested は 0 になる。
 template<class Stream, class StreamFunc, class Pool>
 sized_ptr zlib_reloc(Pool& pool,
     const void* in, std::size_t in_size, std::size_t out_init_size, float rate,
-    Stream& s, StreamFunc func) {
+    Stream& s, StreamFunc func, int& result, std::size_t& requested) {
 
     assert(rate > 1.0f);
 
@@ -45,7 +124,10 @@ sized_ptr zlib_reloc(Pool& pool,
             }
         }
         void reallocate(std::size_t size) {
-            p_ = pool_.reallocate(p_, size);
+            const reloc::reloc_ptr p = pool_.reallocate(p_, size);
+            // 失敗しても元の領域は残っているので、ここで解放しておく
+            if (!p) pool_.deallocate(p_);
+            p_ = p;
         }
         reloc::reloc_ptr get() const { return p_; }
         reloc::reloc_ptr release() {
@@ -55,8 +137,19 @@ sized_ptr zlib_reloc(Pool& pool,
         }
     };
 
-    scoped_ptr p(pool, pool.allocate(out_init_size));
-    if (!p.get()) return sized_ptr();
+    result = zlibpp::OK;
+    requested = 0;
+    // out_init_size はヒントなので、reclaimer などを使ってまで確保はしない。
+    // 確保できなければ小さく始めて伸ばしていく
+    scoped_ptr p(pool, pool.try_allocate(out_init_size));
+    if (!p.get()) {
+        if (out_init_size > fallback_out_size) out_init_size = fallback_out_size;
+        p.reset(pool.allocate(out_init_size));
+    }
+    if (!p.get()) {
+        requested = out_init_size;
+        return sized_ptr();
+    }
 
     reloc::pinned_ptr pin = p.get().pin();
 
@@ -68,11 +161,12 @@ sized_ptr zlib_reloc(Pool& pool,
     typedef unsigned char byte;
 
     while (true) {
-        const int result = (s.*func)(s->avail_in == 0 ? zlibpp::FINISH : zlibpp::NO_FLUSH);
-        if (result == zlibpp::STREAM_END) break;
+        const int r = (s.*func)(s->avail_in == 0 ? zlibpp::FINISH : zlibpp::NO_FLUSH);
+        if (r == zlibpp::STREAM_END) break;
 
-        if (result != zlibpp::OK) {
-            throw result;
+        if (r != zlibpp::OK) {
+            result = r;
+            return sized_ptr();
         }
 
         if (s->avail_out == 0) {
@@ -82,7 +176,10 @@ sized_ptr zlib_reloc(Pool& pool,
 
             pin.reset();
             p.reallocate(newsize);
-            if (!p.get()) return sized_ptr();
+            if (!p.get()) {
+                requested = newsize;
+                return sized_ptr();
+            }
             pin = p.get().pin();
 
             s->next_out = static_cast<byte*>(pin.get()) + oldsize;
@@ -91,25 +188,54 @@ sized_ptr zlib_reloc(Pool& pool,
     }
     pin.reset();
     p.reallocate(s->total_out);
+    if (!p.get()) {
+        requested = s->total_out;
+        return sized_ptr();
+    }
     sized_ptr sp = { p.release(), s->total_out };
     return sp;
 }
 
+// zlib がエラーを返した場合は例外を投げる
+template<class Stream, class StreamFunc, class Pool>
+sized_ptr zlib_reloc(Pool& pool,
+    const void* in, std::size_t in_size, std::size_t out_init_size, float rate,
+    Stream& s, StreamFunc func) {
+
+    int result;
+    std::size_t requested;
+    const sized_ptr sp = zlib_reloc(pool, in, in_size, out_init_size, rate, s, func, result, requested);
+    if (result != zlibpp::OK) throw result;
+    return sp;
+}
+
 }
 
+// out_init_size が 0 なら、deflateBound で求めた出力サイズの上限を最初に確保するので、
+// 途中で reallocate することはない。最後に一度だけ縮める。
+// 上限を確保できなければ、小さく始めて伸ばしていく。
+// alloc を指定すると、zlib の内部状態をそこから確保する (pool_allocator.hpp, zlibpp::arena)
+// looks_incompressible なら level に関係なく無圧縮で出力するので、出力は入力より少し大きくなる。
 template<class Pool>
 sized_ptr deflate(Pool& pool, const void* in, std::size_t in_size,
-    std::size_t out_init_size = 8, float rate = 1.5f, int level = zlibpp::BEST_COMPRESSION) {
+    std::size_t out_init_size = 0, float rate = 1.5f, int level = zlibpp::BEST_COMPRESSION,
+    const zlibpp::allocator* alloc = 0) {
 
-    zlibpp::deflate_stream ds(level);
+    if (level != zlibpp::NO_COMPRESSION && looks_incompressible(in, in_size)) level = zlibpp::NO_COMPRESSION;
+    zlibpp::deflate_stream ds(level, alloc);
+    if (!ds) throw ds.init_result();
+    if (out_init_size == 0) out_init_size = ds.bound(in_size);
     return detail::zlib_reloc(pool, in, in_size, out_init_size, rate, ds, &zlibpp::deflate_stream::deflate);
 }
 
+// out_init_size は展開後のサイズのヒントで、0 なら入力から推測する
 template<class Pool>
 sized_ptr inflate(Pool& pool, const void* in, std::size_t in_size,
-    std::size_t out_init_size = 8, float rate = 1.5f) {
+    std::size_t out_init_size = 0, float rate = 1.5f, const zlibpp::allocator* alloc = 0) {
 
-    zlibpp::inflate_stream is;
+    zlibpp::inflate_stream is(alloc);
+    if (!is) throw is.init_result();
+    if (out_init_size == 0) out_init_size = detail::estimate_inflate_size(in, in_size);
     return detail::zlib_reloc(pool, in, in_size, out_init_size, rate, is, &zlibpp::inflate_stream::inflate);
 }
 
@@ -0,0 +1,410 @@
+// z_reloc のベンチマーク
+//
+//     z_reloc_bench [size]
+//
+// 出力バッファの初期サイズの決め方によって、reallocate の回数や
+// リアロケート･リロケーションでコピーされたバイト数がどう変わるかを計測する。
+// また、deflate_parallel のスレッド数毎のスループットと、
+// 小さなレコードを 1 つずつ deflate する場合と deflate_batch の 1 秒あたりのレコード数を計測する。
+// codec.hpp の Codec 毎の圧縮率と速度も比べる。
+// 圧縮できないデータが 3 割混ざっている場合に、判定して無圧縮で出力するとどれだけ速くなるかも計測する。
+// deflate_indexed の出力を inflate と inflate_parallel で展開する速さも比べる。
+// verifier で展開できるかどうかだけを調べる速さを、プールに展開する場合と比べる。
+// 大きさの違う入力を deflate_queue で圧縮した時のスループットと、依頼してから受け取るまでの時間も計測する。
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+#include <z_reloc/z_reloc.hpp>
+#include <z_reloc/parallel.hpp>
+#include <z_reloc/chain.hpp>
+#include <z_reloc/batch.hpp>
+#include <z_reloc/codec.hpp>
+#include <z_reloc/lz.hpp>
+#include <z_reloc/async.hpp>
+#include <z_reloc/block_index.hpp>
+#include <z_reloc/verify.hpp>
+#include <reloc/reloc_pool.hpp>
+#include <reloc/detail/clock.hpp>
+
+using namespace reloc;
+
+// コピーされたバイト数を数える Traits
+struct counting_traits {
+    static std::size_t copied;
+
+    static void construct(void* p) { }
+    static void destroy(void* p) { }
+    static void move_left(const void* src, std::size_t size, void* dst) {
+        copied += size;
+        std_traits::move_left(src, size, dst);
+    }
+    static void move_right(const void* src, std::size_t size, void* dst) {
+        copied += size;
+        std_traits::move_right(src, size, dst);
+    }
+    static void copy(const void* src, std::size_t size, void* dst) {
+        copied += size;
+        std_traits::copy(src, size, dst);
+    }
+};
+std::size_t counting_traits::copied = 0;
+
+// reallocate の回数を数える Observer
+struct counting_observer : null_observer {
+    static std::size_t reallocated_count;
+    static void reallocated(const void*, std::size_t, const void*, const void*, std::size_t) {
+        ++reallocated_count;
+    }
+};
+std::size_t counting_observer::reallocated_count = 0;
+
+typedef reloc_pool<16, counting_traits, counting_observer> pool_t;
+
+// それなりに圧縮できるデータ
+std::vector<unsigned char> make_data(std::size_t size) {
+    static const char* const words[] = {
+        "reloc", "pool", "pinned", "allocate", "relocate", "zlib", "deflate", "inflate",
+    };
+    std::vector<unsigned char> v;
+    v.reserve(size);
+    std::srand(1);
+    while (v.size() < size) {
+        const char* w = words[std::rand() % 8];
+        while (*w && v.size() < size) v.push_back(*w++);
+        if (v.size() < size) v.push_back(static_cast<unsigned char>(std::rand() % 4 == 0 ? '\n' : ' '));
+    }
+    return v;
+}
+
+void reset_counters() {
+    counting_traits::copied = 0;
+    counting_observer::reallocated_count = 0;
+}
+
+void report(const char* name, uint64_t elapsed, std::size_t in_size, std::size_t out_size) {
+    std::printf("%-28s %8.3f ms  %10lu -> %10lu  reallocate: %4lu  copied: %10lu bytes\n",
+        name, elapsed / 1e6, (unsigned long)in_size, (unsigned long)out_size,
+        (unsigned long)counting_observer::reallocated_count, (unsigned long)counting_traits::copied);
+}
+
+template<class F>
+void bench(const char* name, pool_t& pool, const std::vector<unsigned char>& data, F f) {
+    reset_counters();
+    const uint64_t t = detail::now_ns();
+    z_reloc::sized_ptr sp = f(pool, &data[0], data.size());
+    report(name, detail::now_ns() - t, data.size(), sp.size);
+    pool.deallocate(sp.ptr);
+}
+
+struct deflate_grow {
+    z_reloc::sized_ptr operator()(pool_t& pool, const void* in, std::size_t size) const {
+        return z_reloc::deflate(pool, in, size, 8);
+    }
+};
+struct deflate_bound {
+    z_reloc::sized_ptr operator()(pool_t& pool, const void* in, std::size_t size) const {
+        return z_reloc::deflate(pool, in, size);
+    }
+};
+struct inflate_grow {
+    const void* in;
+    std::size_t size;
+    z_reloc::sized_ptr operator()(pool_t& pool, const void*, std::size_t) const {
+        return z_reloc::inflate(pool, in, size, 8);
+    }
+};
+struct inflate_hint {
+    const void* in;
+    std::size_t size;
+    std::size_t hint;
+    z_reloc::sized_ptr operator()(pool_t& pool, const void*, std::size_t) const {
+        return z_reloc::inflate(pool, in, size, hint);
+    }
+};
+
+void bench_chain(const char* name, pool_t& pool, const std::vector<unsigned char>& data) {
+    reset_counters();
+    z_reloc::chain c;
+    const uint64_t t = detail::now_ns();
+    z_reloc::deflate_chain(pool, c, &data[0], data.size());
+    report(name, detail::now_ns() - t, data.size(), c.size);
+    z_reloc::deallocate(pool, c);
+}
+
+void run(pool_t& pool, const std::vector<unsigned char>& data) {
+    bench("deflate (init 8, grow 1.5x)", pool, data, deflate_grow());
+    bench("deflate (deflateBound)", pool, data, deflate_bound());
+    bench_chain("deflate (chain 64KB)", pool, data);
+
+    z_reloc::sized_ptr compressed = z_reloc::deflate(pool, &data[0], data.size());
+    std::vector<unsigned char> c(compressed.size);
+    {
+        pinned_ptr pin = compressed.ptr.pin();
+        const unsigned char* p = static_cast<const unsigned char*>(pin.get());
+        c.assign(p, p + compressed.size);
+    }
+    pool.deallocate(compressed.ptr);
+
+    inflate_grow ig = { &c[0], c.size() };
+    bench("inflate (init 8, grow 1.5x)", pool, data, ig);
+    inflate_hint ie = { &c[0], c.size(), 0 };
+    bench("inflate (estimated)", pool, data, ie);
+    inflate_hint ih = { &c[0], c.size(), data.size() };
+    bench("inflate (caller hint)", pool, data, ih);
+}
+
+void run_parallel(pool_t& pool, const std::vector<unsigned char>& data) {
+    std::size_t threads[] = { 0, 1, 2, 4, z_reloc::worker_pool::hardware_concurrency() };
+    for (std::size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+        z_reloc::worker_pool workers(threads[i]);
+        const uint64_t t = detail::now_ns();
+        z_reloc::sized_ptr sp = z_reloc::deflate_parallel(pool, workers, &data[0], data.size());
+        const uint64_t elapsed = detail::now_ns() - t;
+        std::printf("deflate_parallel (%2lu threads) %8.3f ms  %10lu -> %10lu  %8.1f MB/s\n",
+            (unsigned long)threads[i], elapsed / 1e6, (unsigned long)data.size(), (unsigned long)sp.size,
+            data.size() / (elapsed / 1e9) / (1024 * 1024));
+        pool.deallocate(sp.ptr);
+    }
+}
+
+void run_batch(pool_t& pool, const std::vector<unsigned char>& data) {
+    const std::size_t record_size = 200;
+    const std::size_t n = data.size() / record_size;
+    std::vector<z_reloc::batch_input> in(n);
+    for (std::size_t i = 0; i < n; i++) {
+        in[i].data = &data[i * record_size];
+        in[i].size = record_size;
+    }
+    std::vector<z_reloc::sized_ptr> out(n);
+
+    const uint64_t t = detail::now_ns();
+    for (std::size_t i = 0; i < n; i++) {
+        out[i] = z_reloc::deflate(pool, in[i].data, in[i].size, 0, 1.5f, zlibpp::DEFAULT_COMPRESSION);
+    }
+    const uint64_t elapsed = detail::now_ns() - t;
+    std::printf("deflate per record           %8.3f ms  %10.0f records/s\n", elapsed / 1e6, n / (elapsed / 1e9));
+    for (std::size_t i = 0; i < n; i++) pool.deallocate(out[i].ptr);
+
+    std::size_t threads[] = { 0, 2, z_reloc::worker_pool::hardware_concurrency() };
+    for (std::size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+        z_reloc::worker_pool workers(threads[i]);
+        const uint64_t t = detail::now_ns();
+        const bool ok = z_reloc::deflate_batch(pool, &in[0], n, &out[0], zlibpp::DEFAULT_COMPRESSION, &workers);
+        const uint64_t elapsed = detail::now_ns() - t;
+        // 失敗した時は out に何も入っていない
+        if (!ok) {
+            std::printf("deflate_batch (%2lu threads)   pool exhausted\n", (unsigned long)threads[i]);
+            continue;
+        }
+        std::printf("deflate_batch (%2lu threads)   %8.3f ms  %10.0f records/s\n",
+            (unsigned long)threads[i], elapsed / 1e6, n / (elapsed / 1e9));
+        for (std::size_t i = 0; i < n; i++) pool.deallocate(out[i].ptr);
+    }
+}
+
+template<class Codec>
+void bench_codec(const char* name, pool_t& pool, const std::vector<unsigned char>& data, int level) {
+    const uint64_t t = detail::now_ns();
+    z_reloc::sized_ptr c = z_reloc::compress<Codec>(pool, &data[0], data.size(), 0, 1.5f, level);
+    const uint64_t t2 = detail::now_ns();
+    z_reloc::sized_ptr d = z_reloc::decompress<Codec>(pool, c.ptr.pin().get(), c.size, data.size());
+    const uint64_t t3 = detail::now_ns();
+    const double mb = data.size() / (1024.0 * 1024.0);
+    std::printf("%-28s ratio %6.2f%%  compress %8.1f MB/s  decompress %8.1f MB/s\n",
+        name, 100.0 * c.size / data.size(), mb / ((t2 - t) / 1e9), mb / ((t3 - t2) / 1e9));
+    pool.deallocate(c.ptr);
+    pool.deallocate(d.ptr);
+}
+
+void run_mixed(pool_t& pool, const std::vector<unsigned char>& data) {
+    const std::size_t payload = 64 * 1024;
+    const std::size_t n = data.size() / payload;
+    std::vector<unsigned char> random(data.size());
+    for (std::size_t i = 0; i < random.size(); i++) random[i] = static_cast<unsigned char>(std::rand() >> 4);
+
+    for (int probe = 0; probe < 2; probe++) {
+        std::size_t out = 0;
+        const uint64_t t = detail::now_ns();
+        for (std::size_t i = 0; i < n; i++) {
+            const unsigned char* in = i % 10 < 3 ? &random[i * payload] : &data[i * payload];
+            // compress<zlib_codec> は判定しない
+            const z_reloc::sized_ptr sp = probe
+                ? z_reloc::deflate(pool, in, payload)
+                : z_reloc::compress<z_reloc::zlib_codec>(pool, in, payload, 0, 1.5f, zlibpp::BEST_COMPRESSION);
+            out += sp.size;
+            pool.deallocate(sp.ptr);
+        }
+        std::printf("mixed 30%% incompressible (%s) %8.3f ms  %10lu -> %10lu\n",
+            probe ? "probe" : "no probe", (detail::now_ns() - t) / 1e6,
+            (unsigned long)(n * payload), (unsigned long)out);
+    }
+}
+
+void run_codecs(pool_t& pool, const std::vector<unsigned char>& data) {
+    bench_codec<z_reloc::zlib_codec>("zlib (level 1)", pool, data, zlibpp::BEST_SPEED);
+    bench_codec<z_reloc::zlib_codec>("zlib (level 6)", pool, data, zlibpp::DEFAULT_COMPRESSION);
+    bench_codec<z_reloc::zlib_codec>("zlib (level 9)", pool, data, zlibpp::BEST_COMPRESSION);
+    bench_codec<z_reloc::raw_deflate_codec>("raw deflate (level 6)", pool, data, zlibpp::DEFAULT_COMPRESSION);
+    bench_codec<z_reloc::gzip_codec>("gzip (level 6)", pool, data, zlibpp::DEFAULT_COMPRESSION);
+    bench_codec<z_reloc::lz_codec>("lz", pool, data, 0);
+}
+
+void run_indexed(pool_t& pool, const std::vector<unsigned char>& data) {
+    z_reloc::worker_pool workers(z_reloc::worker_pool::hardware_concurrency());
+    z_reloc::block_index index;
+    const z_reloc::sized_ptr c = z_reloc::deflate_indexed(pool, workers, &data[0], data.size(), index,
+        zlibpp::DEFAULT_COMPRESSION);
+    const double mb = data.size() / (1024.0 * 1024.0);
+    std::printf("deflate_indexed              %lu blocks  %10lu -> %10lu\n",
+        (unsigned long)index.blocks.size(), (unsigned long)data.size(), (unsigned long)c.size);
+
+    {
+        const reloc::pinned_ptr pin = c.ptr.pin();
+        uint64_t t = detail::now_ns();
+        z_reloc::sized_ptr d = z_reloc::inflate(pool, pin.get(), c.size, data.size());
+        std::printf("inflate                      %8.1f MB/s\n", mb / ((detail::now_ns() - t) / 1e9));
+        pool.deallocate(d.ptr);
+
+        t = detail::now_ns();
+        d = z_reloc::inflate_parallel(pool, workers, pin.get(), c.size, index);
+        std::printf("inflate_parallel (%2lu threads) %8.1f MB/s\n",
+            (unsigned long)workers.size(), mb / ((detail::now_ns() - t) / 1e9));
+        pool.deallocate(d.ptr);
+
+        // 真ん中のブロックだけ
+        t = detail::now_ns();
+        d = z_reloc::inflate_block(pool, pin.get(), c.size, index, index.find(data.size() / 2));
+        std::printf("inflate_block (1 block)      %8.3f ms\n", (detail::now_ns() - t) / 1e6);
+        pool.deallocate(d.ptr);
+    }
+    pool.deallocate(c.ptr);
+}
+
+void run_verify(pool_t& pool, const std::vector<unsigned char>& data) {
+    const z_reloc::sized_ptr c = z_reloc::deflate(pool, &data[0], data.size(), 0, 1.5f, zlibpp::DEFAULT_COMPRESSION);
+    const double mb = data.size() / (1024.0 * 1024.0);
+    {
+        const reloc::pinned_ptr pin = c.ptr.pin();
+        uint64_t t = detail::now_ns();
+        const z_reloc::sized_ptr d = z_reloc::inflate(pool, pin.get(), c.size, data.size());
+        pool.deallocate(d.ptr);
+        std::printf("inflate + deallocate         %8.1f MB/s\n", mb / ((detail::now_ns() - t) / 1e9));
+
+        z_reloc::verifier v;
+        t = detail::now_ns();
+        const z_reloc::verify_result r = v.verify(pin.get(), c.size);
+        std::printf("verify (adler32 + crc32)     %8.1f MB/s  %s\n",
+            mb / ((detail::now_ns() - t) / 1e9), r.result == zlibpp::OK ? "ok" : "error");
+        t = detail::now_ns();
+        v.verify(pin.get(), c.size, 0);
+        std::printf("verify (no checksum)         %8.1f MB/s\n", mb / ((detail::now_ns() - t) / 1e9));
+
+        t = detail::now_ns();
+        const unsigned long crc = zlibpp::crc32(0, &data[0], data.size());
+        const uint64_t t2 = detail::now_ns();
+        const unsigned long adler = zlibpp::adler32(1, &data[0], data.size());
+        const uint64_t t3 = detail::now_ns();
+        std::printf("crc32 %8.1f MB/s  adler32 %8.1f MB/s  (%08lx %08lx)\n",
+            mb / ((t2 - t) / 1e9), mb / ((t3 - t2) / 1e9), crc, adler);
+    }
+    pool.deallocate(c.ptr);
+}
+
+// 200B, 4KB, 64KB の入力を混ぜる
+std::size_t mixed_size(std::size_t i) {
+    static const std::size_t sizes[] = { 200, 200, 200, 4 * 1024, 4 * 1024, 64 * 1024 };
+    return sizes[i % (sizeof(sizes) / sizeof(sizes[0]))];
+}
+
+void report_latency(const char* name, uint64_t elapsed, std::size_t bytes, std::vector<uint64_t>& latency) {
+    std::sort(latency.begin(), latency.end());
+    std::printf("%-28s %8.3f ms  %8.1f MB/s  latency p50 %8.3f ms  p99 %8.3f ms\n",
+        name, elapsed / 1e6, bytes / (elapsed / 1e9) / (1024 * 1024),
+        latency[latency.size() / 2] / 1e6, latency[latency.size() * 99 / 100] / 1e6);
+}
+
+void run_async(pool_t& pool, const std::vector<unsigned char>& data) {
+    std::vector<std::size_t> offsets;
+    std::size_t bytes = 0;
+    for (std::size_t i = 0; bytes + mixed_size(i) <= data.size(); i++) {
+        offsets.push_back(bytes);
+        bytes += mixed_size(i);
+    }
+    const std::size_t n = offsets.size();
+    std::vector<uint64_t> submitted(n);
+    std::vector<uint64_t> latency;
+
+    {
+        // 比較用に、呼び出したスレッドで 1 つずつ圧縮する
+        const uint64_t t = detail::now_ns();
+        for (std::size_t i = 0; i < n; i++) {
+            const uint64_t t = detail::now_ns();
+            const z_reloc::sized_ptr sp = z_reloc::deflate(pool, &data[offsets[i]], mixed_size(i),
+                0, 1.5f, zlibpp::DEFAULT_COMPRESSION);
+            latency.push_back(detail::now_ns() - t);
+            pool.deallocate(sp.ptr);
+        }
+        report_latency("deflate (blocking)", detail::now_ns() - t, bytes, latency);
+    }
+
+    std::size_t threads[] = { 1, 2, z_reloc::worker_pool::hardware_concurrency() };
+    for (std::size_t k = 0; k < sizeof(threads) / sizeof(threads[0]); k++) {
+        z_reloc::worker_pool workers(threads[k]);
+        z_reloc::deflate_queue<pool_t> q(pool, workers, zlibpp::DEFAULT_COMPRESSION);
+        std::vector<z_reloc::deflate_completion> done;
+        latency.clear();
+
+        const uint64_t t = detail::now_ns();
+        std::size_t i = 0;
+        while (i < n || q.pending() != 0) {
+            // 断られたら受け取ってから続ける
+            while (i < n) {
+                submitted[i] = detail::now_ns();
+                if (!q.submit(&data[offsets[i]], mixed_size(i), &submitted[i])) break;
+                ++i;
+            }
+            done.clear();
+            q.wait(done);
+            const uint64_t now = detail::now_ns();
+            for (std::size_t j = 0; j < done.size(); j++) {
+                latency.push_back(now - *static_cast<uint64_t*>(done[j].user));
+                pool.deallocate(done[j].out.ptr);
+            }
+        }
+        char name[64];
+        std::sprintf(name, "deflate_queue (%2lu threads)", (unsigned long)threads[k]);
+        report_latency(name, detail::now_ns() - t, bytes, latency);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    const std::size_t size = argc > 1 ? std::atoi(argv[1]) : 1024 * 1024;
+    const std::vector<unsigned char> data = make_data(size);
+
+    const std::size_t pool_size = size * 4 + 1024 * 1024;
+    void* mem = std::malloc(pool_size);
+    pool_t pool(mem, pool_size);
+
+    std::printf("empty pool:\n");
+    run(pool, data);
+    run_parallel(pool, data);
+    run_batch(pool, data);
+    run_codecs(pool, data);
+    run_mixed(pool, data);
+    run_indexed(pool, data);
+    run_verify(pool, data);
+    run_async(pool, data);
+
+    // プール全体を断片化させておき、大きな領域を確保するとリロケーションが起きるようにする
+    std::vector<reloc_ptr> holes;
+    while (reloc_ptr p = pool.allocate(pool_size / 512)) holes.push_back(p);
+    for (std::size_t i = 0; i < holes.size(); i += 2) pool.deallocate(holes[i]);
+
+    std::printf("fragmented pool:\n");
+    run(pool, data);
+
+    for (std::size_t i = 1; i < holes.size(); i += 2) pool.deallocate(holes[i]);
+    std::free(mem);
+}
@@ -5,11 +5,14 @@
 #include <zlibpp/zlibpp.cpp>
 
 #include <cassert>
+#include <cstring>
+#include <new>
 
-int main() {
+void test1() {
     char* p = new char[100];
 
     zlibpp::deflate_stream ds(zlibpp::BEST_COMPRESSION);
+    assert(ds.bound(3) >= 3 && ds.bound(3) <= 100);
     ds->next_in = "abc";
     ds->avail_in = 3;
     ds->next_out = p;
@@ -18,6 +21,7 @@ int main() {
     assert(ds->avail_in == 0);
     assert(ds->total_in == 3);
     assert(ds->total_out + ds->avail_out == 100);
+    assert(ds->total_out <= ds.bound(3));
 
     char buf[3];
     zlibpp::inflate_stream is;
@@ -34,3 +38,208 @@ int main() {
     delete[] p;
 }
 
+// 確保したバイト数を数えながら new で確保する
+std::size_t allocated = 0;
+std::size_t freed = 0;
+void* counting_alloc(void* opaque, std::size_t size) {
+    assert(opaque == &allocated);
+    allocated += size;
+    std::size_t* p = static_cast<std::size_t*>(::operator new(size + 16));
+    *p = size;
+    return reinterpret_cast<char*>(p) + 16;
+}
+void counting_free(void* opaque, void* p) {
+    std::size_t* h = reinterpret_cast<std::size_t*>(static_cast<char*>(p) - 16);
+    freed += *h;
+    ::operator delete(h);
+}
+
+void test2() {
+    char buf[100];
+    char buf2[4];
+    zlibpp::allocator a = { counting_alloc, counting_free, &allocated };
+    {
+        zlibpp::deflate_stream ds(zlibpp::BEST_SPEED, &a);
+        assert(allocated > 0);
+        ds->next_in = "abcd";
+        ds->avail_in = 4;
+        ds->next_out = buf;
+        ds->avail_out = sizeof(buf);
+        assert(ds.deflate(zlibpp::FINISH) == zlibpp::STREAM_END);
+    }
+    assert(allocated == freed);
+
+    // 固定のバッファから確保する
+    static double mem[512 * 1024 / sizeof(double)];
+    zlibpp::arena ar(mem, sizeof(mem));
+    zlibpp::allocator a2 = ar.get();
+    {
+        zlibpp::inflate_stream is(&a2);
+        assert(ar.used() > 0);
+        is->next_in = buf;
+        is->avail_in = sizeof(buf);
+        is->next_out = buf2;
+        is->avail_out = 4;
+        assert(is.inflate(zlibpp::FINISH) == zlibpp::STREAM_END);
+        assert(std::memcmp(buf2, "abcd", 4) == 0);
+    }
+    ar.reset();
+
+    // バッファが足りない
+    zlibpp::arena small(mem, 64);
+    zlibpp::allocator a3 = small.get();
+    zlibpp::deflate_stream ds(zlibpp::BEST_SPEED, &a3);
+    assert(!ds);
+}
+
+void test3() {
+    // gzip 形式で圧縮し、reset して同じストリームで 2 回展開する
+    char p[100];
+    zlibpp::deflate_stream ds(zlibpp::BEST_SPEED, zlibpp::MAX_WINDOW_BITS + 16, zlibpp::DEFAULT_MEM_LEVEL);
+    ds->next_in = "gzip";
+    ds->avail_in = 4;
+    ds->next_out = p;
+    ds->avail_out = sizeof(p);
+    assert(ds.deflate(zlibpp::FINISH) == zlibpp::STREAM_END);
+    assert(static_cast<unsigned char>(p[0]) == 0x1f && static_cast<unsigned char>(p[1]) == 0x8b);
+
+    zlibpp::inflate_stream is(zlibpp::MAX_WINDOW_BITS + 32);
+    for (int i = 0; i < 2; i++) {
+        char buf[4];
+        is->next_in = p;
+        is->avail_in = ds->total_out;
+        is->next_out = buf;
+        is->avail_out = sizeof(buf);
+        assert(is.inflate(zlibpp::FINISH) == zlibpp::STREAM_END);
+        assert(is->total_out == 4);
+        assert(std::memcmp(buf, "gzip", 4) == 0);
+        assert(is.reset() == zlibpp::OK);
+        assert(is->total_in == 0 && is->total_out == 0);
+    }
+}
+
+void test4() {
+    // 少しずつ入力してフラッシュする
+    char out[4096];
+    zlibpp::deflate_stream ds(zlibpp::BEST_SPEED);
+    const zlibpp::stream_ptr none;
+    assert(zlibpp::native_handle(none) == 0);
+    ds->next_out = out;
+    ds->avail_out = sizeof(out);
+    const char* text = "zero copy zero copy zero copy ";
+    for (int i = 0; i < 50; i++) {
+        ds->next_in = text;
+        ds->avail_in = 30;
+        assert(ds.deflate(i == 49 ? zlibpp::FINISH : zlibpp::SYNC_FLUSH) == (i == 49 ? zlibpp::STREAM_END : zlibpp::OK));
+        assert(ds->avail_in == 0);
+        assert(ds->total_in == static_cast<std::size_t>(i + 1) * 30);
+        assert(ds->total_out + ds->avail_out == sizeof(out));
+        assert(static_cast<char*>(ds->next_out) == out + ds->total_out);
+    }
+
+    char buf[1500];
+    zlibpp::inflate_stream is;
+    is->next_in = out;
+    is->avail_in = ds->total_out;
+    // 1 バイトずつ出力する
+    while (is->total_out < sizeof(buf)) {
+        is->next_out = buf + is->total_out;
+        is->avail_out = 1;
+        const int r = is.inflate(zlibpp::NO_FLUSH);
+        assert(r == zlibpp::OK || r == zlibpp::STREAM_END);
+    }
+    assert(is->total_out == 1500);
+    assert(std::memcmp(buf + 1470, text, 30) == 0);
+}
+
+void test5() {
+    char out[256];
+    zlibpp::deflate_stream ds(zlibpp::BEST_SPEED, -zlibpp::MAX_WINDOW_BITS, zlibpp::DEFAULT_MEM_LEVEL);
+    ds->next_out = out;
+    ds->avail_out = sizeof(out);
+    for (int i = 0; i < 3; i++) {
+        ds->next_in = "block";
+        ds->avail_in = 5;
+        assert(ds.deflate(i == 2 ? zlibpp::FINISH : zlibpp::FULL_FLUSH) == (i == 2 ? zlibpp::STREAM_END : zlibpp::OK));
+    }
+
+    // BLOCK を渡すとブロックの境界毎に止まる
+    char buf[15];
+    zlibpp::inflate_stream is(-zlibpp::MAX_WINDOW_BITS);
+    is->next_in = out;
+    is->avail_in = ds->total_out;
+    is->next_out = buf;
+    is->avail_out = sizeof(buf);
+    int boundaries = 0;
+    int r;
+    while ((r = is.inflate(zlibpp::BLOCK)) == zlibpp::OK) {
+        if (is.data_type() & 128) ++boundaries;
+    }
+    assert(r == zlibpp::STREAM_END);
+    assert(boundaries >= 3);
+    assert(std::memcmp(buf, "blockblockblock", 15) == 0);
+
+    // 最初のバイトを prime で渡しても同じ結果になる
+    zlibpp::inflate_stream is2(-zlibpp::MAX_WINDOW_BITS);
+    assert(is2.prime(8, static_cast<unsigned char>(out[0])) == zlibpp::OK);
+    is2->next_in = out + 1;
+    is2->avail_in = ds->total_out - 1;
+    is2->next_out = buf;
+    is2->avail_out = sizeof(buf);
+    std::memset(buf, 0, sizeof(buf));
+    assert(is2.inflate(zlibpp::FINISH) == zlibpp::STREAM_END);
+    assert(std::memcmp(buf, "blockblockblock", 15) == 0);
+}
+
+void test6() {
+    const char* text = "123456789";
+    // CRC-32 のチェック値
+    assert(zlibpp::crc32(0, text, 9) == 0xcbf43926UL);
+    assert(zlibpp::adler32(1, text, 9) == 0x091e01deUL);
+
+    const unsigned long c1 = zlibpp::crc32(0, text, 4);
+    const unsigned long c2 = zlibpp::crc32(0, text + 4, 5);
+    assert(zlibpp::crc32(c1, text + 4, 5) == 0xcbf43926UL);
+    assert(zlibpp::crc32_combine(c1, c2, 5) == 0xcbf43926UL);
+    assert(zlibpp::crc32_combine(c1, 0, 0) == c1);
+    // 長さを分けてずらしても同じ値になる
+    if (sizeof(std::size_t) >= 8 && sizeof(z_off_t) >= 8) {
+        const std::size_t len = static_cast<std::size_t>(5) << 30;
+        assert(zlibpp::crc32_combine(c1, c2, len) == ::crc32_combine(c1, c2, static_cast<z_off_t>(len)));
+    }
+}
+
+void test7() {
+    // 初期化に失敗したらストリームは空になり、その理由が分かる
+    zlibpp::deflate_stream ds(42);
+    assert(!ds && ds.init_result() == zlibpp::STREAM_ERROR);
+    assert(ds.deflate(zlibpp::FINISH) == zlibpp::MEM_ERROR);
+    zlibpp::inflate_stream is(3);
+    assert(!is && is.init_result() == zlibpp::STREAM_ERROR);
+
+    // zlib の内部状態を確保できない
+    unsigned char buf[512 + 16];
+    zlibpp::arena a(buf + (16 - reinterpret_cast<std::size_t>(buf) % 16) % 16, 512);
+    const zlibpp::allocator alloc = a.get();
+    zlibpp::stream_ptr sp;
+    assert(zlibpp::deflate_init(sp, zlibpp::BEST_SPEED, &alloc) == zlibpp::MEM_ERROR);
+    assert(!sp);
+    // ストリーム自体を確保できない
+    zlibpp::arena none(buf, 0);
+    const zlibpp::allocator alloc2 = none.get();
+    assert(zlibpp::inflate_init(sp, &alloc2) == zlibpp::MEM_ERROR);
+    assert(!sp);
+
+    zlibpp::inflate_stream ok;
+    assert(ok && ok.init_result() == zlibpp::OK);
+}
+
+int main() {
+    test1();
+    test2();
+    test3();
+    test4();
+    test5();
+    test6();
+    test7();
+}
@@ -28,73 +28,237 @@ const int BEST_SPEED = Z_BEST_SPEED;
 const int BEST_COMPRESSION = Z_BEST_COMPRESSION;
 const int DEFAULT_COMPRESSION = Z_DEFAULT_COMPRESSION;
 
+const int MAX_WINDOW_BITS = MAX_WBITS;
+const int DEFAULT_MEM_LEVEL = 8;
+
 struct stream_impl : stream {
     z_stream z;
+    // alloc.alloc が 0 ならデフォルトのアロケータを使う
+    allocator alloc;
 };
 
+voidpf zalloc(voidpf opaque, uInt items, uInt size) {
+    const allocator* a = static_cast<const allocator*>(opaque);
+    const std::size_t n = static_cast<std::size_t>(items) * size;
+    return a->alloc(a->opaque, n);
+}
+void zfree(voidpf opaque, voidpf p) {
+    const allocator* a = static_cast<const allocator*>(opaque);
+    a->free(a->opaque, p);
+}
+
+void delete_stream(stream_impl* si) {
+    if (si->alloc.alloc) {
+        const allocator a = si->alloc;
+        si->~stream_impl();
+        a.free(a.opaque, si);
+    } else {
+        delete si;
+    }
+}
+
 void deflate_end(stream* p) {
     stream_impl* si = static_cast<stream_impl*>(p);
     deflateEnd(&si->z);
-    delete si;
+    delete_stream(si);
 }
 
 void inflate_end(stream* p) {
     stream_impl* si = static_cast<stream_impl*>(p);
     inflateEnd(&si->z);
-    delete si;
+    delete_stream(si);
 }
 
-void make_stream(stream_ptr& z, void (*f)(stream* p)) {
-    stream_impl* si = new (std::nothrow) stream_impl();
-    if (!si) return;
+void make_stream(stream_ptr& z, void (*f)(stream* p), const allocator* alloc) {
+    stream_impl* si;
+    if (alloc) {
+        void* p = alloc->alloc(alloc->opaque, sizeof(stream_impl));
+        if (!p) return;
+        si = new (p) stream_impl();
+        si->alloc = *alloc;
+        si->z.zalloc = zalloc;
+        si->z.zfree = zfree;
+        si->z.opaque = &si->alloc;
+    } else {
+        si = new (std::nothrow) stream_impl();
+        if (!si) return;
+    }
     z.reset(stream_ptr(si, f).release());
 }
 
+// stream のポインタとサイズを z_stream に渡して f を呼び、進んだ分だけ stream を進める。
+// total_in, total_out は z_stream の uLong に頼らず、ここで足していく。
+// avail_in, avail_out が uInt に収まらない場合は、収まる大きさに分けて続けて呼ぶ。
 template<class F>
 int do_zlib(const stream_ptr& sp, int flush, F f) {
     if (!sp) return Z_MEM_ERROR;
 
     stream_impl* si = static_cast<stream_impl*>(sp.get());
+    z_stream& z = si->z;
+    const std::size_t max = static_cast<uInt>(-1);
 
-    si->z.next_in =
-        const_cast<Bytef*>(static_cast<const Bytef*>(si->next_in));
-    si->z.avail_in = static_cast<uInt>(si->avail_in);
-    si->z.total_in = static_cast<uLong>(si->total_in);
-    si->z.next_out = static_cast<Bytef*>(si->next_out);
-    si->z.avail_out = static_cast<uInt>(si->avail_out);
-    si->z.total_out = static_cast<uLong>(si->total_out);
+    int result;
+    while (true) {
+        const uInt in = static_cast<uInt>(si->avail_in < max ? si->avail_in : max);
+        const uInt out = static_cast<uInt>(si->avail_out < max ? si->avail_out : max);
+        z.next_in = const_cast<Bytef*>(static_cast<const Bytef*>(si->next_in));
+        z.avail_in = in;
+        z.next_out = static_cast<Bytef*>(si->next_out);
+        z.avail_out = out;
 
-    const int result = f(&si->z, flush);
+        // 入力の途中で FINISH などを渡さないようにする (BLOCK, TREES はどこで渡してもよい)
+        const bool whole = in == si->avail_in || flush == Z_BLOCK || flush == Z_TREES;
+        result = f(&z, whole ? flush : Z_NO_FLUSH);
 
-    si->next_in = si->z.next_in;
-    si->avail_in = static_cast<std::size_t>(si->z.avail_in);
-    si->total_in = static_cast<std::size_t>(si->z.total_in);
-    si->next_out = si->z.next_out;
-    si->avail_out = static_cast<std::size_t>(si->z.avail_out);
-    si->total_out = static_cast<std::size_t>(si->z.total_out);
+        const std::size_t used_in = in - z.avail_in;
+        const std::size_t used_out = out - z.avail_out;
+        si->next_in = z.next_in;
+        si->avail_in -= used_in;
+        si->total_in += used_in;
+        si->next_out = z.next_out;
+        si->avail_out -= used_out;
+        si->total_out += used_out;
 
+        if (result != Z_OK || (used_in == 0 && used_out == 0)) break;
+        // 分けた分を使い切った時だけ続ける
+        const bool more_in = z.avail_in == 0 && si->avail_in != 0;
+        const bool more_out = z.avail_out == 0 && si->avail_out != 0;
+        if (!more_in && !more_out) break;
+    }
     return result;
 }
 
-void deflate_init(stream_ptr& sp, int level) {
-    make_stream(sp, deflate_end);
-    if (!sp) return;
+// ストリームの位置を最初に戻す
+void clear_stream(stream_impl* si) {
+    si->next_in = 0;
+    si->avail_in = 0;
+    si->total_in = 0;
+    si->next_out = 0;
+    si->avail_out = 0;
+    si->total_out = 0;
+}
+
+// 初期化に失敗したストリームは使えないので捨てる
+// (z_stream の state は 0 になっているので、deflateEnd, inflateEnd を呼んでも問題ない)
+int init_result(stream_ptr& sp, int result) {
+    if (result != Z_OK) sp.reset();
+    return result;
+}
+
+int deflate_init(stream_ptr& sp, int level, const allocator* alloc) {
+    make_stream(sp, deflate_end, alloc);
+    if (!sp) return Z_MEM_ERROR;
     stream_impl* si = static_cast<stream_impl*>(sp.get());
-    deflateInit(&si->z, level);
+    return init_result(sp, deflateInit(&si->z, level));
+}
+int deflate_init2(stream_ptr& sp, int level, int window_bits, int mem_level, const allocator* alloc) {
+    make_stream(sp, deflate_end, alloc);
+    if (!sp) return Z_MEM_ERROR;
+    stream_impl* si = static_cast<stream_impl*>(sp.get());
+    return init_result(sp, deflateInit2(&si->z, level, Z_DEFLATED, window_bits, mem_level, Z_DEFAULT_STRATEGY));
 }
 int deflate(const stream_ptr& sp, int flush) {
     return do_zlib(sp, flush, ::deflate);
 }
+int deflate_reset(const stream_ptr& sp) {
+    if (!sp) return Z_MEM_ERROR;
+    stream_impl* si = static_cast<stream_impl*>(sp.get());
+    clear_stream(si);
+    return deflateReset(&si->z);
+}
+std::size_t deflate_bound(const stream_ptr& sp, std::size_t source_len) {
+    // deflateBound は uLong で計算するので、溢れる場合は自前で計算する
+    // (zlib の deflateBound の、最も保守的な場合の式と同じ)
+    if (!sp || static_cast<uLong>(source_len) != source_len) {
+        return source_len + ((source_len + 7) >> 3) + ((source_len + 63) >> 6) + 5 + 18;
+    }
+    stream_impl* si = static_cast<stream_impl*>(sp.get());
+    return static_cast<std::size_t>(deflateBound(&si->z, static_cast<uLong>(source_len)));
+}
+
+void* native_handle(const stream_ptr& sp) {
+    if (!sp) return 0;
+    return &static_cast<stream_impl*>(sp.get())->z;
+}
+
+int deflate_set_dictionary(const stream_ptr& sp, const void* dict, std::size_t dict_len) {
+    if (!sp) return Z_MEM_ERROR;
+    stream_impl* si = static_cast<stream_impl*>(sp.get());
+    return deflateSetDictionary(&si->z, static_cast<const Bytef*>(dict), static_cast<uInt>(dict_len));
+}
 
-void inflate_init(stream_ptr& sp) {
-    make_stream(sp, inflate_end);
-    if (!sp) return;
+int inflate_init(stream_ptr& sp, const allocator* alloc) {
+    make_stream(sp, inflate_end, alloc);
+    if (!sp) return Z_MEM_ERROR;
+    stream_impl* si = static_cast<stream_impl*>(sp.get());
+    return init_result(sp, inflateInit(&si->z));
+}
+int inflate_init2(stream_ptr& sp, int window_bits, const allocator* alloc) {
+    make_stream(sp, inflate_end, alloc);
+    if (!sp) return Z_MEM_ERROR;
     stream_impl* si = static_cast<stream_impl*>(sp.get());
-    inflateInit(&si->z);
+    return init_result(sp, inflateInit2(&si->z, window_bits));
 }
 int inflate(const stream_ptr& sp, int flush) {
     return do_zlib(sp, flush, ::inflate);
 }
+int inflate_reset(const stream_ptr& sp) {
+    if (!sp) return Z_MEM_ERROR;
+    stream_impl* si = static_cast<stream_impl*>(sp.get());
+    clear_stream(si);
+    return inflateReset(&si->z);
+}
+int inflate_set_dictionary(const stream_ptr& sp, const void* dict, std::size_t dict_len) {
+    if (!sp) return Z_MEM_ERROR;
+    stream_impl* si = static_cast<stream_impl*>(sp.get());
+    return inflateSetDictionary(&si->z, static_cast<const Bytef*>(dict), static_cast<uInt>(dict_len));
+}
+
+int inflate_prime(const stream_ptr& sp, int bits, int value) {
+    if (!sp) return Z_MEM_ERROR;
+    stream_impl* si = static_cast<stream_impl*>(sp.get());
+    return inflatePrime(&si->z, bits, value);
+}
+int data_type(const stream_ptr& sp) {
+    if (!sp) return 0;
+    return static_cast<stream_impl*>(sp.get())->z.data_type;
+}
+
+unsigned long adler32(unsigned long adler, const void* buf, std::size_t len) {
+    const Bytef* p = static_cast<const Bytef*>(buf);
+    // uInt に収まる単位で計算する
+    while (len != 0) {
+        const uInt n = len > 0x40000000 ? 0x40000000 : static_cast<uInt>(len);
+        adler = ::adler32(adler, p, n);
+        p += n;
+        len -= n;
+    }
+    return adler;
+}
+unsigned long adler32_combine(unsigned long adler1, unsigned long adler2, std::size_t len2) {
+    // Adler-32 の B は長さを 65521 で割った余りにしか依存しない
+    return ::adler32_combine(adler1, adler2, static_cast<z_off_t>(len2 % 65521));
+}
+unsigned long crc32(unsigned long crc, const void* buf, std::size_t len) {
+    const Bytef* p = static_cast<const Bytef*>(buf);
+    while (len != 0) {
+        const uInt n = len > 0x40000000 ? 0x40000000 : static_cast<uInt>(len);
+        crc = ::crc32(crc, p, n);
+        p += n;
+        len -= n;
+    }
+    return crc;
+}
+unsigned long crc32_combine(unsigned long crc1, unsigned long crc2, std::size_t len2) {
+    // crc1 を len2 バイト分ずらして crc2 と xor したものなので、
+    // z_off_t に収まらない長さは、crc2 を 0 にして少しずつずらしていく
+    const std::size_t max = 0x40000000;
+    while (len2 > max) {
+        crc1 = ::crc32_combine(crc1, 0, static_cast<z_off_t>(max));
+        len2 -= max;
+    }
+    return ::crc32_combine(crc1, crc2, static_cast<z_off_t>(len2));
+}
 
 }
 
@@ -30,6 +30,56 @@ extern const int BEST_SPEED;
 extern const int BEST_COMPRESSION;
 extern const int DEFAULT_COMPRESSION;
 
+// deflate_init2, inflate_init2 に渡す window_bits と mem_level
+extern const int MAX_WINDOW_BITS;
+extern const int DEFAULT_MEM_LEVEL;
+
+// zlib の内部状態やストリーム自体を確保するためのアロケータ。
+// alloc は失敗したら 0 を返すこと。
+// stream_ptr が生きている間、opaque が指すものも生きていなければならない。
+struct allocator {
+    void* (*alloc)(void* opaque, std::size_t size);
+    void (*free)(void* opaque, void* p);
+    void* opaque;
+};
+
+// 固定のバッファから順に切り出すだけのアロケータ。
+// free では何もしないので、ストリームを破棄した後に reset して使い回す。
+class arena {
+    unsigned char* buf_;
+    std::size_t size_;
+    std::size_t used_;
+
+    static void* do_alloc(void* opaque, std::size_t size) {
+        arena* a = static_cast<arena*>(opaque);
+        // 何に使われても良いように 16 バイトでアライメントしておく
+        const std::size_t n = (size + 15) / 16 * 16;
+        if (n < size || a->size_ - a->used_ < n) return 0;
+        void* p = a->buf_ + a->used_;
+        a->used_ += n;
+        return p;
+    }
+    static void do_free(void*, void*) { }
+
+    arena(const arena&);
+    arena& operator=(const arena&);
+
+public:
+    // buf は 16 バイトでアライメントされていること
+    arena(void* buf, std::size_t size)
+        : buf_(static_cast<unsigned char*>(buf)), size_(size), used_(0) { }
+
+    allocator get() {
+        allocator a = { &arena::do_alloc, &arena::do_free, this };
+        return a;
+    }
+    void reset() { used_ = 0; }
+    std::size_t used() const { return used_; }
+};
+
+// z_stream の代わりに使う。
+// avail_in, avail_out は uInt に収まらなくても良い (zlib へは分けて渡す)。
+// total_in, total_out は、deflate, inflate で進んだ分が足されていく。
 struct stream {
     const void* next_in;
     std::size_t avail_in;
@@ -89,22 +139,71 @@ public:
     }
 };
 
-extern void deflate_init(stream_ptr& sp, int level);
+// ストリームの z_stream*。
+// zlibpp に無い zlib の関数を直接呼ぶ時に使う。
+// next_in などは deflate, inflate を呼ぶ度に stream の値で上書きされる。
+extern void* native_handle(const stream_ptr& sp);
+
+// alloc が 0 なら、new と zlib のデフォルトのアロケータを使う。
+// 初期化の結果を返す。ストリームを確保できなければ MEM_ERROR、
+// level などが不正なら STREAM_ERROR で、失敗した場合 sp は空になる。
+extern int deflate_init(stream_ptr& sp, int level, const allocator* alloc = 0);
+// window_bits, mem_level は zlib の deflateInit2 と同じ
+extern int deflate_init2(stream_ptr& sp, int level, int window_bits, int mem_level, const allocator* alloc = 0);
 extern int deflate(const stream_ptr& sp, int flush);
+// 設定はそのままで、新しいストリームとして使えるようにする
+extern int deflate_reset(const stream_ptr& sp);
+// source_len バイトを圧縮した時の出力サイズの上限
+extern std::size_t deflate_bound(const stream_ptr& sp, std::size_t source_len);
+// 最初の deflate を呼ぶ前に、辞書として使うデータを設定する
+extern int deflate_set_dictionary(const stream_ptr& sp, const void* dict, std::size_t dict_len);
 
-extern void inflate_init(stream_ptr& sp);
+extern int inflate_init(stream_ptr& sp, const allocator* alloc = 0);
+extern int inflate_init2(stream_ptr& sp, int window_bits, const allocator* alloc = 0);
 extern int inflate(const stream_ptr& sp, int flush);
+extern int inflate_reset(const stream_ptr& sp);
+// zlib 形式なら inflate が NEED_DICT を返した後に、raw deflate なら最初に呼ぶ
+extern int inflate_set_dictionary(const stream_ptr& sp, const void* dict, std::size_t dict_len);
+// 次の入力の前に value の下位 bits ビットを差し込む (inflatePrime)。
+// バイト境界にないブロックの途中から展開を始める時に使う。
+extern int inflate_prime(const stream_ptr& sp, int bits, int value);
+// 最後の deflate, inflate で z_stream に設定された data_type。
+// inflate なら、最後のバイトの未使用のビット数 (下位 3 ビット) に、
+// 最後のブロックの途中なら 64、BLOCK でブロックの境界で止まったなら 128 を足したもの。
+extern int data_type(const stream_ptr& sp);
+
+// adler は前回までの値で、最初は 1
+extern unsigned long adler32(unsigned long adler, const void* buf, std::size_t len);
+// adler1, adler2 を続けたデータの Adler-32 を求める。len2 は adler2 のデータの長さ
+extern unsigned long adler32_combine(unsigned long adler1, unsigned long adler2, std::size_t len2);
+// gzip の CRC-32。crc は前回までの値で、最初は 0。
+// 計算はリンクした zlib の実装に任せる (新しい zlib ほど速い)。
+extern unsigned long crc32(unsigned long crc, const void* buf, std::size_t len);
+extern unsigned long crc32_combine(unsigned long crc1, unsigned long crc2, std::size_t len2);
 
 class deflate_stream {
     stream_ptr sp;
+    int init_result_;
 
 public:
-    deflate_stream(int level) {
-        deflate_init(sp, level);
-    }
+    deflate_stream(int level, const allocator* alloc = 0)
+        : init_result_(deflate_init(sp, level, alloc)) { }
+    deflate_stream(int level, int window_bits, int mem_level, const allocator* alloc = 0)
+        : init_result_(deflate_init2(sp, level, window_bits, mem_level, alloc)) { }
+    // deflate_init の結果。OK でなければストリームは空
+    int init_result() const { return init_result_; }
     int deflate(int flush) {
         return zlibpp::deflate(sp, flush);
     }
+    int reset() {
+        return zlibpp::deflate_reset(sp);
+    }
+    std::size_t bound(std::size_t source_len) const {
+        return zlibpp::deflate_bound(sp, source_len);
+    }
+    int set_dictionary(const void* dict, std::size_t dict_len) {
+        return zlibpp::deflate_set_dictionary(sp, dict, dict_len);
+    }
 
     stream* get() const { return sp.get(); }
     stream* operator->() const { return sp.get(); }
@@ -118,14 +217,29 @@ public:
 
 class inflate_stream {
     stream_ptr sp;
+    int init_result_;
 
 public:
-    inflate_stream() {
-        inflate_init(sp);
-    }
+    inflate_stream(const allocator* alloc = 0)
+        : init_result_(inflate_init(sp, alloc)) { }
+    explicit inflate_stream(int window_bits, const allocator* alloc = 0)
+        : init_result_(inflate_init2(sp, window_bits, alloc)) { }
+    int init_result() const { return init_result_; }
     int inflate(int flush) {
         return zlibpp::inflate(sp, flush);
     }
+    int reset() {
+        return zlibpp::inflate_reset(sp);
+    }
+    int set_dictionary(const void* dict, std::size_t dict_len) {
+        return zlibpp::inflate_set_dictionary(sp, dict, dict_len);
+    }
+    int prime(int bits, int value) {
+        return zlibpp::inflate_prime(sp, bits, value);
+    }
+    int data_type() const {
+        return zlibpp::data_type(sp);
+    }
 
     stream* get() const { return sp.get(); }
     stream* operator->() const { return sp.get(); }